@@ -5,9 +5,14 @@
 class Bitmap
 {
 public:
+    Bitmap() : width(0), height(0) {}
+
     // Load a bitmap file
+    //  Leaves the bitmap empty, with width and height 0, if the file can't be read whole
     void LoadFile(const std::string& filename)
     {
+        width = height = 0;
+        pixels.clear();
         std::fstream file;
         file.open(filename, std::ios::in | std::ios::binary);
         if (file.is_open())
@@ -23,11 +28,22 @@ public:
             file.seekg(22);
             file.read((char*)&height, sizeof(height));
             
-            if (width > 0 && height > 0)
+            if (!file)
+            {
+                std::cout << "Bitmap file too short: " << filename << std::endl;
+                width = height = 0;
+            }
+            else if (width > 0 && height > 0)
             {
                 pixels.resize(width*height);
                 file.seekg(offset);
                 file.read((char*)&pixels[0], sizeof(RGBColor)*width*height);
+                if (!file)
+                {
+                    std::cout << "Bitmap file too short: " << filename << std::endl;
+                    width = height = 0;
+                    pixels.clear();
+                }
             }
 
             file.close();
@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <memory>
+
+// Fill count values from p, 16 bytes at a time where aligned
+void FillBuffer(uint32_t* p, size_t count, uint32_t value);
+void FillBuffer(float* p, size_t count, float value);
+
+// Lazy clear of a color buffer and a depth buffer of the same size, in tiles
+//  Clear only marks the tiles: a tile is cleared when the rasterizer first draws into it,
+//  and the color of tiles nothing drew into is filled in by Resolve before the frame is presented
+// A tile left holding the clear color costs nothing more in later frames, until something draws into it:
+//  its depth is only cleared when it's drawn into, its color isn't filled again
+// Drawing threads may touch the same tile; one clears it while the others wait
+class ClearTiles
+{
+public:
+    static const int TILE_SIZE = 32;
+
+    ClearTiles() : m_color(NULL), m_depth(NULL), m_width(0), m_height(0), m_pitch(0), m_tilesX(0), m_tilesY(0), m_clearColor(0) {}
+
+    // Buffers to clear: color rows are width pixels apart, depth rows pitch floats
+    //  Their contents are taken as drawn
+    void Attach(uint32_t* color, float* depth, int width, int height, int pitch);
+    bool IsAttachedTo(const float* depth) const { return depth != NULL && depth == m_depth; }
+    bool IsAttachedTo(const uint32_t* color, const float* depth, int width, int height) const
+    {
+        return IsAttachedTo(depth) && color == m_color && width == m_width && height == m_height;
+    }
+
+    // Clear both buffers lazily
+    void Clear(uint32_t clearColor);
+    // Fill the color of tiles not drawn into since they were cleared; depth stays to be cleared
+    void Resolve();
+    // Clear whatever is still to be cleared, so that the buffers can be used without the tiles
+    void Flush();
+
+    // Called by the rasterizer before drawing pixels x1 to x2 of row y
+    void Touch(int y, int x1, int x2)
+    {
+        std::atomic<uint8_t>* row = &m_states[size_t(y / TILE_SIZE) * size_t(m_tilesX)];
+        for (int x = x1 / TILE_SIZE; x <= x2 / TILE_SIZE; ++x)
+            if (row[x].load(std::memory_order_acquire) != TILE_DRAWN)
+                Prepare(x, y / TILE_SIZE);
+    }
+
+private:
+    enum TILE_STATE
+    {
+        TILE_DRAWN,             // Holds what was drawn into it, if anything, since its buffers were last really cleared
+        TILE_CLEAR,             // Holds the clear color and nothing drawn; depth still to be cleared
+        TILE_PENDING,           // Cleared lazily: color and depth to be cleared
+        TILE_PENDING_DEPTH,     // Cleared lazily while holding the clear color: depth to be cleared
+        TILE_CLEARING,          // Being cleared by a drawing thread
+    };
+
+    uint32_t* m_color;
+    float* m_depth;
+    int m_width, m_height, m_pitch;
+    int m_tilesX, m_tilesY;
+    std::unique_ptr<std::atomic<uint8_t>[]> m_states;
+    uint32_t m_clearColor;
+
+    // Clear a tile about to be drawn into
+    void Prepare(int tileX, int tileY);
+    void FillTile(int tileX, int tileY, bool color, bool depth);
+    size_t GetNumTiles() const { return size_t(m_tilesX) * size_t(m_tilesY); }
+};
@@ -0,0 +1,73 @@
+#pragma once
+#include <future>
+
+class Renderer;
+struct PackingInfo;
+
+// List of recorded rendering commands, executed later by a renderer
+//  Draw commands keep a copy of the constants they were recorded with,
+//  so executing them doesn't depend on the renderer state at that time
+// A list can be executed again in following frames, as long as nothing it draws has changed
+//  Buffers drawn are referred to, not copied, and read as they are when executed: a draw recorded with an owner
+//  (the mesh, for meshes drawn through RecordingShaders) keeps it alive, other buffers must outlive the list
+class CommandList
+{
+public:
+    // Record any command as a function of the renderer executing it
+    void Record(const std::function<void(Renderer&)>& command) { m_commands.push_back(command); }
+    void Clear() { m_commands.clear(); }
+    void Append(const CommandList& other) { m_commands.insert(m_commands.end(), other.m_commands.begin(), other.m_commands.end()); }
+
+    bool IsEmpty() const { return m_commands.empty(); }
+    size_t GetNumCommands() const { return m_commands.size(); }
+
+    void Execute(Renderer& renderer) const
+    {
+        for (size_t i=0; i<m_commands.size(); ++i)
+            m_commands[i](renderer);
+    }
+    // Execute on another thread; the list must not be changed until the returned future is ready
+    std::future<void> ExecuteAsync(Renderer& renderer) const
+    {
+        return std::async(std::launch::async, [this, &renderer]() { Execute(renderer); });
+    }
+
+private:
+    std::vector<std::function<void(Renderer&)>> m_commands;
+};
+
+// Shaders that record draws into a command list instead of drawing right away
+//  Anything drawing through shaders (like Mesh::Draw) can be recorded by passing these instead
+template<class ShadersClass>
+class RecordingShaders
+{
+public:
+    // Draws recorded keep owner alive, when given: the holder of the buffers drawn, like a mesh
+    RecordingShaders(ShadersClass& shaders, CommandList& commands, const std::shared_ptr<const void>& owner=nullptr)
+        : m_shaders(shaders), m_commands(commands), m_owner(owner) {}
+
+    Renderer& GetRenderer() { return m_shaders.GetRenderer(); }
+
+    template<class VertexType, class IndexType>
+    void DrawTriangles(const std::vector<VertexType>& vertices, const std::vector<IndexType>& indices, bool transparency=false, const PackingInfo& packing=PackingInfo())
+    {
+        m_shaders.RecordTriangles(m_commands, vertices, indices, transparency, m_owner, packing);
+    }
+    template<class VertexType, class IndexType, class Instance>
+    void DrawTrianglesInstanced(const std::vector<VertexType>& vertices, const std::vector<IndexType>& indices, const Instance* instances, size_t numInstances,
+                                bool transparency=false, const PackingInfo& packing=PackingInfo())
+    {
+        m_shaders.RecordTrianglesInstanced(m_commands, vertices, indices, instances, numInstances, transparency, m_owner, packing);
+    }
+
+private:
+    ShadersClass& m_shaders;
+    CommandList& m_commands;
+    std::shared_ptr<const void> m_owner;
+};
+
+template<class ShadersClass>
+RecordingShaders<ShadersClass> Record(ShadersClass& shaders, CommandList& commands, const std::shared_ptr<const void>& owner=nullptr)
+{
+    return RecordingShaders<ShadersClass>(shaders, commands, owner);
+}
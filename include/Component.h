@@ -11,6 +11,7 @@ enum COMPONENT_TYPE
 
 struct ComponentBase
 {
+    virtual ~ComponentBase() {}     // Entities delete their components through this base
 };
 template <COMPONENT_TYPE componentType>
 struct Component : public ComponentBase
@@ -66,12 +67,32 @@ struct MeshComponent : public Component<COMPONENT_TYPE(MESH_COMPONENT+MaterialCl
     // Compile-time test for correct Material Class : "MaterialClass" must be derived from Material
     static_assert(std::is_base_of<Material, MaterialClass>::value, "Invalid Material Class");
 
-    MeshComponent(const Mesh& mesh, float scale=1.0f, bool transparent=false) : mesh(mesh), scale(scale), transparent(transparent) {}
-    MeshComponent(float scale=1.0f, bool transparent=false) : scale(scale), transparent(transparent) {}
-    Mesh mesh; 
+    MeshComponent(const MeshHandle& mesh, float scale=1.0f, bool transparent=false) : mesh(mesh), scale(scale), transparent(transparent), lod(0), lodTolerance(1.0f) {}
+    MeshComponent(float scale=1.0f, bool transparent=false) : scale(scale), transparent(transparent), lod(0), lodTolerance(1.0f) {}
+    MeshHandle mesh;        // Mesh shared with other entities
+    Pose pose;              // Animated state of this entity's mesh; unused for meshes without animation
     MaterialClass material;
     float scale;
     bool transparent;
+
+    size_t lod;             // Level of detail of the mesh to draw
+    float lodTolerance;     // Estimated error in pixels allowed on screen when picking level of detail
+
+    // Pick the coarsest level of detail whose estimated error stays within tolerance on screen
+    //  pixelsPerUnit is the size in pixels of a unit length at the mesh's distance
+    //  The error of a level (Mesh::GetLODError) is an RMS distance rather than the largest deviation,
+    //  so parts of a level can stray farther than tolerance; lower it where that shows
+    // A level is only left when it is clearly over or under the tolerance,
+    //  so a mesh near the threshold doesn't keep switching (popping) between levels
+    void SelectLOD(float pixelsPerUnit)
+    {
+        const float hysteresis = 0.25f;
+        float s = pixelsPerUnit * scale;
+        while (lod > 0 && mesh->GetLODError(lod)*s > lodTolerance*(1.0f+hysteresis))
+            --lod;
+        while (lod+1 < mesh->GetNumLODs() && mesh->GetLODError(lod+1)*s < lodTolerance*(1.0f-hysteresis))
+            ++lod;
+    }
 };
 
 class CameraSystem;
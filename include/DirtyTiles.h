@@ -0,0 +1,34 @@
+#pragma once
+#include <vector>
+
+// Tiles of a color buffer whose pixels changed since it was last presented, to present only those
+//  Tiles are compared by a hash of their pixels, so a tile drawn again just the same isn't presented again
+class DirtyTiles
+{
+public:
+    static const int TILE_SIZE = 32;
+    struct Rect { int x, y, w, h; };
+
+    DirtyTiles() : m_width(0), m_height(0), m_tilesX(0), m_tilesY(0), m_all(true) {}
+
+    // Start comparing a color buffer of width x height pixels; all tiles count as changed when its size changed
+    void Begin(int width, int height);
+    // Hash the tiles of rows of tiles firstRow to lastRow, excluded, of color and compare them with what was presented
+    //  Different rows can be hashed by different threads
+    void HashRows(const uint32_t* color, int firstRow, int lastRow);
+    // Rectangles of the changed tiles, runs of them along a row of tiles in one, which count as presented
+    //  Returns the number of changed tiles
+    size_t Gather(std::vector<Rect>& rects);
+    // Take all tiles as changed, as when what the window shows was lost
+    void Invalidate() { m_all = true; }
+
+    int GetNumRows() const { return m_tilesY; }
+    size_t GetNumTiles() const { return size_t(m_tilesX)*size_t(m_tilesY); }
+
+private:
+    int m_width, m_height;
+    int m_tilesX, m_tilesY;
+    bool m_all;
+    std::vector<uint64_t> m_hashes;     // Of the tiles as last presented
+    std::vector<uint8_t> m_changed;
+};
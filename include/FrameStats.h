@@ -0,0 +1,113 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Count fragments depth tested and passing in the rasterizer, to measure overdraw
+//  Costs a few adds per span; without it, frame statistics leave fragments out
+//#define COUNT_FRAGMENTS
+
+// Parts of a frame timed apart
+//  The time of a frame is split between them: the stage being timed is switched as the frame moves on,
+//  and time in a stage nested in another, like a clear within a pass, counts only for the inner one
+enum FRAME_STAGE
+{
+    STAGE_UPDATE,           // Updating the scene
+    STAGE_RECORD,           // Recording draws, and whatever else comes before the first pass
+    STAGE_SHADOW,
+    STAGE_OPAQUE,
+    STAGE_TRANSPARENT,      // Including the resolve of weighted blending
+    STAGE_CLEAR,            // Eager clears, and filling tiles left clear at the end of a lazily cleared frame
+    STAGE_PRESENT,
+    NUM_FRAME_STAGES
+};
+
+// Where the time of a frame went, and how much work it did
+struct FrameStats
+{
+    double frameTime;                       // Milliseconds
+    double stageTimes[NUM_FRAME_STAGES];
+    double skinningTime;                    // Of the frame's stages, spent skinning vertices
+    uint64_t verticesShaded;
+    uint64_t trianglesSubmitted;
+    uint64_t trianglesClipped;              // Outside the view volume
+    uint64_t trianglesCulled;               // Facing away, or without area
+    uint64_t trianglesRasterized;
+    // Fragments are only counted with COUNT_FRAGMENTS, and stay 0 otherwise
+    uint64_t fragmentsTested;               // Within the depth range, tested against the depth buffer
+    uint64_t fragmentsPassed;
+    uint64_t fragmentsShaded;               // Every fragment passing the depth test is shaded
+};
+
+// Counts of work done in the current frame, added to by whatever does it, from any thread
+struct FrameCounters
+{
+    std::atomic<uint64_t> verticesShaded;
+    std::atomic<uint64_t> trianglesSubmitted, trianglesClipped, trianglesCulled, trianglesRasterized;
+    std::atomic<uint64_t> fragmentsTested, fragmentsPassed;
+    std::atomic<uint64_t> skinningNanoseconds;
+
+    static FrameCounters& Get()
+    {
+        static FrameCounters counters;
+        return counters;
+    }
+};
+
+// Times the stages of frames and gathers the counters, frame after frame
+class FrameStatistics
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    FrameStatistics();
+
+    void BeginFrame(FRAME_STAGE stage = STAGE_UPDATE);
+    // Time what comes next as stage, returning the stage timed until now
+    FRAME_STAGE SetStage(FRAME_STAGE stage);
+    void EndFrame();
+
+    // Of the last frame ended
+    const FrameStats& GetLast() const { return m_last; }
+    size_t GetNumFrames() const { return m_numFrames; }
+
+    // Keep the stats of every frame ended from now on, to write them out as CSV, a line per frame
+    void StartRecording() { m_recording = true; }
+    bool WriteCSV(const std::string& filename) const;
+
+private:
+    FrameStats m_last;
+    size_t m_numFrames;
+    bool m_inFrame;
+    FRAME_STAGE m_stage;
+    Clock::time_point m_frameStart, m_stageStart;
+    double m_stageTimes[NUM_FRAME_STAGES];
+    bool m_recording;
+    std::vector<FrameStats> m_history;
+};
+
+// Time the enclosing scope as stage, then go back to timing the stage before
+class StageScope
+{
+public:
+    StageScope(FrameStatistics& statistics, FRAME_STAGE stage) : m_statistics(statistics), m_previous(statistics.SetStage(stage)) {}
+    ~StageScope() { m_statistics.SetStage(m_previous); }
+private:
+    FrameStatistics& m_statistics;
+    FRAME_STAGE m_previous;
+    StageScope& operator=(const StageScope&);
+};
+
+// Add the time of the enclosing scope to the skinning time of the frame
+class SkinningScope
+{
+public:
+    SkinningScope() : m_start(FrameStatistics::Clock::now()) {}
+    ~SkinningScope()
+    {
+        FrameCounters::Get().skinningNanoseconds += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(FrameStatistics::Clock::now() - m_start).count();
+    }
+private:
+    FrameStatistics::Clock::time_point m_start;
+};
@@ -0,0 +1,86 @@
+#pragma once
+#include "fastmath.h"
+
+// Point and spot lights, lighting what lies within their radius
+//  Expects vector.h and matrix.h to be included first
+struct LocalLight
+{
+    LocalLight(const vec3& position = vec3(), float radius = 1.0f, const vec3& color = vec3(1.0f, 1.0f, 1.0f))
+        : position(position), radius(radius), color(color), direction(vec3(0.0f, -1.0f, 0.0f)), outerAngle(0.0f), innerAngle(0.0f) {}
+
+    // Make it a spot light shining along direction (normalized), full inside innerAngle and fading out to outerAngle, in radians
+    void SetSpot(const vec3& direction, float outerAngle, float innerAngle)
+    {
+        this->direction = direction;
+        this->outerAngle = outerAngle;
+        this->innerAngle = innerAngle;
+    }
+    bool IsSpot() const { return outerAngle > 0.0f; }
+
+    vec3 position;
+    float radius;           // Light fades out to nothing at this distance
+    vec3 color;
+    vec3 direction;
+    float outerAngle, innerAngle;   // Half angles of the cone of spot lights; 0 for point lights
+};
+
+// Camera frustum split in clusters, and the local lights reaching each
+//  Clusters are screen tiles of LIGHT_TILE_SIZE pixels, each sliced in depth from the near to the far plane,
+//  slices growing exponentially with distance like the size of a tile does
+// Built once a frame for the camera; fragment shaders then only go through the lights of their cluster
+const int LIGHT_TILE_SIZE = 32;
+const int LIGHT_DEPTH_SLICES = 16;
+
+class LightGrid
+{
+public:
+    // Light as the shaders use it
+    struct Light
+    {
+        vec3 position;
+        float radiusSquared, invRadiusSquared;
+        vec3 color;
+        vec3 direction;
+        float cosOuter, spotScale;      // Spot factor is (cos(angle to direction) - cosOuter)*spotScale, clamped to [0, 1]; 1 for point lights
+    };
+
+    LightGrid() : m_tilesX(0), m_tilesY(0), m_near(1.0f), m_invNear(1.0f), m_sliceScale(0.0f) {}
+
+    // Assign lights to the clusters of a camera with given view and perspective projection, drawing to a target of width x height
+    //  Clusters a light's bounding sphere may touch are assigned, from its screen rectangle and its depth range
+    void Build(const std::vector<LocalLight>& lights, const mat4& view, const mat4& proj, int width, int height);
+
+    size_t GetNumLights() const { return m_lights.size(); }
+    const Light& GetLight(size_t i) const { return m_lights[i]; }
+
+    // Lights of the cluster of pixel (x, y) at given distance along the view direction, as indices for GetLight
+    const uint16_t* GetLights(int x, int y, float viewDepth, int& count) const
+    {
+        if (m_lights.empty())
+        {
+            count = 0;
+            return NULL;
+        }
+        size_t cluster = (size_t(Slice(viewDepth))*size_t(m_tilesY) + size_t(y/LIGHT_TILE_SIZE))*size_t(m_tilesX) + size_t(x/LIGHT_TILE_SIZE);
+        count = int(m_offsets[cluster+1] - m_offsets[cluster]);
+        return m_indices.data() + m_offsets[cluster];
+    }
+
+    // Light indices in all clusters, for statistics
+    size_t GetNumIndices() const { return m_indices.size(); }
+    size_t GetNumClusters() const { return size_t(m_tilesX)*size_t(m_tilesY)*LIGHT_DEPTH_SLICES; }
+
+private:
+    int m_tilesX, m_tilesY;
+    float m_near, m_invNear, m_sliceScale;
+    std::vector<Light> m_lights;
+    std::vector<uint32_t> m_offsets;    // Of the first index of each cluster, and the end of the last
+    std::vector<uint16_t> m_indices;    // Lights of all clusters, cluster after cluster
+
+    int Slice(float viewDepth) const
+    {
+        if (viewDepth <= m_near)
+            return 0;
+        return Min(int(Log2<SHADER_MATH_ACCURACY>(viewDepth*m_invNear)*m_sliceScale), LIGHT_DEPTH_SLICES-1);
+    }
+};
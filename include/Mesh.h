@@ -9,12 +9,93 @@ struct Vertex
     vec2 texcoords;
 };
 
+inline Vertex UnpackVertex(const PackedVertex& packed, const PackingInfo& info)
+{
+    Vertex v;
+    v.position = UnpackPosition(packed, info);
+    v.normal = UnpackOctahedral(packed.normal);
+    v.texcoords = UnpackTexcoords(packed, info);
+    return v;
+}
+
+// Views that the multi-view vertex stage transforms vertices for
+enum VIEW
+{
+    VIEW_CAMERA,
+    VIEW_LIGHT,
+
+    NUM_VIEWS
+};
+
+// Vertex transformed for all views at once by Mesh::TransformViews,
+//  so that passes drawing the mesh from different views don't each read and transform it again
+struct MultiViewVertex
+{
+    vec4 positions[NUM_VIEWS];      // Clip-space position in each view
+    Vertex vertex;                  // Unpacked and skinned vertex
+};
+
+// Animated state of an animated mesh
+//  Kept by each user of the mesh, so that the mesh itself can be shared
+struct Pose
+{
+    std::vector<mat4> transforms;           // Transform of each node relative to its parent
+    std::vector<mat4> combinedTransforms;   // Transform of each node relative to the root
+    // Skinned vertices of each level of detail drawn, and positions for passes drawing positions only
+    //  Kept apart for each level, as draws recorded at one level are executed after others have been skinned
+    std::vector<std::vector<Vertex>> vertices;
+    std::vector<std::vector<vec3>> positions;
+};
+
+// Index buffer holding 16-bit indices, or 32-bit ones when
+//  there are too many vertices for 16-bit indices to address
+struct IndexBuffer
+{
+    IndexBuffer() : wide(false) {}
+
+    std::vector<uint16_t> indices16;
+    std::vector<uint32_t> indices32;
+    bool wide;
+
+    // Store indices with the width needed for given number of vertices
+    void Set(const std::vector<uint32_t>& indices, size_t nvertices);
+    // Read indices stored with the given width (MESH_FILE_WIDE_INDICES)
+    void Read(std::fstream& file, bool wideIndices);
+    // Get indices widened to 32-bit
+    void Get(std::vector<uint32_t>& indices) const;
+
+    size_t Size() const { return wide ? indices32.size() : indices16.size(); }
+    size_t GetIndexSize() const { return wide ? sizeof(uint32_t) : sizeof(uint16_t); }
+
+    // Pick the index buffer once per draw, so that the 16-bit path pays nothing per triangle
+    //  packing is passed on for packed vertices
+    template<class ShadersClass, class VertexType>
+    void Draw(ShadersClass &shaders, const std::vector<VertexType>& vertices, bool transparency, const PackingInfo& packing=PackingInfo()) const
+    {
+        if (wide)
+            shaders.DrawTriangles(vertices, indices32, transparency, packing);
+        else
+            shaders.DrawTriangles(vertices, indices16, transparency, packing);
+    }
+    template<class ShadersClass, class VertexType, class Instance>
+    void DrawInstanced(ShadersClass &shaders, const std::vector<VertexType>& vertices, const Instance* instances, size_t numInstances, bool transparency,
+                       const PackingInfo& packing=PackingInfo()) const
+    {
+        if (wide)
+            shaders.DrawTrianglesInstanced(vertices, indices32, instances, numInstances, transparency, packing);
+        else
+            shaders.DrawTrianglesInstanced(vertices, indices16, instances, numInstances, transparency, packing);
+    }
+};
+
 // Class to store vertex and index buffers
 class Mesh
 {
 public:
     Mesh();
     ~Mesh();
+    Mesh(const Mesh&) = delete;             // Meshes are shared through MeshHandle instead of being copied
+    Mesh& operator=(const Mesh&) = delete;
 
     //Load animated mesh from a file
     void LoadAnimatedFile(const std::string &filename);
@@ -28,50 +109,152 @@ public:
     void LoadCone(float radius, float height, unsigned sides);
     
     // Draw the mesh with the given shaders
+    //  lod picks one of the levels built by GenerateLODs, 0 being the full detail mesh
+    //  Animated meshes are skinned with pose; they are drawn in bind pose without one
     template<class ShadersClass>
-    void Draw(ShadersClass &shaders, bool transparency=false)
+    void Draw(ShadersClass &shaders, bool transparency=false, size_t lod=0, Pose* pose=NULL) const
     {
-        if (m_animation)
-        {
-            for (size_t i=0; i<m_vertices.size(); ++i)
-            {
-                WeightInfo& wt = m_animation->skin[i];
-                mat4 t;
-                for (int k=0; k<6; ++k)
-                {
-                    if (wt.weights[k] <= 0)
-                        continue;
-                    Bone& bn = m_animation->bones[wt.boneids[k]];
-                    t = t + (bn.node->combined_transform * bn.offset) * wt.weights[k];
-                }
-                m_animation->tempVertices[i] = m_vertices[i];
-                m_animation->tempVertices[i].position = t*m_vertices[i].position;
-            }
-            shaders.DrawTriangles(m_animation->tempVertices, m_indices, transparency);
-        }
+        const std::vector<Vertex>* vertices;
+        const std::vector<PackedVertex>* packedVertices;
+        const IndexBuffer* indices;
+        GetBuffers(lod, pose, vertices, packedVertices, indices);
+        if (packedVertices)
+            indices->Draw(shaders, *packedVertices, transparency, m_packing);
         else
-            shaders.DrawTriangles(m_vertices, m_indices, transparency);
+            indices->Draw(shaders, *vertices, transparency);
+    }
+
+    // Draw numInstances copies of the mesh with the given shaders
+    //  Each instance holds what differs between them, such as transforms and uniforms (the Instance of the shaders' constants),
+    //  while skinning and buffer setup are done only once for all of them, so they share the pose
+    template<class ShadersClass, class Instance>
+    void DrawInstanced(ShadersClass &shaders, const Instance* instances, size_t numInstances,
+                       bool transparency=false, size_t lod=0, Pose* pose=NULL) const
+    {
+        const std::vector<Vertex>* vertices;
+        const std::vector<PackedVertex>* packedVertices;
+        const IndexBuffer* indices;
+        GetBuffers(lod, pose, vertices, packedVertices, indices);
+        if (packedVertices)
+            indices->DrawInstanced(shaders, *packedVertices, instances, numInstances, transparency, m_packing);
+        else
+            indices->DrawInstanced(shaders, *vertices, instances, numInstances, transparency);
     }
     
+    // Draw only positions of the mesh, for depth-only passes such as shadow maps
+    //  shaders must also take vec3 vertices: the position stream is drawn when there is one
+    //  (see SplitPositions) and animated meshes are skinned touching positions only
+    //  Otherwise the full vertices are drawn with the same shaders
+    template<class ShadersClass, class Instance>
+    void DrawPositionsInstanced(ShadersClass &shaders, const Instance* instances, size_t numInstances,
+                                size_t lod=0, Pose* pose=NULL) const
+    {
+        const std::vector<vec3>* positions;
+        const IndexBuffer* indices;
+        if (GetPositionBuffers(lod, pose, positions, indices))
+            indices->DrawInstanced(shaders, *positions, instances, numInstances, false);
+        else
+            DrawInstanced(shaders, instances, numInstances, false, lod, pose);
+    }
+    template<class ShadersClass>
+    void DrawPositions(ShadersClass &shaders, size_t lod=0, Pose* pose=NULL) const
+    {
+        const std::vector<vec3>* positions;
+        const IndexBuffer* indices;
+        if (GetPositionBuffers(lod, pose, positions, indices))
+            indices->Draw(shaders, *positions, false);
+        else
+            Draw(shaders, false, lod, pose);
+    }
+
+    // Multi-view vertex stage: read (and skin) each vertex once and transform it for all views
+    //  mvps holds the Model-View-Projection matrix of each view
+    void TransformViews(std::vector<MultiViewVertex>& views, const mat4 mvps[NUM_VIEWS], size_t lod=0, Pose* pose=NULL) const;
+    // Draw vertices of given level of detail as transformed by TransformViews, as the given instance
+    //  shaders must take MultiViewVertex vertices
+    template<class ShadersClass, class Instance>
+    void DrawViews(ShadersClass &shaders, const std::vector<MultiViewVertex>& views, const Instance& instance, bool transparency=false, size_t lod=0) const
+    {
+        const IndexBuffer& indices = lod > 0 && lod <= m_lods.size() ? m_lods[lod-1].indices : m_indices;
+        indices.DrawInstanced(shaders, views, &instance, 1, transparency);
+    }
+
+    bool IsAnimated() const { return m_animation != NULL; }
     const Animation* GetAnimation() const { return &m_animation->animation; }
-    void Animate(double time);
+    // Set pose to the animation at given time
+    void Animate(Pose& pose, double time) const;
+
+    // Size in bytes of each index: 2 for meshes with upto 65536 vertices, 4 for larger ones
+    size_t GetIndexSize() const { return m_indices.GetIndexSize(); }
+    size_t GetNumIndices() const { return m_indices.Size(); }
+
+    // Store vertices in the packed format (PackedVertex), taking half the memory
+    //  Packed vertices are unpacked by the vertex shaders while drawing
+    //  Animated meshes unpack them while skinning instead
+    void Pack();
+    bool IsPacked() const { return !m_packedVertices.empty(); }
+    size_t GetNumVertices() const { return IsPacked() ? m_packedVertices.size() : m_vertices.size(); }
+
+    // Also keep positions in a stream of their own, costing 12 bytes more per vertex
+    //  Passes that need positions only then read 12 bytes per vertex instead of the whole vertex
+    //  (DrawPositions; the multi-view vertex stage reads whole vertices, so it gains nothing from the stream)
+    void SplitPositions();
+    bool HasPositionStream() const { return !m_positions.empty(); }
+
+    // Build upto maxLevels simplified versions of the mesh,
+    //  each with about ratio times the triangles of the previous one
+    void GenerateLODs(size_t maxLevels = 4, float ratio = 0.5f);
+    // Number of levels of detail, including the full detail mesh
+    size_t GetNumLODs() const { return m_lods.size() + 1; }
+    size_t GetNumTriangles(size_t lod = 0) const { return (lod == 0 ? m_indices : m_lods[lod-1].indices).Size()/3; }
+    // Estimated error of a level against the full detail mesh, in mesh units: the square root of the largest quadric error
+    //  of its collapses (see SimplifyMesh), an RMS distance to the original triangles rather than a bound on the deviation
+    float GetLODError(size_t lod) const { return lod == 0 ? 0.0f : m_lods[lod-1].error; }
 
 private:
     std::vector<Vertex> m_vertices;     // Vertex Buffer
-    std::vector<uint16_t> m_indices;    // Index Buffer
+    IndexBuffer m_indices;              // Index Buffer
+
+    std::vector<PackedVertex> m_packedVertices; // Vertex Buffer used instead of m_vertices when the mesh is packed
+    PackingInfo m_packing;
+
+    std::vector<vec3> m_positions;      // Positions of the vertices, when kept as a stream of their own
+
+    // A simplified version of the mesh
+    struct LODLevel
+    {
+        std::vector<Vertex> vertices;
+        std::vector<PackedVertex> packedVertices;
+        std::vector<vec3> positions;
+        IndexBuffer indices;
+        std::vector<uint32_t> sourceVertices;   // Vertex of the full detail mesh each vertex is copied from; used for skinning
+        float error;
+    };
+    std::vector<LODLevel> m_lods;
+
+    // Get buffers to draw for given level of detail, skinning the vertices into pose if the mesh is animated
+    //  packedVertices is set instead of vertices when packed vertices are to be drawn, else it is NULL
+    void GetBuffers(size_t lod, Pose* pose, const std::vector<Vertex>*& vertices, const std::vector<PackedVertex>*& packedVertices, const IndexBuffer*& indices) const;
+    // Get position stream to draw for given level of detail, skinning positions only into pose if the mesh is animated
+    //  Returns false when there is no position stream to draw
+    bool GetPositionBuffers(size_t lod, Pose* pose, const std::vector<vec3>*& positions, const IndexBuffer*& indices) const;
+    void CopyPositions(size_t lod);
+
+    void ReadVertices(std::fstream& file, uint32_t nvertices, uint32_t flags);
+    void GetUnpackedVertices(std::vector<Vertex>& vertices) const;
     
     struct AnimationInfo
     {
         std::vector<Bone> bones;
-        Node root;
+        std::vector<Node> nodes;
         Animation animation;
         std::vector<WeightInfo> skin;
-        std::vector<Vertex> tempVertices;
-
-        std::map<unsigned int, Node*> map;
     } * m_animation;
 
-    void ReadNode(std::fstream& file, Node* node);
-
-    void UpdateNode(Node& node, Node* parent=NULL);
+    // Read a node and its children, mapping the ids used in the file to node indices
+    void ReadNode(std::fstream& file, int parent, std::map<unsigned int, size_t>& ids);
 };
+
+// Shared reference to a mesh, as handed out by MeshManager
+//  The mesh is const, as others may be drawing it: it is processed before it is shared (see MeshManager)
+typedef std::shared_ptr<const Mesh> MeshHandle;
@@ -0,0 +1,139 @@
+#pragma once
+
+// Mesh files may start with a header: MESH_FILE_MAGIC followed by a uint32 of flags
+//  Files without it are read as plain float vertices
+//  The magic can't be mistaken for older files: those start with either
+//  the vertex count or, for animated meshes, the id of root node which is 0
+const uint32_t MESH_FILE_MAGIC = 0x4853454D;    // "MESH"
+
+enum MESH_FILE_FLAGS
+{
+    MESH_FILE_QUANTIZED = 1,    // Vertices are stored as PackingInfo followed by PackedVertex records
+    MESH_FILE_WIDE_INDICES = 2, // Indices are stored as uint32 rather than uint16, for meshes with more than 65536 vertices
+};
+
+// Vertex with each attribute quantized to 16 bits:
+//  position normalized to the bounds of the mesh,
+//  normal octahedral encoded and texture coordinates normalized to their range in the mesh
+struct PackedVertex
+{
+    uint16_t position[3];
+    int16_t normal[2];
+    uint16_t texcoords[2];
+    uint16_t padding;
+};
+
+// Ranges that positions and texture coordinates of a mesh are normalized to
+//  Unpacked value = offset + scale * normalized value
+struct PackingInfo
+{
+    vec3 positionOffset, positionScale;
+    vec2 texcoordOffset, texcoordScale;
+};
+
+inline uint16_t PackUnorm16(float v)
+{
+    return uint16_t(Min(Max(v, 0.0f), 1.0f) * 65535.0f + 0.5f);
+}
+
+inline float UnpackUnorm16(uint16_t v)
+{
+    return float(v) * (1.0f/65535.0f);
+}
+
+inline int16_t PackSnorm16(float v)
+{
+    v = Min(Max(v, -1.0f), 1.0f) * 32767.0f;
+    return int16_t(v < 0.0f ? v - 0.5f : v + 0.5f);
+}
+
+inline float UnpackSnorm16(int16_t v)
+{
+    return Max(float(v) * (1.0f/32767.0f), -1.0f);
+}
+
+// Map a unit vector onto an octahedron, unfolded into a square
+inline void PackOctahedral(const vec3& n, int16_t out[2])
+{
+    float l = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    float x = l > 0.0f ? n.x/l : 1.0f;
+    float y = l > 0.0f ? n.y/l : 0.0f;
+    if (n.z < 0.0f)
+    {
+        float tx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = tx;
+    }
+    out[0] = PackSnorm16(x);
+    out[1] = PackSnorm16(y);
+}
+
+inline vec3 UnpackOctahedral(const int16_t in[2])
+{
+    vec3 n(UnpackSnorm16(in[0]), UnpackSnorm16(in[1]), 0.0f);
+    n.z = 1.0f - fabsf(n.x) - fabsf(n.y);
+    if (n.z < 0.0f)
+    {
+        float tx = (1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+        n.y = (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+        n.x = tx;
+    }
+    n.Normalize();
+    return n;
+}
+
+// Find ranges of positions and texture coordinates, given as arrays with a stride in bytes
+inline PackingInfo ComputePackingInfo(const vec3* positions, const vec2* texcoords, size_t count, size_t stride)
+{
+    vec3 pmin(1e30f, 1e30f, 1e30f), pmax(-1e30f, -1e30f, -1e30f);
+    vec2 tmin(1e30f, 1e30f), tmax(-1e30f, -1e30f);
+    for (size_t i=0; i<count; ++i)
+    {
+        const vec3& p = *(const vec3*)((const char*)positions + i*stride);
+        const vec2& t = *(const vec2*)((const char*)texcoords + i*stride);
+        for (int k=0; k<3; ++k)
+        {
+            pmin[k] = Min(pmin[k], p[k]);
+            pmax[k] = Max(pmax[k], p[k]);
+        }
+        for (int k=0; k<2; ++k)
+        {
+            tmin[k] = Min(tmin[k], t[k]);
+            tmax[k] = Max(tmax[k], t[k]);
+        }
+    }
+
+    PackingInfo info;
+    if (count == 0)
+        return info;
+    info.positionOffset = pmin;
+    info.positionScale = pmax - pmin;
+    info.texcoordOffset = tmin;
+    info.texcoordScale = tmax - tmin;
+    return info;
+}
+
+inline PackedVertex PackVertex(const vec3& position, const vec3& normal, const vec2& texcoords, const PackingInfo& info)
+{
+    PackedVertex v;
+    for (int k=0; k<3; ++k)
+        v.position[k] = info.positionScale[k] > 0.0f ? PackUnorm16((position[k] - info.positionOffset[k]) / info.positionScale[k]) : 0;
+    PackOctahedral(normal, v.normal);
+    for (int k=0; k<2; ++k)
+        v.texcoords[k] = info.texcoordScale[k] > 0.0f ? PackUnorm16((texcoords[k] - info.texcoordOffset[k]) / info.texcoordScale[k]) : 0;
+    v.padding = 0;
+    return v;
+}
+
+inline vec3 UnpackPosition(const PackedVertex& v, const PackingInfo& info)
+{
+    return vec3(info.positionOffset.x + info.positionScale.x * UnpackUnorm16(v.position[0]),
+                info.positionOffset.y + info.positionScale.y * UnpackUnorm16(v.position[1]),
+                info.positionOffset.z + info.positionScale.z * UnpackUnorm16(v.position[2]));
+}
+
+inline vec2 UnpackTexcoords(const PackedVertex& v, const PackingInfo& info)
+{
+    return vec2(info.texcoordOffset.x + info.texcoordScale.x * UnpackUnorm16(v.texcoords[0]),
+                info.texcoordOffset.y + info.texcoordScale.y * UnpackUnorm16(v.texcoords[1]));
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include "Mesh.h"
+#include <tuple>
+
+// Processing of a mesh after loading it, before it is shared; a combination of these bits
+enum MESH_PROCESSING
+{
+    MESH_GENERATE_LODS = 1,         // GenerateLODs with default settings
+    MESH_PACK = 2,                  // Pack
+    MESH_SPLIT_POSITIONS = 4,       // SplitPositions
+};
+
+// Loads each mesh once and hands out shared handles to it
+//  File meshes are cached by path and procedural meshes by their parameters,
+//  so loading the same mesh again returns the one already loaded
+// Meshes are handed out const: what would change one for all its users, like GenerateLODs or Pack,
+//  is asked for as processing (MESH_PROCESSING bits) when loading, and meshes are cached for each processing too
+class MeshManager
+{
+public:
+    MeshHandle LoadFile(const std::string& filename, unsigned processing = 0)
+    {
+        return GetMesh(m_files, std::make_tuple(filename, processing), processing, [&](Mesh& mesh) { mesh.LoadFile(filename); });
+    }
+    MeshHandle LoadAnimatedFile(const std::string& filename, unsigned processing = 0)
+    {
+        return GetMesh(m_animatedFiles, std::make_tuple(filename, processing), processing, [&](Mesh& mesh) { mesh.LoadAnimatedFile(filename); });
+    }
+    MeshHandle LoadBox(float halfLength, float halfHeight, float halfWidth, unsigned processing = 0)
+    {
+        return GetMesh(m_boxes, std::make_tuple(halfLength, halfHeight, halfWidth, processing), processing,
+                       [&](Mesh& mesh) { mesh.LoadBox(halfLength, halfHeight, halfWidth); });
+    }
+    MeshHandle LoadSphere(float radius, uint16_t rings, uint16_t sectors, unsigned processing = 0)
+    {
+        return GetMesh(m_spheres, std::make_tuple(radius, rings, sectors, processing), processing,
+                       [&](Mesh& mesh) { mesh.LoadSphere(radius, rings, sectors); });
+    }
+    MeshHandle LoadCone(float radius, float height, unsigned sides, unsigned processing = 0)
+    {
+        return GetMesh(m_cones, std::make_tuple(radius, height, sides, processing), processing,
+                       [&](Mesh& mesh) { mesh.LoadCone(radius, height, sides); });
+    }
+
+    // Free the meshes that no one but the manager refers to
+    void ReleaseUnused()
+    {
+        ReleaseUnused(m_files);
+        ReleaseUnused(m_animatedFiles);
+        ReleaseUnused(m_boxes);
+        ReleaseUnused(m_spheres);
+        ReleaseUnused(m_cones);
+    }
+
+    // Forget all meshes; each is freed once its last handle is gone
+    void CleanUp()
+    {
+        m_files.clear();
+        m_animatedFiles.clear();
+        m_boxes.clear();
+        m_spheres.clear();
+        m_cones.clear();
+    }
+
+private:
+    std::map<std::tuple<std::string, unsigned>, MeshHandle> m_files, m_animatedFiles;
+    std::map<std::tuple<float, float, float, unsigned>, MeshHandle> m_boxes;
+    std::map<std::tuple<float, uint16_t, uint16_t, unsigned>, MeshHandle> m_spheres;
+    std::map<std::tuple<float, float, unsigned, unsigned>, MeshHandle> m_cones;
+
+    template<class Key>
+    static MeshHandle GetMesh(std::map<Key, MeshHandle>& cache, const Key& key, unsigned processing, const std::function<void(Mesh&)>& load)
+    {
+        auto it = cache.find(key);
+        if (it != cache.end())
+            return it->second;
+        std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+        load(*mesh);
+        // Levels of detail first, so that packing and the position stream cover them too
+        if (processing & MESH_GENERATE_LODS)
+            mesh->GenerateLODs();
+        if (processing & MESH_PACK)
+            mesh->Pack();
+        if (processing & MESH_SPLIT_POSITIONS)
+            mesh->SplitPositions();
+        cache[key] = mesh;
+        return mesh;
+    }
+
+    template<class Key>
+    static void ReleaseUnused(std::map<Key, MeshHandle>& cache)
+    {
+        for (auto it=cache.begin(); it!=cache.end(); )
+        {
+            if (it->second.use_count() == 1)
+                it = cache.erase(it);
+            else
+                ++it;
+        }
+    }
+};
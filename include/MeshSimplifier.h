@@ -0,0 +1,13 @@
+#pragma once
+
+struct Vertex;
+
+// Simplify a triangle list by quadric-error edge collapses until it has
+//  no more than targetTriangles triangles, or nothing more can be collapsed
+// Each collapse moves a vertex onto one of its neighbours, so the resulting
+//  indices still refer to the given vertices (only fewer of them are used)
+// Vertices on open borders and attribute seams are never moved
+// Returns the square root of the largest quadric error of the collapses, in mesh units: the root mean square
+//  distance of a moved vertex to the planes of the original triangles around it
+//  It estimates, rather than bounds, how far the simplified surface lies from the original one
+float SimplifyMesh(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, size_t targetTriangles);
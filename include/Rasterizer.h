@@ -1,15 +1,46 @@
 #pragma once
 #include "RasterizerStructs.h"
+#include "ClearTiles.h"
+#include "FrameStats.h"
 
 class Rasterizer
 {
 public:
-    template<int N>
-    static void DrawTriangle(Point<N>* point1, Point<N>* point2, Point<N>* point3, void(*f)(Point<N>&), int width, int height, float* depthBuffer, bool transparency=false)
+    // constants are the per-draw constants passed on to the fragment shader f
+    //  Rows of depthBuffer are pitch floats apart
+    // With clearTiles, the tiles of the buffers are cleared as they are first drawn into
+    // With accumulate, fragments are depth tested but leave the depth buffer as it is,
+    //  and spans and rows are half-open so that triangles sharing an edge or a row don't both draw its pixels:
+    //  each pixel a mesh covers is shaded once per layer, as blending fragments by accumulation needs
+    template<int N, class Constants>
+    static void DrawTriangle(Point<N>* point1, Point<N>* point2, Point<N>* point3, void(*f)(Point<N>&, const Constants&), const Constants& constants,
+                             int width, int height, float* depthBuffer, int pitch, bool transparency=false, ClearTiles* clearTiles=NULL, bool accumulate=false)
     {
         int *pt1 = point1->pos,
             *pt2 = point2->pos,
             *pt3 = point3->pos;
+
+        // Plane gradients of attributes times w and of w, for derivatives in the fragment shader
+        vec4 gradientX[N+1], gradientY[N+1];
+        Point<N> point;
+        point.gradientX = gradientX;
+        point.gradientY = gradientY;
+        float area = float((pt2[0]-pt1[0])*(pt3[1]-pt1[1]) - (pt3[0]-pt1[0])*(pt2[1]-pt1[1]));
+        if (area != 0.0f)
+        {
+            float x2 = float(pt2[0]-pt1[0])/area, y2 = float(pt2[1]-pt1[1])/area;
+            float x3 = float(pt3[0]-pt1[0])/area, y3 = float(pt3[1]-pt1[1])/area;
+            float dw2 = point2->w - point1->w, dw3 = point3->w - point1->w;
+            point.wdx = dw2*y3 - dw3*y2;
+            point.wdy = dw3*x2 - dw2*x3;
+            for (int i=0; i<N; ++i)
+            {
+                vec4 a1 = point1->attribute[i]*point1->w;
+                vec4 da2 = point2->attribute[i]*point2->w - a1, da3 = point3->attribute[i]*point3->w - a1;
+                gradientX[i] = da2*y3 - da3*y2;
+                gradientY[i] = da3*x2 - da2*x3;
+            }
+        }
     
         // Create edges out of the points
         // But do not create horizontal edges
@@ -27,7 +58,7 @@ public:
         if (num == 2)
         {
             Pair<N> pair(&edges[0], &edges[1]);
-            DrawSpans(pair, f, width, height, depthBuffer, transparency);
+            DrawSpans(pair, point, f, constants, width, height, depthBuffer, pitch, transparency, clearTiles, accumulate);
         }
         // If 3 edges were created, find the longest edge and draw spans for two pairs
         //  each pair containing the longest edge and a short edge
@@ -43,17 +74,19 @@ public:
             if (edges[se2].y < edges[se1].y)        // Make sure short edge with less y is drawn first
                 Swap(se1, se2);
 
-            Pair<N> p1(&edges[le], &edges[se1]), p2(&edges[le], &edges[se2]);
-            DrawSpans(p1, f, width, height, depthBuffer, transparency);
-            DrawSpans(p2, f, width, height, depthBuffer, transparency);
+            Pair<N> p1(&edges[le], &edges[se1]);
+            DrawSpans(p1, point, f, constants, width, height, depthBuffer, pitch, transparency, clearTiles, accumulate);
+            // Made once the long edge is stepped down to the second short edge, to order them by where they start from
+            Pair<N> p2(&edges[le], &edges[se2]);
+            DrawSpans(p2, point, f, constants, width, height, depthBuffer, pitch, transparency, clearTiles, accumulate);
         }
     }
 
 private:
-    template<int N>
-    static void DrawSpans(Pair<N> &p, void(*f)(Point<N>&), int width, int height, float* depthBuffer, bool transparency)
+    template<int N, class Constants>
+    // point holds the gradients of the triangle
+    static void DrawSpans(Pair<N> &p, Point<N>& point, void(*f)(Point<N>&, const Constants&), const Constants& constants, int width, int height, float* depthBuffer, int pitch, bool transparency, ClearTiles* clearTiles, bool accumulate)
     {
-        Point<N> point;
         float xdiff;
         int start;
 
@@ -64,14 +97,18 @@ private:
             int y = p.e1->y;
             if (y >= height)         // Clipping when y >= height
                 return;
-            if (y >= 0)         // Clipping when y < 0
+            // Last row of the pair, left to the next pair or triangle when accumulating
+            bool lastRow = accumulate && y == Min(p.le->p2->y, p.se->p2->y);
+            if (y >= 0 && !lastRow)         // Clipping when y < 0
             {
                 int x1 = p.e1->x;
                 int x2 = p.e2->x;
                 if (x1 < width && x2 >= 0 && x1 < x2)      // Clipping when x > width or x < 0
                 {
                     x1 = Max(x1, 0);        // Further clipping
-                    x2 = Min(x2, width-1);
+                    x2 = Min(accumulate ? x2-1 : x2, width-1);
+                    if (clearTiles)
+                        clearTiles->Touch(y, x1, x2);
 
                     point.pos[1] = y;
                     xdiff = float(p.e2->x - p.e1->x);
@@ -88,21 +125,32 @@ private:
                         point.attribute[i] = attrs_tmp[i]/w;
                     }
 
+#ifdef COUNT_FRAGMENTS
+                    uint64_t tested = 0, passed = 0;
+#endif
                     for (point.pos[0] = x1; point.pos[0] <= x2; ++point.pos[0])
                     {
                         // depth clipping (d < 0 and d > 1) Since depth buffer store 1 at max, d>1 is automatically tested
                         if (point.d > 0)
                         {
+#ifdef COUNT_FRAGMENTS
+                            ++tested;
+#endif
                             // Depth test
-                            float& depth = depthBuffer[point.pos[1]*width+point.pos[0]];
+                            float& depth = depthBuffer[point.pos[1]*pitch+point.pos[0]];
                             
                             float dd = point.d - depth;
                             bool depthtest = transparency?(dd < 0 && fabs(dd) > 0.000007f):(dd < 0);
                             if (depthtest)
                             {
-                                depth = point.d;
+                                if (!accumulate)
+                                    depth = point.d;
                                 // Pass to the fragment shader
-                                f(point);
+                                point.w = w;
+                                f(point, constants);
+#ifdef COUNT_FRAGMENTS
+                                ++passed;
+#endif
                             }
                         }   
                         // Increment the depth and attributes
@@ -114,6 +162,10 @@ private:
                             point.attribute[i] = attrs_tmp[i]/w;
                         }
                     }
+#ifdef COUNT_FRAGMENTS
+                    FrameCounters::Get().fragmentsTested += tested;
+                    FrameCounters::Get().fragmentsPassed += passed;
+#endif
                 }
             }
 
@@ -7,7 +7,7 @@ class Point
 {
 public:
     Point(int x=0, int y=0, float d=0.0f)
-    :d(d)
+    :d(d), gradientX(NULL), gradientY(NULL), wdx(0.0f), wdy(0.0f)
     {
         pos[0]=x;
         pos[1]=y;
@@ -27,6 +27,19 @@ public:
     float d;
     vec4 attribute[N + 1];
     float w;                // w is stored for perspective correct interpolation
+
+    // Set by the rasterizer for fragment shaders: gradients over the triangle of attributes (times w, as interpolated)
+    //  and of w, along x and y in window space
+    const vec4* gradientX, *gradientY;
+    float wdx, wdy;
+
+    // Derivatives of attribute i along x and y in window space, as used to pick a level of detail
+    void Derivatives(int i, vec4& ddx, vec4& ddy) const
+    {
+        float invW = 1.0f/w;
+        ddx = (gradientX[i] - attribute[i]*wdx)*invW;
+        ddy = (gradientY[i] - attribute[i]*wdy)*invW;
+    }
 };
 
 // Edge stores a pair of points, sorted by y-coordinate
@@ -117,7 +130,8 @@ public:
     Pair(Edge<N> *_e1, Edge<N>*_e2)
     : e1(_e1), e2(_e2), le(_e1), se(_e2)
     {
-          if (e1->p1->pos[0] > e2->p1->pos[0])
+          // By where the edges are now, as the long edge is stepped down a triangle's first pair before its second
+          if (e1->x > e2->x)
             Swap(e1, e2);
     }
     
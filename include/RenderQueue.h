@@ -0,0 +1,82 @@
+#pragma once
+#include "CommandList.h"
+#include <string.h>
+
+// Passes of a frame, in the order they are drawn
+enum RENDER_PASS
+{
+    PASS_SHADOW,
+    PASS_OPAQUE,
+    PASS_TRANSPARENT,
+    PASS_COMPOSITE,     // Resolving what the transparent pass accumulated
+};
+
+// Draws gathered from all systems of a frame, sorted by key before they are executed
+//  Keys order draws by pass and layer within the pass (like the cascade of a shadow map), then for opaque draws by material and near to far for early depth rejection,
+//  and for transparent draws far to near, as blending them one over another needs, before material
+//  Draws with equal keys keep the order they were added in
+class RenderQueue
+{
+public:
+    // Key of commands setting up a layer of a pass, sorted before all its draws
+    static uint64_t SetupKey(unsigned pass, unsigned layer = 0)
+    {
+        return uint64_t(pass) << 56 | uint64_t(layer & 0xFF) << 48;
+    }
+    // Key of a draw of the given material, at the given distance from the view
+    static uint64_t DrawKey(unsigned pass, unsigned material, float depth, unsigned layer = 0)
+    {
+        uint64_t m = (material + 1) & 0xFFFF;       // Material 0 is left to setup
+        // Non-negative floats order like their bits
+        depth = Max(depth, 0.0f);
+        uint32_t d;
+        memcpy(&d, &depth, sizeof(d));
+        if (pass == PASS_TRANSPARENT)
+            return SetupKey(pass, layer) | uint64_t(~d) << 16 | m;
+        return SetupKey(pass, layer) | m << 32 | d;
+    }
+
+    // Commands of a new draw with given key
+    //  The reference is only good until the next draw is added
+    CommandList& Add(uint64_t key)
+    {
+        m_items.push_back(Item());
+        m_items.back().key = key;
+        return m_items.back().commands;
+    }
+
+    bool IsEmpty() const { return m_items.empty(); }
+    size_t GetNumDraws() const { return m_items.size(); }
+    void Clear() { m_items.clear(); }
+
+    // Sort the draws and append their commands to commands, leaving the queue empty
+    void Flush(CommandList& commands)
+    {
+        std::stable_sort(m_items.begin(), m_items.end(), [](const Item& a, const Item& b) { return a.key < b.key; });
+        for (size_t i=0; i<m_items.size(); ++i)
+            commands.Append(m_items[i].commands);
+        m_items.clear();
+    }
+
+private:
+    struct Item
+    {
+        uint64_t key;
+        CommandList commands;
+    };
+    std::vector<Item> m_items;
+};
+
+// Small ids given to types of material in the order they are first asked for
+inline unsigned NextMaterialId()
+{
+    static unsigned next = 0;
+    return next++;
+}
+
+template<class T>
+unsigned MaterialId()
+{
+    static unsigned id = NextMaterialId();
+    return id;
+}
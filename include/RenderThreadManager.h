@@ -53,25 +53,30 @@ public:
     }
 
     
-    template<int N>
-    void DrawTriangles(void(*fragmentShader)(Point<N>&), uint16_t* indexBuffer, size_t numTriangles, bool backfaceVisible,
+    template<int N, class Constants, class IndexType>
+    void DrawTriangles(void(*fragmentShader)(Point<N>&, const Constants&), const Constants& constants, const IndexType* indexBuffer, size_t numTriangles, bool backfaceVisible,
                         vec4* vs, Point<N>* points, bool transparency = false, int offset=0);
 
-    template<int N>
-    void DrawTrianglesThreaded(void(*fragmentShader)(Point<N>&), uint16_t* indexBuffer, size_t numTriangles, bool backfaceVisible,
+    template<int N, class Constants, class IndexType>
+    void DrawTrianglesThreaded(void(*fragmentShader)(Point<N>&, const Constants&), const Constants& constants, const IndexType* indexBuffer, size_t numTriangles, bool backfaceVisible,
                         vec4* vs, Point<N>* points, bool transparency = false)
     {
-        
+        Run([this, fragmentShader, &constants, indexBuffer, backfaceVisible, vs, points, transparency]
+            (int offset, size_t numTriangles) {
+                DrawTriangles(fragmentShader, constants, indexBuffer, numTriangles, backfaceVisible, vs, points, transparency, offset);
+            }, numTriangles);
+    }
+
+    // Run job(offset, count) on all threads, each on its share of count items, and wait for them
+    void Run(const std::function<void(int offset, size_t count)>& job, size_t count)
+    {
         runningThreads = NUM_THREADS;
-        draw = [this, fragmentShader, indexBuffer, backfaceVisible, vs, points, transparency]
-               (int offset, size_t numTriangles) {
-                  DrawTriangles(fragmentShader, indexBuffer, numTriangles, backfaceVisible, vs, points, transparency, offset);
-              };
+        draw = job;
         for (int i=0; i<NUM_THREADS; ++i)
         {
-            m_numTriangles[i] = numTriangles/NUM_THREADS;
+            m_numTriangles[i] = count/NUM_THREADS;
             if (i == 0){ 
-                m_numTriangles[i] += numTriangles%NUM_THREADS;
+                m_numTriangles[i] += count%NUM_THREADS;
                 m_offset[i] = 0;
             }
             else m_offset[i] = m_offset[i-1] + (int)m_numTriangles[i-1];
@@ -81,8 +86,6 @@ public:
 
         while (runningThreads > 0)
             ;// std::this_thread::sleep_for(std::chrono::nanoseconds(1));
-
-        
     }
     
 };
@@ -1,7 +1,14 @@
 #pragma once
 #include "quat.h"
+#include "MeshFormat.h"
 #include "Timer.h"
 #include "Rasterizer.h"
+#include "CommandList.h"
+#include "RenderQueue.h"
+#include "ShadowSampling.h"
+#include "LightGrid.h"
+#include "DirtyTiles.h"
+#include "FrameStats.h"
 #include <RenderThreadManager.h>
 
 //#define USE_MULTITHREADING
@@ -14,9 +21,27 @@ public:
     Renderer();
     ~Renderer();
 
+    // Draw into the surface of a window
     void Initialize(const char* title, int x, int y, int width, int height);
+    // Draw into color and depth buffers of the renderer's own, without a window or anything of SDL
+    //  Frames are drawn the same as in a window
+    void InitializeOffscreen(int width, int height);
+    bool IsOffscreen() const { return m_offscreen; }
+
+    // Update and draw frames until the window is closed
     void MainLoop();
+    // Update and draw numFrames frames offscreen, each one update of the target time step after the previous one
+    void RunOffscreen(int numFrames);
     void CleanUp();
+
+    // Times and counts of work of frames, the last of them and, once recording, all of them
+    //  Passes time themselves by switching its stage as they begin
+    FrameStatistics& GetStatistics() { return m_statistics; }
+
+    // Color buffer of the last frame drawn: rows of width 0xAARRGGBB pixels, top row first
+    const uint32_t* GetFramebuffer() const { return m_framebuffer; }
+    // Write the color buffer to a binary PPM file
+    bool SaveFramebuffer(const std::string& filename) const;
     
     void PutPixel(int x, int y, const RGBColor &color)
     {
@@ -37,6 +62,7 @@ public:
             return;
         PutPixelUnsafe(x, y, color, alpha);
     }
+    //  alpha is the opacity of color over what is already there
     void PutPixelUnsafe(int x, int y, RGBColor color, float alpha)
     {
         if (alpha == 0.0f)
@@ -44,12 +70,34 @@ public:
         if (alpha < 1.0f)
         {
             RGBColor d = GetPixel(x, y);
-            color.r = uint8_t(d.r * alpha + color.r * (1.0f-alpha));
-            color.g = uint8_t(d.g * alpha + color.g * (1.0f-alpha));
-            color.b = uint8_t(d.b * alpha + color.b * (1.0f-alpha));
+            color.r = uint8_t(color.r * alpha + d.r * (1.0f-alpha));
+            color.g = uint8_t(color.g * alpha + d.g * (1.0f-alpha));
+            color.b = uint8_t(color.b * alpha + d.b * (1.0f-alpha));
         }
         m_framebuffer[y*m_width + x] = (0xFF << 24) | (color.r << 16) | (color.g << 8) | color.b;
     }
+    // Blend a transparent fragment at given window depth, as the transparency mode does
+    //  Weighted blending accumulates it to be resolved at the end of the pass; otherwise it's blended right away
+    void BlendPixel(int x, int y, const vec3& color, float alpha, float depth)
+    {
+        if (!m_accumulating)
+        {
+            PutPixelUnsafe(x, y, color, alpha);
+            return;
+        }
+        if (alpha <= 0.0f)
+            return;
+        // Weight from McGuire and Bavoil, "Weighted Blended Order-Independent Transparency": near fragments count more
+        float d = 1.0f - depth;
+        float weight = alpha * Min(Max(3e3f*d*d*d, 1e-2f), 3e3f);
+        size_t i = size_t(y)*size_t(m_width) + size_t(x);
+        float* accumulation = &m_accumulation[i*4];
+        accumulation[0] += color.r * weight;
+        accumulation[1] += color.g * weight;
+        accumulation[2] += color.b * weight;
+        accumulation[3] += weight;
+        m_revealage[i] *= 1.0f - alpha;
+    }
     
     RGBColor GetPixel(int x, int y)
     {
@@ -62,44 +110,125 @@ public:
     void SetResizeCallback(std::function<void(int, int)> resizeCallback) { m_resize = resizeCallback; }
 
     // Draw a triangle from from pixel points
-    template<int N>
-    void DrawTriangle(Point<N> &pt1, Point<N> &pt2, Point<N> &pt3, void (*fragmentShader)(Point<N>&), bool transparency = false)
+    template<int N, class Constants>
+    void DrawTriangle(Point<N> &pt1, Point<N> &pt2, Point<N> &pt3, void (*fragmentShader)(Point<N>&, const Constants&), const Constants& constants, bool transparency = false)
     {
-        Rasterizer::DrawTriangle(&pt1, &pt2, &pt3, fragmentShader, m_width, m_height, m_depthBuffers[m_depthBufferId], transparency); 
+        const DepthBuffer& target = m_depthBuffers[m_depthBufferId];
+        Rasterizer::DrawTriangle(&pt1, &pt2, &pt3, fragmentShader, constants, target.width, target.height, target.data, target.pitch, transparency,
+                                 m_lazyClear && m_clearTiles.IsAttachedTo(target.data) ? &m_clearTiles : NULL, transparency && m_accumulating); 
     }
     
     // Draw triangles with given vertices and indices
     //  The vertices are passed through the vertexShader function
     //  and rasterized. Each pixel is then passed through the framentShader function
-    template<int N, class Args>
-    void DrawTriangles(vec4(*vertexShader)(vec4[], const Args&), void(*fragmentShader)(Point<N>&), Args* vertexBuffer, size_t numVertices, uint16_t* indexBuffer, size_t numTriangles, bool backfaceVisible = false, bool transparency = false)
+    // IndexType is either uint16_t or uint32_t, so the index width is resolved at compile time
+    // Both shaders receive a block of Constants built from the renderer once for the draw,
+    //  so that they neither read nor recompute anything shared by all vertices and pixels
+    // packing holds the ranges to unpack packed vertices with, and is ignored for other vertex formats
+    template<int N, class Args, class IndexType, class Constants>
+    void DrawTriangles(vec4(*vertexShader)(vec4[], const Args&, const Constants&), void(*fragmentShader)(Point<N>&, const Constants&), const Args* vertexBuffer, size_t numVertices, const IndexType* indexBuffer, size_t numTriangles, bool backfaceVisible = false, bool transparency = false,
+                       const PackingInfo& packing = PackingInfo())
     {
-        vec4* vs = new vec4[numVertices];                // array to carry the clip-space vertices returned by vertexBuffer
-        Point<N>* points = new Point<N>[numVertices];    // array to carry window space points and their attributes
+        const Constants constants(*this, packing);
+        DrawTrianglesWithConstants(vertexShader, fragmentShader, &constants, 1, vertexBuffer, numVertices, indexBuffer, numTriangles, backfaceVisible, transparency);
+    }
 
-        ProcessVertices(points, vs, vertexShader, vertexBuffer, numVertices);
-        
-#ifndef USE_MULTITHREADING
-        m_threader.DrawTriangles(fragmentShader, indexBuffer, numTriangles, backfaceVisible, vs, points, transparency);
-#else
-        m_threader.DrawTrianglesThreaded(fragmentShader, indexBuffer, numTriangles, backfaceVisible, vs, points, transparency);
-#endif
+    // Instanced draws process the vertices of as many instances together as fit in this many vertices
+    static const size_t INSTANCE_BATCH_VERTICES = 16384;
+
+    // Draw the same triangles once for each of numInstances constant blocks built beforehand,
+    //  such as those of a recorded CommandList
+    // Vertices of a batch of instances are processed in one go (split between threads with USE_MULTITHREADING),
+    //  then the triangles of each instance are drawn from them
+    template<int N, class Args, class IndexType, class Constants>
+    void DrawTrianglesWithConstants(vec4(*vertexShader)(vec4[], const Args&, const Constants&), void(*fragmentShader)(Point<N>&, const Constants&), const Constants* constants, size_t numInstances,
+                                    const Args* vertexBuffer, size_t numVertices, const IndexType* indexBuffer, size_t numTriangles, bool backfaceVisible = false, bool transparency = false)
+    {
+        if (numInstances == 0 || numVertices == 0)
+            return;
+        size_t batch = Min(Max(INSTANCE_BATCH_VERTICES / numVertices, (size_t)1), numInstances);
+        vec4* vs = new vec4[numVertices*batch];                // array to carry the clip-space vertices returned by vertexBuffer
+        Point<N>* points = new Point<N>[numVertices*batch];    // array to carry window space points and their attributes
+
+        for (size_t first=0; first<numInstances; first+=batch)
+        {
+            size_t count = Min(batch, numInstances - first);
+            ProcessInstances(points, vs, vertexShader, constants + first, count, vertexBuffer, numVertices);
+            for (size_t i=0; i<count; ++i)
+                RasterizeInstance(fragmentShader, constants[first + i], indexBuffer, numTriangles, backfaceVisible, vs + i*numVertices, points + i*numVertices, transparency);
+        }
         
         delete[] points;
         delete[] vs;
     }
         
+    // Draw the same triangles once for each of numInstances instances
+    //  The constants of each instance are built from the renderer and the instance, Constants(renderer, instance),
+    //  so drawing an instance changes no renderer state; Constants::Instance holds what differs between instances
+    template<int N, class Args, class IndexType, class Constants>
+    void DrawTrianglesInstanced(vec4(*vertexShader)(vec4[], const Args&, const Constants&), void(*fragmentShader)(Point<N>&, const Constants&), const Args* vertexBuffer, size_t numVertices, const IndexType* indexBuffer, size_t numTriangles,
+                                const typename Constants::Instance* instances, size_t numInstances, bool backfaceVisible = false, bool transparency = false,
+                                const PackingInfo& packing = PackingInfo())
+    {
+        std::vector<Constants> constants;
+        constants.reserve(numInstances);
+        for (size_t i=0; i<numInstances; ++i)
+            constants.push_back(Constants(*this, instances[i], packing));
+        if (!constants.empty())
+            DrawTrianglesWithConstants(vertexShader, fragmentShader, &constants[0], numInstances, vertexBuffer, numVertices, indexBuffer, numTriangles, backfaceVisible, transparency);
+    }
+
+    // Process the vertices of count instances, each with its constants, those of instance i into the arrays from i*numVertices on
+    template<int N, class Args, class Constants>
+    void ProcessInstances(Point<N>* points, vec4* vs, vec4(*vertexShader)(vec4[], const Args&, const Constants&), const Constants* constants, size_t count,
+                          const Args* vertexBuffer, size_t numVertices)
+    {
+#ifdef USE_MULTITHREADING
+        if (count > 1)
+        {
+            // Each thread processes its share of the instances
+            m_threader.Run([this, points, vs, vertexShader, constants, vertexBuffer, numVertices](int offset, size_t n) {
+                for (size_t i=size_t(offset); i<size_t(offset) + n; ++i)
+                    ProcessVertices(points + i*numVertices, vs + i*numVertices, vertexShader, constants[i], vertexBuffer, numVertices);
+            }, count);
+            return;
+        }
+#endif
+        for (size_t i=0; i<count; ++i)
+            ProcessVertices(points + i*numVertices, vs + i*numVertices, vertexShader, constants[i], vertexBuffer, numVertices);
+    }
+
+    // Rasterize the triangles of one instance, from its clip-space vertices and window-space points
+    template<int N, class IndexType, class Constants>
+    void RasterizeInstance(void(*fragmentShader)(Point<N>&, const Constants&), const Constants& constants, const IndexType* indexBuffer, size_t numTriangles, bool backfaceVisible,
+                           vec4* vs, Point<N>* points, bool transparency)
+    {
+#ifndef USE_MULTITHREADING
+        m_threader.DrawTriangles(fragmentShader, constants, indexBuffer, numTriangles, backfaceVisible, vs, points, transparency);
+#else
+        // Accumulating transparent fragments adds to the pixels without a depth test to keep threads apart, so it takes one thread
+        if (transparency && m_accumulating)
+            m_threader.DrawTriangles(fragmentShader, constants, indexBuffer, numTriangles, backfaceVisible, vs, points, transparency);
+        else
+            m_threader.DrawTrianglesThreaded(fragmentShader, constants, indexBuffer, numTriangles, backfaceVisible, vs, points, transparency);
+#endif
+    }
+
     // Process each vertex through vertexShader and
     //  fill 'newVertices' with resulting clip-space vertices
     //  and 'points' with corresponding window-space points and their attributes
-    template<int N, class Args>
-    void ProcessVertices(Point<N>*points, vec4* newVertices, vec4(*f)(vec4[], const Args&), Args* args, size_t numVertices)
+    template<int N, class Args, class Constants>
+    void ProcessVertices(Point<N>*points, vec4* newVertices, vec4(*f)(vec4[], const Args&, const Constants&), const Constants& constants, const Args* args, size_t numVertices)
     {
         
         vec4 v;
+        // Viewport covers the depth buffer in use
+        float targetWidth = (float)m_depthBuffers[m_depthBufferId].width;
+        float targetHeight = (float)m_depthBuffers[m_depthBufferId].height;
+        FrameCounters::Get().verticesShaded += numVertices;
         for (size_t i=0; i<numVertices; ++i)
         {
-            newVertices[i] = f(points[i].attribute, args[i]);
+            newVertices[i] = f(points[i].attribute, args[i], constants);
             bool t = false;
             for (int j=0; j<N; ++j)
                 points[i].attribute[j] = points[i].attribute[j];
@@ -116,8 +245,8 @@ public:
             ///###
 
             v = vec4(newVertices[i].ConvertToVec3(), newVertices[i].w);
-            v.x = (0.5f*v.x + 0.5f)*m_width;
-            v.y = (-0.5f*v.y + 0.5f)*m_height;
+            v.x = (0.5f*v.x + 0.5f)*targetWidth;
+            v.y = (-0.5f*v.y + 0.5f)*targetHeight;
 
             ///### TEMPORARY SOLUTION
             if (t) v.z += 2.0f;
@@ -133,32 +262,51 @@ public:
     int GetHeight() { return m_height; }
     void SetClearColor(RGBColor clearColor) { m_clearColor = clearColor; }
 
-    size_t AddDepthBuffer() { m_depthBuffers.push_back(new float[m_width*m_height]); return m_depthBuffers.size()-1; }
+    // Depth buffers are render targets of their own size, the size of the window by default
+    //  Drawing covers the depth buffer in use; color is only drawn while it is the size of the window
+    // A buffer can be padded by texels on all sides that are cleared but never drawn to
+    size_t AddDepthBuffer(int width = 0, int height = 0, int padding = 0);
     void UseDepthBuffer(size_t depthBufferId) { m_depthBufferId = depthBufferId; }
-    float* GetDepthBuffer(size_t depthBufferId) { return m_depthBuffers[depthBufferId]; }
+    float* GetDepthBuffer(size_t depthBufferId) { return m_depthBuffers[depthBufferId].data; }     // First texel inside the padding
+    int GetDepthBufferWidth(size_t depthBufferId) { return m_depthBuffers[depthBufferId].width; }
+    int GetDepthBufferHeight(size_t depthBufferId) { return m_depthBuffers[depthBufferId].height; }
+    int GetDepthBufferPitch(size_t depthBufferId) { return m_depthBuffers[depthBufferId].pitch; }  // Floats from a row to the next
+
+    // Copy a depth buffer into another of the same size
+    void CopyDepthBuffer(size_t fromId, size_t toId);
+
+    // Create shadow maps of given size, one for each of numCascades cascades, sampled with given filter
+    //  filterRadius is the radius in texels of the PCF kernel, or of the box filter of VSM moments
+    void CreateShadowMaps(int numCascades, int width, int height, SHADOW_FILTER filter = SHADOW_FILTER_PCF, int filterRadius = 1);
+    // Prefilter the shadow maps once drawn, if their filter needs it
+    void FilterShadowMaps();
+    // Check if the shadow caches still hold what static casters would draw now,
+    //  that is, nothing invalidated them and the light frustum of each cascade is the same as when they were drawn
+    // Either way the caches count as valid afterwards, so when they were not, they must be drawn again
+    bool ValidateShadowCache();
 
     // Clear the color-buffer
-    void ClearColor()
-    {
-        for (int i = 0; i < m_width; ++i)
-        for (int j = 0; j < m_height; ++j)
-            PutPixelUnsafe(i, j, m_clearColor); // Clear the color buffer
-    }
-    void ClearColorAndDepth()
-    {
-        for (int i = 0; i < m_width; ++i)
-        for (int j = 0; j < m_height; ++j)
-        {
-            PutPixelUnsafe(i, j, m_clearColor); // Clear the color buffer
-            m_depthBuffers[m_depthBufferId][j*m_width+i] = 1.0f; // Clear the depth buffer
-        }
-    }
-    void ClearDepth()
-    {
-        for (int i = 0; i < m_width; ++i)
-        for (int j = 0; j < m_height; ++j)
-            m_depthBuffers[m_depthBufferId][j*m_width+i] = 1.0f; // Clear the depth buffer
-    }
+    void ClearColor();
+    // Clear the depth buffer in use
+    void ClearDepth();
+    // Clear both; with lazy clears, drawing into the window-sized depth buffer only marks its tiles to be cleared
+    void ClearColorAndDepth();
+    // Clear lazily, by tiles as they are drawn into, and fill the color of tiles not drawn into only before presenting
+    //  Costs nothing where a frame's opaque geometry covers the window, and nothing again where nothing ever draws
+    void SetLazyClear(bool lazyClear);
+
+    // How transparent draws are blended
+    //  TRANSPARENCY_BLEND blends each fragment over the color buffer as it's drawn: the result depends on draw order,
+    //  and transparent surfaces hide those behind them drawn later
+    //  TRANSPARENCY_WEIGHTED accumulates fragments, weighted by alpha and depth, without writing depth,
+    //  and resolves them over the color buffer at the end of the pass: no order matters, for an approximation of sorted blending
+    //  With USE_MULTITHREADING its transparent triangles are drawn on one thread, as their fragments add to pixels unsynchronized;
+    //  only the resolve is split between threads
+    enum TRANSPARENCY_MODE { TRANSPARENCY_BLEND, TRANSPARENCY_WEIGHTED };
+    void SetTransparencyMode(TRANSPARENCY_MODE mode) { m_transparencyMode = mode; }
+    // Begin and end the transparent pass, around its draws
+    void BeginTransparency();
+    void ResolveTransparency();
 
     struct
     {
@@ -168,18 +316,52 @@ public:
             bias_light_mvp, // Texture matrix == Model-View-Projection matrix for light space combined with bias matrix
 
             vp,             // View-Projection matrix
-            light_vp;       // View-Projection matrix for light space
+            view, proj,     // View and projection matrices of the camera
+            light_vp,       // View-Projection matrix for light space
+            bias;           // Bias matrix for texture transformation, from clip space to texture space
 
         vec3 camPos;        // Position of camera needed for some lighting calculations
+        float projScale;    // Size in pixels of a unit length at unit distance from camera
 
     } transforms;
     
-    struct
+    struct LightInfo
     {
         vec3 direction;
         vec3 diffuse, specular, ambient;
     } light;
 
+    // Point and spot lights, culled into the light grid for the camera by CullLights once a frame
+    //  Shaders only read the grid, so lights can change between recording draws and executing them
+    std::vector<LocalLight> lights;
+    LightGrid lightGrid;
+    void CullLights() { lightGrid.Build(lights, transforms.view, transforms.proj, m_width, m_height); }
+
+    // Shadow maps of the light, one for each cascade
+    //  Each cascade covers a slice of the camera frustum; with one cascade, its map covers all of light_vp
+    static const int MAX_SHADOW_CASCADES = 4;
+    struct ShadowInfo
+    {
+        int numCascades;
+        size_t depthBuffers[MAX_SHADOW_CASCADES];
+        mat4 crop[MAX_SHADOW_CASCADES];     // Scale and offset from light clip space to clip space of each cascade
+        float splits[MAX_SHADOW_CASCADES];  // Window-space depth of the camera where each cascade ends
+        float distance;                     // Distance from the camera covered by the cascades
+        int cascade;                        // Cascade being drawn by the shadow pass
+
+        // Static casters are drawn into a cache of each shadow map, which the maps start from every frame
+        size_t cacheBuffers[MAX_SHADOW_CASCADES];
+        mat4 cacheVP[MAX_SHADOW_CASCADES];  // Light view-projection of each cascade when its cache was drawn
+        bool cacheValid;                    // Cleared when static casters change
+
+        SHADOW_FILTER filter;
+        int filterRadius;
+        float darkness;                     // Light taken away from pixels fully in shadow
+        float minVariance, lightBleeding;   // See SampleShadowVSM
+        std::vector<float> moments[MAX_SHADOW_CASCADES];   // Prefiltered moments of each map, for VSM
+        std::vector<float> momentsScratch;
+    } shadows;
+
 private:
     uint32_t* m_framebuffer;
     int m_width, m_height;
@@ -187,7 +369,17 @@ private:
     
     SDL_Window* m_window;
     SDL_Surface* m_screen;
-    std::vector<float*> m_depthBuffers;
+    bool m_offscreen;
+    uint32_t* m_colorAllocation;    // Of the color buffer when offscreen
+    struct DepthBuffer
+    {
+        float* allocation;
+        float* memory;      // Whole buffer, padding included, starting on a cache line
+        size_t size;
+        float* data;        // First texel inside the padding
+        int width, height, pitch;
+    };
+    std::vector<DepthBuffer> m_depthBuffers;
     size_t m_depthBufferId;
 
     std::function<void()> m_render;
@@ -196,27 +388,118 @@ private:
     RGBColor m_clearColor;
 
     RenderThreadManager m_threader;
+    bool m_lazyClear;
+    ClearTiles m_clearTiles;    // Of the color buffer and the window-sized depth buffer cleared lazily
+    TRANSPARENCY_MODE m_transparencyMode;
+    bool m_accumulating;                // In the transparent pass, with weighted blending
+    std::vector<float> m_accumulation;  // Of each pixel, color times weight then weight, of the transparent fragments
+    std::vector<float> m_revealage;     // Of each pixel, how much of the color buffer the transparent fragments let through
+
+    DirtyTiles m_dirtyTiles;
+    FrameStatistics m_statistics;
+    std::vector<DirtyTiles::Rect> m_dirtyRects;
+    std::vector<SDL_Rect> m_presentRects;
+
+    void DrawFrame();
+    // Update the window with the tiles of the frame that changed since the last one presented
+    void Present();
+    // Clear what is still to be cleared lazily of given depth buffer, before using it otherwise than drawing
+    void FlushClear(const float* depth) { if (m_clearTiles.IsAttachedTo(depth)) m_clearTiles.Flush(); }
 };
 
 // A class to store shaders
 // Shaders are stored as template arguments, which
 // MIGHT help compile time optimization
-template<Renderer& renderer, class VertexType, int NoOfAttributes,
-        vec4(*vertexShader)(vec4[], const VertexType&), void(*fragmentShader)(Point<NoOfAttributes>&), bool backfaceVisible=false>
+// Constants is the per-draw constant block of the shaders, constructed from the renderer for each draw
+template<Renderer& renderer, class VertexType, int NoOfAttributes, class Constants,
+        vec4(*vertexShader)(vec4[], const VertexType&, const Constants&), void(*fragmentShader)(Point<NoOfAttributes>&, const Constants&), bool backfaceVisible=false>
 class Shaders
 {
 public:
-    void DrawTriangles(std::vector<VertexType>& vertices, std::vector<uint16_t>& indices, bool transparency=false)
+    static Renderer& GetRenderer() { return renderer; }
+
+    // packing holds the ranges to unpack packed vertices with
+    template<class IndexType>
+    void DrawTriangles(const std::vector<VertexType>& vertices, const std::vector<IndexType>& indices, bool transparency=false, const PackingInfo& packing=PackingInfo())
     {
-        renderer.DrawTriangles(vertexShader, fragmentShader, &vertices[0], vertices.size(), &indices[0], indices.size()/3, backfaceVisible, transparency);
+        renderer.DrawTriangles(vertexShader, fragmentShader, &vertices[0], vertices.size(), &indices[0], indices.size()/3, backfaceVisible, transparency, packing);
+    }
+    // Draw once for each instance, Constants::Instance holding what differs between them
+    template<class IndexType>
+    void DrawTrianglesInstanced(const std::vector<VertexType>& vertices, const std::vector<IndexType>& indices, const typename Constants::Instance* instances, size_t numInstances,
+                                bool transparency=false, const PackingInfo& packing=PackingInfo())
+    {
+        renderer.DrawTrianglesInstanced(vertexShader, fragmentShader, &vertices[0], vertices.size(), &indices[0], indices.size()/3,
+                                        instances, numInstances, backfaceVisible, transparency, packing);
+    }
+
+    // Record drawing into a command list instead, with constants built now
+    //  The buffers are read as they are when the command is executed; owner, such as the mesh holding them,
+    //  is kept alive by the command until then
+    template<class IndexType>
+    void RecordTriangles(CommandList& commands, const std::vector<VertexType>& vertices, const std::vector<IndexType>& indices, bool transparency=false,
+                         const std::shared_ptr<const void>& owner=nullptr, const PackingInfo& packing=PackingInfo())
+    {
+        RecordTrianglesWithConstants(commands, vertices, indices, std::vector<Constants>(1, Constants(renderer, packing)), transparency, owner);
+    }
+    template<class IndexType>
+    void RecordTrianglesInstanced(CommandList& commands, const std::vector<VertexType>& vertices, const std::vector<IndexType>& indices, const typename Constants::Instance* instances, size_t numInstances,
+                                  bool transparency=false, const std::shared_ptr<const void>& owner=nullptr, const PackingInfo& packing=PackingInfo())
+    {
+        std::vector<Constants> constants;
+        constants.reserve(numInstances);
+        for (size_t i=0; i<numInstances; ++i)
+            constants.push_back(Constants(renderer, instances[i], packing));
+        RecordTrianglesWithConstants(commands, vertices, indices, constants, transparency, owner);
+    }
+
+private:
+    template<class IndexType>
+    void RecordTrianglesWithConstants(CommandList& commands, const std::vector<VertexType>& vertices, const std::vector<IndexType>& indices, const std::vector<Constants>& constants, bool transparency,
+                                      const std::shared_ptr<const void>& owner)
+    {
+        if (constants.empty())
+            return;
+        // The vectors rather than their contents, which move when they are reallocated
+        const std::vector<VertexType>* vertexBuffer = &vertices;
+        const std::vector<IndexType>* indexBuffer = &indices;
+        commands.Record([=](Renderer& r) {
+            (void)owner;     // Only held, to keep the buffers alive
+            if (vertexBuffer->empty() || indexBuffer->empty())
+                return;
+            r.DrawTrianglesWithConstants(vertexShader, fragmentShader, &constants[0], constants.size(),
+                                         &(*vertexBuffer)[0], vertexBuffer->size(), &(*indexBuffer)[0], indexBuffer->size()/3, backfaceVisible, transparency);
+        });
     }
 };
 
-template<int N>
-inline void RenderThreadManager::DrawTriangles(void(*fragmentShader)(Point<N>&), uint16_t* indexBuffer, size_t numTriangles, bool backfaceVisible,
+// Shaders of a material for several vertex formats (float, packed, ...)
+//  Each of the given Shaders classes handles one format,
+//  and the overload to use is picked from the type of vertices being drawn
+template<class First, class... Rest>
+class VertexFormatShaders : public First, public VertexFormatShaders<Rest...>
+{
+public:
+    using First::GetRenderer;
+    using First::DrawTriangles;
+    using VertexFormatShaders<Rest...>::DrawTriangles;
+    using First::DrawTrianglesInstanced;
+    using VertexFormatShaders<Rest...>::DrawTrianglesInstanced;
+    using First::RecordTriangles;
+    using VertexFormatShaders<Rest...>::RecordTriangles;
+    using First::RecordTrianglesInstanced;
+    using VertexFormatShaders<Rest...>::RecordTrianglesInstanced;
+};
+template<class Last>
+class VertexFormatShaders<Last> : public Last
+{};
+
+template<int N, class Constants, class IndexType>
+inline void RenderThreadManager::DrawTriangles(void(*fragmentShader)(Point<N>&, const Constants&), const Constants& constants, const IndexType* indexBuffer, size_t numTriangles, bool backfaceVisible,
                     vec4* vs, Point<N>* points, bool transparency, int offset)
 {
     indexBuffer += offset*3;
+    uint64_t clipped = 0, culled = 0;
     for (size_t i=0; i<numTriangles; ++i)
     {
         size_t i1 = indexBuffer[i*3], i2 = indexBuffer[i*3+1], i3 = indexBuffer[i*3+2];
@@ -228,13 +511,24 @@ inline void RenderThreadManager::DrawTriangles(void(*fragmentShader)(Point<N>&),
             (vs[i1].x > vs[i1].w && vs[i2].x > vs[i2].w && vs[i3].x > vs[i3].w) ||
             (vs[i1].y > vs[i1].w && vs[i2].y > vs[i2].w && vs[i3].y > vs[i3].w) ||
             (vs[i1].z > vs[i1].w && vs[i2].z > vs[i2].w && vs[i3].z > vs[i3].w))
+        {
+            ++clipped;
             continue;
+        }
 
         // BackFace or FrontFace Culling
         static int C = 0;
         C = (points[i2].x-points[i1].x) * (points[i3].y-points[i1].y)
                 - (points[i3].x-points[i1].x) * (points[i2].y-points[i1].y);
         if (backfaceVisible?C > 0:C < 0)
-           renderer->DrawTriangle(points[i1], points[i2], points[i3], fragmentShader, transparency);
+           renderer->DrawTriangle(points[i1], points[i2], points[i3], fragmentShader, constants, transparency);
+        else
+            ++culled;
     }
+
+    FrameCounters& counters = FrameCounters::Get();
+    counters.trianglesSubmitted += numTriangles;
+    counters.trianglesClipped += clipped;
+    counters.trianglesCulled += culled;
+    counters.trianglesRasterized += numTriangles - clipped - culled;
 }
@@ -0,0 +1,76 @@
+#pragma once
+
+// Sampling of shadow maps by shaders
+//  Maps hold the depth closest to the light; a pixel is in shadow where its own light-space depth is farther
+
+enum SHADOW_FILTER
+{
+    SHADOW_FILTER_PCF,      // Percentage-closer filtering: compare depth with each texel of a kernel
+    SHADOW_FILTER_VSM,      // Variance shadow maps: one fetch of prefiltered depth moments
+};
+
+// Shadow maps are padded by this many lit texels on each side,
+//  so PCF taps need no bounds checks as long as the kernel radius is at most SHADOW_MAX_PCF_RADIUS
+//  (taps are read four at a time, hence 3 texels more to the right)
+const int SHADOW_MAP_PADDING = 8;
+const int SHADOW_MAX_PCF_RADIUS = SHADOW_MAP_PADDING - 3;
+
+// Fraction of the (2*radius+1)^2 texels around (x, y) in shadow map coordinates that are closer to the light than depth
+//  map points at texel (0, 0) of a padded map with rows pitch floats apart
+//  Outside the map nothing is in shadow
+inline float SampleShadowPCF(const float* map, int width, int height, int pitch, int radius, float x, float y, float depth)
+{
+    if (!(x >= 0.0f && y >= 0.0f && x < (float)width && y < (float)height))
+        return 0.0f;
+    int taps = 2*radius+1;
+    const float* row = map + ((int)y - radius)*pitch + (int)x - radius;
+    int shadowed = 0;
+#ifdef USE_SSE_KERNELS
+    // Compare four taps of a row at a time, dropping those past the end of the row
+    static const int bitCount[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+    const int lastMask = (1 << ((taps-1)%4 + 1)) - 1;
+    __m128 reference = _mm_set1_ps(depth);
+    for (int j=0; j<taps; ++j, row += pitch)
+        for (int i=0; i<taps; i+=4)
+        {
+            int mask = _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(row + i), reference));
+            shadowed += bitCount[i+4 > taps ? mask & lastMask : mask];
+        }
+#else
+    for (int j=0; j<taps; ++j, row += pitch)
+        for (int i=0; i<taps; ++i)
+            shadowed += row[i] < depth;
+#endif
+    return float(shadowed) / float(taps*taps);
+}
+
+// Fraction of light blocked at depth, from prefiltered moments (mean depth and mean squared depth) of a map
+//  moments holds width*height pairs, fetched with bilinear filtering
+//  Chebyshev's inequality bounds the fraction of the filter area lit; the lowest lightBleeding of it is cut
+//  to darken the light leaking where casters overlap
+inline float SampleShadowVSM(const float* moments, int width, int height, float minVariance, float lightBleeding, float x, float y, float depth)
+{
+    x -= 0.5f;
+    y -= 0.5f;
+    if (!(x >= 0.0f && y >= 0.0f && x < (float)(width-1) && y < (float)(height-1)))
+        return 0.0f;
+    int ix = (int)x, iy = (int)y;
+    float fx = x - (float)ix, fy = y - (float)iy;
+    const float* m00 = moments + 2*(iy*width + ix);
+    const float* m10 = m00 + 2*width;
+    float mean = (m00[0]*(1.0f-fx) + m00[2]*fx)*(1.0f-fy) + (m10[0]*(1.0f-fx) + m10[2]*fx)*fy;
+    float meanSquare = (m00[1]*(1.0f-fx) + m00[3]*fx)*(1.0f-fy) + (m10[1]*(1.0f-fx) + m10[3]*fx)*fy;
+
+    if (depth <= mean)
+        return 0.0f;
+    float variance = Max(meanSquare - mean*mean, minVariance);
+    float d = depth - mean;
+    float lit = variance / (variance + d*d);
+    lit = Min(Max((lit - lightBleeding) / (1.0f - lightBleeding), 0.0f), 1.0f);
+    return 1.0f - lit;
+}
+
+// Fill moments with depth and squared depth of a map, box filtered over (2*radius+1)^2 texels
+//  moments must hold width*height pairs; map rows are pitch floats apart
+//  scratch is resized to hold the intermediate result
+void ComputeShadowMoments(const float* map, int width, int height, int pitch, int radius, float* moments, std::vector<float>& scratch);
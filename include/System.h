@@ -4,6 +4,8 @@
 class SystemBase
 {
 public:
+    SystemBase() : m_renderQueue(NULL), m_staticShadowQueue(NULL) {}
+
     virtual void Initialize() {};
     virtual void CleanUp() {};
     virtual void Update(double dt) {};
@@ -14,8 +16,20 @@ public:
 
     virtual void AddEntity(Entity* entity) { m_entities.push_back(entity); };
 
+    // Add draws of the render passes to a queue shared by all systems, to be sorted and executed later,
+    //  instead of drawing them; NULL draws at the end of each pass
+    // Shadow casters that don't move by themselves go to staticShadowQueue if given,
+    //  for drawing into the shadow cache; systems clear Renderer::shadows.cacheValid when these change
+    void SetRenderQueue(RenderQueue* queue, RenderQueue* staticShadowQueue = NULL)
+    {
+        m_renderQueue = queue;
+        m_staticShadowQueue = staticShadowQueue;
+    }
+
 protected:
     std::vector<Entity*> m_entities;
+    RenderQueue* m_renderQueue;
+    RenderQueue* m_staticShadowQueue;
 };
 
 template<class... Args>
@@ -48,62 +62,308 @@ private:
     
 };
 
-extern mat4 bias_matrix;
-
 template <class T>
 class MeshRenderSystem : public System<TransformComponent, MeshComponent<T>>
 {
 public:
-    MeshRenderSystem(Renderer* renderer) : m_renderer(renderer) {}
+    // With multiView, the shadow pass transforms each vertex for camera and light in one sweep,
+    //  and later passes of the frame draw from those vertices instead of transforming them again
+    MeshRenderSystem(Renderer* renderer, bool multiView=false) : m_renderer(renderer), m_multiView(multiView) {}
     
+    // Each pass adds its draws to the render queue, with the constants of every instance taken as they are recorded
+    //  Without a render queue set, the draws are sorted and executed at the end of the pass
+    //  The shadow pass draws all casters into the shadow map of each cascade
     void RenderShadow()
     {
-        for (size_t i=0; i< SystemBase::m_entities.size(); ++i)
+        if (m_multiView)
         {
-            Entity* entity = SystemBase::m_entities[i];
-            auto mc = entity->GetComponent<MeshComponent<T>>();
-            m_renderer->transforms.model = entity->GetComponent<TransformComponent>()->GetTransform()
-                                            * Scale(mc->scale);
-            m_renderer->transforms.mvp = m_renderer->transforms.light_vp * m_renderer->transforms.model;
-            mc->mesh.Draw(shadersDepth);
+            GatherInstances(true, true, true);
+            TransformViews();
         }
+        else
+        {
+            GatherInstances(true, true, false);
+            SortInstances(PASS_SHADOW);
+        }
+        CheckStaticCasters();
 
-     
+        auto& shadows = m_renderer->shadows;
+        for (shadows.cascade = 0; shadows.cascade < shadows.numCascades; ++shadows.cascade)
+        {
+            unsigned cascade = (unsigned)shadows.cascade;
+            mat4 cascadeVP = shadows.crop[cascade] * m_renderer->transforms.light_vp;
+            auto depthInstance = [cascadeVP](const Instance& instance) {
+                DepthConstants::Instance depth;
+                depth.mvp = cascadeVP * instance.model;
+                return depth;
+            };
+            if (m_multiView)
+                DrawViews(shadersDepth, depthInstance, PASS_SHADOW, true, true, false, cascade);
+            else
+            {
+                // Only depth is needed, so draw positions alone
+                DrawBatches<DepthConstants::Instance>(PASS_SHADOW, depthInstance,
+                    [](CommandList& commands, MeshComponent<T>* mc, const DepthConstants::Instance* instances, size_t numInstances) {
+                        auto shaders = Record(shadersDepth, commands, mc->mesh);
+                        mc->mesh->DrawPositionsInstanced(shaders, instances, numInstances, mc->lod, &mc->pose);
+                    }, cascade);
+            }
+        }
+        shadows.cascade = 0;
+        ExecuteImmediate();
     }
     void Render()
     {
-        for (size_t i=0; i<SystemBase::m_entities.size(); ++i)
+        if (m_multiView)
+            DrawViews(T::GetShaders(), SurfaceInstance, PASS_OPAQUE, true, false, false);
+        else
         {
-            Entity* entity = SystemBase::m_entities[i];
-            auto mc = entity->GetComponent<MeshComponent<T>>();
-            if (mc->transparent)
-                continue;
-            m_renderer->transforms.model = entity->GetComponent<TransformComponent>()->GetTransform()
-                                            * Scale(mc->scale);
-            m_renderer->transforms.mvp = m_renderer->transforms.vp * m_renderer->transforms.model;
-            m_renderer->transforms.bias_light_mvp = bias_matrix * m_renderer->transforms.light_vp * m_renderer->transforms.model;
-            mc->material.DrawMesh(mc->mesh);
+            GatherInstances(true, false, true);
+            SortInstances(PASS_OPAQUE);
+            DrawBatches<ShaderInstance>(PASS_OPAQUE, SurfaceInstance,
+                [](CommandList& commands, MeshComponent<T>* mc, const ShaderInstance* instances, size_t numInstances) {
+                    auto shaders = Record(T::GetShaders(), commands, mc->mesh);
+                    mc->mesh->DrawInstanced(shaders, instances, numInstances, false, mc->lod, &mc->pose);
+                });
         }
+        ExecuteImmediate();
     }
 
     void PostRender()
     {
+        if (m_multiView)
+            DrawViews(T::GetShaders(), SurfaceInstance, PASS_TRANSPARENT, false, true, true);
+        else
+        {
+            GatherInstances(false, true, true);
+            DrawBatches<ShaderInstance>(PASS_TRANSPARENT, SurfaceInstance,
+                [](CommandList& commands, MeshComponent<T>* mc, const ShaderInstance* instances, size_t numInstances) {
+                    auto shaders = Record(T::GetShaders(), commands, mc->mesh);
+                    mc->mesh->DrawInstanced(shaders, instances, numInstances, true, mc->lod, &mc->pose);
+                });
+        }
+        ExecuteImmediate();
+    }
+
+private:
+    Renderer* m_renderer;
+
+    // An entity drawn as one instance of its mesh
+    struct Instance
+    {
+        MeshComponent<T>* mc;
+        mat4 model;
+        vec3 position;
+    };
+    std::vector<Instance> m_instances;
+
+    // An instance as the shaders of the material draw it: placed by its model matrix, with the uniforms of its material
+    //  Built apart for each instance, so that drawing them changes no renderer state
+    typedef typename T::ShadersClass::Instance ShaderInstance;
+    static ShaderInstance SurfaceInstance(const Instance& instance)
+    {
+        ShaderInstance surface = ShaderInstance();
+        surface.model = instance.model;
+        instance.mc->material.GetUniforms(surface.material);
+        return surface;
+    }
+
+    RenderQueue m_immediateQueue;       // Draws of the current pass when no render queue is set
+    CommandList m_immediateCommands;
+
+    RenderQueue& GetRenderQueue()
+    {
+        return SystemBase::m_renderQueue ? *SystemBase::m_renderQueue : m_immediateQueue;
+    }
+    // Queue for a draw of an instance in the given pass
+    RenderQueue& GetRenderQueue(unsigned pass, const Instance& instance)
+    {
+        if (pass == PASS_SHADOW && SystemBase::m_staticShadowQueue && IsStaticCaster(instance))
+            return *SystemBase::m_staticShadowQueue;
+        return GetRenderQueue();
+    }
+    void ExecuteImmediate()
+    {
+        if (m_immediateQueue.IsEmpty())
+            return;
+        m_immediateQueue.Flush(m_immediateCommands);
+        m_immediateCommands.Execute(*m_renderer);
+        m_immediateCommands.Clear();
+    }
+
+    // Animated meshes change shape every frame; other casters only change when moved
+    static bool IsStaticCaster(const Instance& instance)
+    {
+        return !instance.mc->mesh->IsAnimated();
+    }
+
+    // Static casters as they were last drawn into the shadow cache
+    struct CasterState
+    {
+        const Mesh* mesh;
+        size_t lod;
+        mat4 model;
+
+        bool operator==(const CasterState& other) const
+        {
+            if (mesh != other.mesh || lod != other.lod)
+                return false;
+            for (int i=0; i<4; ++i)
+                for (int j=0; j<4; ++j)
+                    if (model.m[i][j] != other.model.m[i][j])
+                        return false;
+            return true;
+        }
+    };
+    std::vector<CasterState> m_staticCasters;
+
+    // Invalidate the shadow cache if static casters of the gathered instances differ from last frame
+    void CheckStaticCasters()
+    {
+        std::vector<CasterState> casters;
+        for (size_t i=0; i<m_instances.size(); ++i)
+        {
+            if (!IsStaticCaster(m_instances[i]))
+                continue;
+            CasterState state;
+            state.mesh = m_instances[i].mc->mesh.get();
+            state.lod = m_instances[i].mc->lod;
+            state.model = m_instances[i].model;
+            casters.push_back(state);
+        }
+        if (casters != m_staticCasters)
+            m_renderer->shadows.cacheValid = false;
+        m_staticCasters.swap(casters);
+    }
+
+    bool m_multiView;
+    std::vector<std::vector<MultiViewVertex>> m_views;  // Vertices of each instance transformed for all views
+
+    // Key of a draw of this system's material at the given instance
+    //  The shadow pass draws all materials with the same depth shaders, so its draws are sorted by depth alone
+    uint64_t DrawKey(unsigned pass, const Instance& instance, unsigned layer)
+    {
+        return RenderQueue::DrawKey(pass, pass == PASS_SHADOW ? 0 : MaterialId<T>(), SortDepth(pass, instance), layer);
+    }
+    // Distance to sort draws by: along the light direction for the shadow pass, from the camera otherwise
+    float SortDepth(unsigned pass, const Instance& instance)
+    {
+        if (pass == PASS_SHADOW)
+            return (m_renderer->transforms.light_vp * vec4(instance.position)).z + 1.0f;
+        return (instance.position - m_renderer->transforms.camPos).Length();
+    }
+
+    // Collect opaque and/or transparent entities to draw
+    void GatherInstances(bool opaque, bool transparent, bool selectLOD)
+    {
+        m_instances.clear();
         for (size_t i=0; i<SystemBase::m_entities.size(); ++i)
         {
             Entity* entity = SystemBase::m_entities[i];
             auto mc = entity->GetComponent<MeshComponent<T>>();
-            if (!mc->transparent)
+            if (!mc->mesh || (mc->transparent ? !transparent : !opaque))
                 continue;
-            m_renderer->transforms.model = entity->GetComponent<TransformComponent>()->GetTransform()
-                                            * Scale(mc->scale);
-            m_renderer->transforms.mvp = m_renderer->transforms.vp * m_renderer->transforms.model;
-            m_renderer->transforms.bias_light_mvp = bias_matrix * m_renderer->transforms.light_vp * m_renderer->transforms.model;
-            mc->material.DrawMesh(mc->mesh, true);
+            if (selectLOD)
+                SelectLOD(entity, mc);
+            Instance instance;
+            instance.mc = mc;
+            instance.model = entity->GetComponent<TransformComponent>()->GetTransform() * Scale(mc->scale);
+            instance.position = entity->GetComponent<TransformComponent>()->GetPosition();
+            m_instances.push_back(instance);
         }
     }
 
-private:
-    Renderer* m_renderer;
+    // Sort opaque instances sharing mesh and level of detail next to each other, near to far within them
+    void SortInstances(unsigned pass)
+    {
+        std::vector<float> depths(m_instances.size());
+        for (size_t i=0; i<m_instances.size(); ++i)
+            depths[i] = SortDepth(pass, m_instances[i]);
+        std::vector<size_t> order(m_instances.size());
+        for (size_t i=0; i<order.size(); ++i)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [this, &depths](size_t i, size_t j) {
+            const Instance& a = m_instances[i];
+            const Instance& b = m_instances[j];
+            if (a.mc->mesh != b.mc->mesh)
+                return std::less<const Mesh*>()(a.mc->mesh.get(), b.mc->mesh.get());
+            if (a.mc->lod != b.mc->lod)
+                return a.mc->lod < b.mc->lod;
+            return depths[i] < depths[j];
+        });
+        std::vector<Instance> sorted(m_instances.size());
+        for (size_t i=0; i<order.size(); ++i)
+            sorted[i] = m_instances[order[i]];
+        m_instances.swap(sorted);
+    }
+
+    // Instances can be drawn together if they share mesh and level of detail,
+    //  and also the pose for animated meshes
+    //  Transparent instances are drawn one by one, so each is blended in its own place in the queue
+    static bool SameBatch(const Instance& a, const Instance& b)
+    {
+        return a.mc->mesh == b.mc->mesh && a.mc->lod == b.mc->lod && !a.mc->transparent && !b.mc->transparent
+            && (!a.mc->mesh->IsAnimated() || a.mc == b.mc);
+    }
+
+    // Add each run of instances that can be drawn together to the render queue as a single instanced draw
+    //  keyed by its nearest instance
+    //  makeInstance(instance) gives what the shaders draw an instance with,
+    //  draw(commands, mc, instances, numInstances) records drawing the mesh of mc for each of them
+    template<class ShadersInstance, class MakeInstance, class Draw>
+    void DrawBatches(unsigned pass, MakeInstance makeInstance, Draw draw, unsigned layer = 0)
+    {
+        std::vector<ShadersInstance> batch;
+        for (size_t i=0; i<m_instances.size(); )
+        {
+            uint64_t key = DrawKey(pass, m_instances[i], layer);
+            size_t j = i+1;
+            while (j < m_instances.size() && SameBatch(m_instances[i], m_instances[j]))
+                key = Min(key, DrawKey(pass, m_instances[j++], layer));
+            batch.clear();
+            for (size_t k=i; k<j; ++k)
+                batch.push_back(makeInstance(m_instances[k]));
+            draw(GetRenderQueue(pass, m_instances[i]).Add(key), m_instances[i].mc, &batch[0], batch.size());
+            i = j;
+        }
+    }
+
+    // Run the multi-view vertex stage on all gathered instances
+    void TransformViews()
+    {
+        m_views.resize(m_instances.size());
+        mat4 mvps[NUM_VIEWS];
+        for (size_t i=0; i<m_instances.size(); ++i)
+        {
+            MeshComponent<T>* mc = m_instances[i].mc;
+            mvps[VIEW_CAMERA] = m_renderer->transforms.vp * m_instances[i].model;
+            mvps[VIEW_LIGHT] = m_renderer->transforms.light_vp * m_instances[i].model;
+            mc->mesh->TransformViews(m_views[i], mvps, mc->lod, &mc->pose);
+        }
+    }
+
+    // Add draws of opaque and/or transparent instances from their transformed vertices to the render queue
+    //  makeInstance(instance) gives what the shaders draw an instance with
+    template<class ShadersClass, class MakeInstance>
+    void DrawViews(ShadersClass& shaders, MakeInstance makeInstance, unsigned pass, bool opaque, bool transparent, bool transparency, unsigned layer = 0)
+    {
+        for (size_t i=0; i<m_instances.size(); ++i)
+        {
+            MeshComponent<T>* mc = m_instances[i].mc;
+            if (mc->transparent ? !transparent : !opaque)
+                continue;
+            auto recorder = Record(shaders, GetRenderQueue(pass, m_instances[i]).Add(DrawKey(pass, m_instances[i], layer)), mc->mesh);
+            mc->mesh->DrawViews(recorder, m_views[i], makeInstance(m_instances[i]), transparency, mc->lod);
+        }
+    }
+
+    // Choose level of detail from the size of the mesh as seen by the active camera
+    //  The shadow pass, which comes earlier, reuses the level chosen in previous frame
+    void SelectLOD(Entity* entity, MeshComponent<T>* mc)
+    {
+        vec3 d = entity->GetComponent<TransformComponent>()->GetPosition() - m_renderer->transforms.camPos;
+        mc->SelectLOD(m_renderer->transforms.projScale / Max(d.Length(), 0.0001f));
+    }
 };
 
 class CameraSystem : public System<TransformComponent, CameraComponent>
@@ -114,16 +374,16 @@ public:
     void SetActiveCamera(size_t cameraId) { m_activeCamera = cameraId; }
     size_t GetActiveCamera() const { return m_activeCamera; }
 
+    // The camera is set up in the first pass of the frame,
+    //  so that views transformed during the shadow pass use this frame's camera
+    //  Render sets it up again for frames drawn without a shadow pass
+    void RenderShadow()
+    {
+        SetupCamera();
+    }
     void Render()
     {
-        if (m_activeCamera >= m_entities.size())
-            return;
-        auto cam = m_entities[m_activeCamera]->GetComponent<CameraComponent>();
-        auto trans = m_entities[m_activeCamera]->GetComponent<TransformComponent>();
-        mat4 view  = trans->GetTransform().AffineInverse();
-        mat4 proj = cam->projection;
-        m_renderer->transforms.vp = proj * view;
-        m_renderer->transforms.camPos = trans->GetPosition();
+        SetupCamera();
     }
 
     void Resize(int width, int height)
@@ -138,4 +398,66 @@ public:
 private:
     Renderer* m_renderer;
     size_t m_activeCamera;
+
+    void SetupCamera()
+    {
+        if (m_activeCamera >= m_entities.size())
+            return;
+        auto cam = m_entities[m_activeCamera]->GetComponent<CameraComponent>();
+        auto trans = m_entities[m_activeCamera]->GetComponent<TransformComponent>();
+        mat4 view  = trans->GetTransform().AffineInverse();
+        mat4 proj = cam->projection;
+        m_renderer->transforms.vp = proj * view;
+        m_renderer->transforms.view = view;
+        m_renderer->transforms.proj = proj;
+        m_renderer->transforms.camPos = trans->GetPosition();
+        m_renderer->transforms.projScale = proj[1][1] * 0.5f * (float)m_renderer->GetHeight();
+        FitShadowCascades(cam, trans->GetTransform(), proj);
+    }
+
+    // Fit each shadow cascade to its slice of the camera frustum, as seen from the light
+    //  Slices end at distances between logarithmic and uniform splits of the shadow distance
+    void FitShadowCascades(const CameraComponent* cam, const mat4& cameraTransform, const mat4& proj)
+    {
+        const float SPLIT_BLEND = 0.75f;    // 1 for logarithmic splits, 0 for uniform ones
+        auto& shadows = m_renderer->shadows;
+        if (shadows.numCascades <= 1)
+            return;
+
+        float nearDist = cam->near, farDist = Min(cam->far, shadows.distance);
+        float tanX = 1.0f/proj[0][0], tanY = 1.0f/proj[1][1];
+        mat4 toLight = m_renderer->transforms.light_vp * cameraTransform;
+        float sliceNear = nearDist;
+        for (int k=0; k<shadows.numCascades; ++k)
+        {
+            float t = float(k+1)/float(shadows.numCascades);
+            float sliceFar = SPLIT_BLEND * nearDist*powf(farDist/nearDist, t) + (1.0f-SPLIT_BLEND) * (nearDist + (farDist-nearDist)*t);
+
+            // Bounds of the corners of the slice in light clip space
+            float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+            for (int c=0; c<8; ++c)
+            {
+                float d = (c & 4) ? sliceFar : sliceNear;
+                vec4 p = toLight * vec4((c & 1 ? tanX : -tanX)*d, (c & 2 ? tanY : -tanY)*d, -d, 1.0f);
+                minX = Min(minX, p.x);
+                maxX = Max(maxX, p.x);
+                minY = Min(minY, p.y);
+                maxY = Max(maxY, p.y);
+            }
+            // Margin of a few texels for the filter taps at the edges
+            float marginX = (maxX-minX) * 2.0f/(float)m_renderer->GetDepthBufferWidth(shadows.depthBuffers[k]);
+            float marginY = (maxY-minY) * 2.0f/(float)m_renderer->GetDepthBufferHeight(shadows.depthBuffers[k]);
+            minX -= marginX; maxX += marginX;
+            minY -= marginY; maxY += marginY;
+            float sx = 2.0f/(maxX-minX), sy = 2.0f/(maxY-minY);
+            shadows.crop[k] = mat4(sx, 0, 0, -(maxX+minX)*0.5f*sx,
+                                   0, sy, 0, -(maxY+minY)*0.5f*sy,
+                                   0, 0, 1, 0,
+                                   0, 0, 0, 1);
+
+            vec4 p = proj * vec4(0.0f, 0.0f, -sliceFar, 1.0f);
+            shadows.splits[k] = 0.5f*p.z/p.w + 0.5f;
+            sliceNear = sliceFar;
+        }
+    }
 };
@@ -0,0 +1,150 @@
+#pragma once
+#include "Bitmap.h"
+#include "TextureFormat.h"
+#include "fastmath.h"
+
+enum TEXTURE_FILTER
+{
+    TEXTURE_FILTER_NEAREST,     // Nearest texel of the most detailed level, like sampling the bitmap
+    TEXTURE_FILTER_BILINEAR,    // Bilinear filtering of the nearest mip level
+    TEXTURE_FILTER_TRILINEAR,   // Bilinear filtering of the two nearest mip levels, blended
+};
+
+// Texture with a chain of mip levels, each half the size of the previous one down to 1x1
+//  Each level is laid out in 4x4 tiles: 32 bit texels fill a 64 byte cache line per tile,
+//  BC1 blocks take 8 bytes per tile and 8 bit palette indices 16 bytes,
+//  so texels close in both directions (like the 2x2 of bilinear filtering) mostly share a cache line
+// Texture coordinates are clamped to the edges
+// The texture is held in the layout of texture files (see TextureFormat.h): built in memory from a bitmap,
+//  or a texture file mapped in place; copies of a texture share it
+class Texture
+{
+public:
+    Texture() : m_filter(TEXTURE_FILTER_TRILINEAR), m_format(TEXTURE_FORMAT_RGBA8), m_size(0), m_mapped(false),
+                m_texels(NULL), m_blocks(NULL), m_indices(NULL), m_palette(NULL) {}
+
+    // Build the mip chain of a bitmap, compressing it to the format
+    void Create(const Bitmap& bitmap, TEXTURE_FILTER filter = TEXTURE_FILTER_TRILINEAR, TEXTURE_FORMAT format = TEXTURE_FORMAT_RGBA8);
+    // Map a texture file, or load a bitmap file and create the texture in the format
+    //  Returns false if neither could be loaded
+    bool LoadFile(const std::string& filename, TEXTURE_FILTER filter = TEXTURE_FILTER_TRILINEAR, TEXTURE_FORMAT format = TEXTURE_FORMAT_RGBA8);
+
+    int GetWidth() const { return m_levels.empty() ? 0 : m_levels[0].width; }
+    int GetHeight() const { return m_levels.empty() ? 0 : m_levels[0].height; }
+    size_t GetNumLevels() const { return m_levels.size(); }
+    TEXTURE_FILTER GetFilter() const { return m_filter; }
+    TEXTURE_FORMAT GetFormat() const { return m_format; }
+    // Bytes taken by the texture, of memory allocated or of the file mapped
+    size_t GetMemorySize() const { return m_size; }
+    bool IsMapped() const { return m_mapped; }
+
+    // Sample at given texture coordinates, with their derivatives along x and y in window space
+    //  The derivatives give the level of detail
+    vec3 Sample(const vec2& uv, const vec2& ddx, const vec2& ddy) const
+    {
+        switch (m_format)
+        {
+        case TEXTURE_FORMAT_BC1:        return Sample<TEXTURE_FORMAT_BC1>(uv, ddx, ddy);
+        case TEXTURE_FORMAT_PALETTED:   return Sample<TEXTURE_FORMAT_PALETTED>(uv, ddx, ddy);
+        default:                        return Sample<TEXTURE_FORMAT_RGBA8>(uv, ddx, ddy);
+        }
+    }
+
+private:
+    struct Level
+    {
+        int width, height;
+        float fwidth, fheight;
+        int tilesPerRow;
+        size_t offset;          // Of the first tile, in tiles
+    };
+
+    TEXTURE_FILTER m_filter;
+    TEXTURE_FORMAT m_format;
+    std::vector<Level> m_levels;
+    std::shared_ptr<const uint8_t> m_memory;    // Image of a texture file
+    size_t m_size;
+    bool m_mapped;
+    // Tiles of all levels in m_memory, in one of the formats
+    const uint32_t* m_texels;
+    const BC1Block* m_blocks;
+    const uint8_t* m_indices;
+    const uint32_t* m_palette;
+
+    // Use the image of a texture file, checking its header
+    bool Attach(const std::shared_ptr<const uint8_t>& memory, size_t size, TEXTURE_FILTER filter, const std::string& name);
+
+    static float Clamp(float t) { return Min(Max(t, 0.0f), 1.0f); }
+
+    template<TEXTURE_FORMAT format>
+    vec3 Sample(const vec2& uv, const vec2& ddx, const vec2& ddy) const
+    {
+        const Level& top = m_levels[0];
+        if (m_filter == TEXTURE_FILTER_NEAREST || m_levels.size() == 1)
+        {
+            if (m_filter == TEXTURE_FILTER_NEAREST || (top.width == 1 && top.height == 1))
+                return Unpack(Fetch<format>(top, int(Clamp(uv.u)*top.fwidth), int(Clamp(uv.v)*top.fheight)));
+            return Unpack(SampleBilinear<format>(top, uv));
+        }
+
+        // Level where a pixel covers about one texel
+        float dx = ddx.u*top.fwidth, dy = ddx.v*top.fheight;
+        float lengthX = dx*dx + dy*dy;
+        dx = ddy.u*top.fwidth;
+        dy = ddy.v*top.fheight;
+        float lengthY = dx*dx + dy*dy;
+        float lod = 0.5f*Log2<SHADER_MATH_ACCURACY>(Max(Max(lengthX, lengthY), 1e-12f));
+
+        int maxLevel = (int)m_levels.size()-1;
+        if (lod <= 0.0f)
+            return Unpack(SampleBilinear<format>(top, uv));
+        if (lod >= (float)maxLevel)
+            return Unpack(SampleBilinear<format>(m_levels[maxLevel], uv));
+        if (m_filter == TEXTURE_FILTER_BILINEAR)
+            return Unpack(SampleBilinear<format>(m_levels[int(lod + 0.5f)], uv));
+        int level = (int)lod;
+        uint32_t weight = uint32_t((lod - (float)level)*256.0f);
+        return Unpack(LerpTexels(SampleBilinear<format>(m_levels[level], uv), SampleBilinear<format>(m_levels[level+1], uv), weight));
+    }
+
+    template<TEXTURE_FORMAT format>
+    uint32_t Fetch(const Level& level, int x, int y) const
+    {
+        x = Min(Max(x, 0), level.width-1);
+        y = Min(Max(y, 0), level.height-1);
+        size_t tile = level.offset + size_t((y >> 2)*level.tilesPerRow + (x >> 2));
+        int texel = ((y & 3) << 2) | (x & 3);
+        if (format == TEXTURE_FORMAT_BC1)
+            return DecodeBC1Texel(m_blocks[tile], texel);
+        if (format == TEXTURE_FORMAT_PALETTED)
+            return m_palette[m_indices[(tile << 4) + size_t(texel)]];
+        return m_texels[(tile << 4) + size_t(texel)];
+    }
+
+    template<TEXTURE_FORMAT format>
+    uint32_t SampleBilinear(const Level& level, const vec2& uv) const
+    {
+        // Texel centers are at half texels; x, y >= -0.5 so that truncating x+1 floors it
+        float x = Clamp(uv.u)*level.fwidth - 0.5f, y = Clamp(uv.v)*level.fheight - 0.5f;
+        int ix = (int)(x + 1.0f) - 1, iy = (int)(y + 1.0f) - 1;
+        uint32_t wx = uint32_t((x - (float)ix)*256.0f), wy = uint32_t((y - (float)iy)*256.0f);
+        if (format == TEXTURE_FORMAT_BC1 && (ix & 3) != 3 && (iy & 3) != 3 && ix >= 0 && iy >= 0 && ix+1 < level.width && iy+1 < level.height)
+        {
+            // All four texels in one block: decode its colors once
+            uint32_t colors[4];
+            const BC1Block& block = m_blocks[level.offset + size_t((iy >> 2)*level.tilesPerRow + (ix >> 2))];
+            DecodeBC1Colors(block, colors);
+            uint32_t indices = block.indices >> (2*(((iy & 3) << 2) | (ix & 3)));
+            return LerpTexels(LerpTexels(colors[indices & 3], colors[(indices >> 2) & 3], wx),
+                              LerpTexels(colors[(indices >> 8) & 3], colors[(indices >> 10) & 3], wx), wy);
+        }
+        return LerpTexels(LerpTexels(Fetch<format>(level, ix, iy), Fetch<format>(level, ix+1, iy), wx),
+                          LerpTexels(Fetch<format>(level, ix, iy+1), Fetch<format>(level, ix+1, iy+1), wx), wy);
+    }
+
+    static vec3 Unpack(uint32_t texel)
+    {
+        const float scale = 1.0f/255.0f;
+        return vec3(float((texel >> 16) & 0xff)*scale, float((texel >> 8) & 0xff)*scale, float(texel & 0xff)*scale);
+    }
+};
@@ -0,0 +1,382 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <string.h>
+
+// Formats textures are stored in, with the encoders used to build them, also by the asset pipeline
+//  Texels are packed 32 bit BGRA (alpha unused) going in and coming out
+enum TEXTURE_FORMAT
+{
+    TEXTURE_FORMAT_RGBA8,       // 32 bits per texel
+    TEXTURE_FORMAT_BC1,         // 4x4 blocks of two RGB565 endpoints and 2 bit indices: 4 bits per texel
+    TEXTURE_FORMAT_PALETTED,    // 8 bit indices into a palette of 256 colors for the whole texture
+};
+
+// Blend of packed texels a and b, weight of b from 0 to 256, two channels at a time
+inline uint32_t LerpTexels(uint32_t a, uint32_t b, uint32_t weight)
+{
+    uint32_t rb = (((a & 0xff00ff)*(256-weight) + (b & 0xff00ff)*weight) >> 8) & 0xff00ff;
+    uint32_t ag = (((a >> 8) & 0xff00ff)*(256-weight) + ((b >> 8) & 0xff00ff)*weight) & 0xff00ff00;
+    return rb | ag;
+}
+
+inline int TexelChannel(uint32_t texel, int channel)
+{
+    return int((texel >> (8*channel)) & 0xff);
+}
+
+// Squared distance of colors of two texels
+inline int TexelDistance(uint32_t a, uint32_t b)
+{
+    int distance = 0;
+    for (int k=0; k<3; ++k)
+    {
+        int d = TexelChannel(a, k) - TexelChannel(b, k);
+        distance += d*d;
+    }
+    return distance;
+}
+
+// Block of 4x4 texels; texel i (of y*4 + x) has index bits 2i and 2i+1
+//  Indices pick color0, color1, or the blends 1/3 and 2/3 of the way from color0 to color1
+//  color0 > color1 as in BC1, whose three color mode is never used
+struct BC1Block
+{
+    uint16_t color0, color1;
+    uint32_t indices;
+};
+
+inline uint32_t Expand565(uint16_t c)
+{
+    uint32_t r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    return 0xff000000 | ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+}
+
+inline uint16_t Pack565(int r, int g, int b)
+{
+    r = Min(Max(r, 0), 255);
+    g = Min(Max(g, 0), 255);
+    b = Min(Max(b, 0), 255);
+    return uint16_t(((r*31 + 127)/255) << 11 | ((g*63 + 127)/255) << 5 | ((b*31 + 127)/255));
+}
+
+inline uint32_t DecodeBC1Texel(const BC1Block& block, int texel)
+{
+    static const uint32_t weights[4] = {0, 256, 85, 171};
+    return LerpTexels(Expand565(block.color0), Expand565(block.color1), weights[(block.indices >> (2*texel)) & 3]);
+}
+
+// The four colors indices of a block pick from
+inline void DecodeBC1Colors(const BC1Block& block, uint32_t colors[4])
+{
+    colors[0] = Expand565(block.color0);
+    colors[1] = Expand565(block.color1);
+    colors[2] = LerpTexels(colors[0], colors[1], 85);
+    colors[3] = LerpTexels(colors[0], colors[1], 171);
+}
+
+// Endpoints are the extremes of the texels along their principal axis
+inline BC1Block EncodeBC1Block(const uint32_t texels[16])
+{
+    float mean[3] = {0.0f, 0.0f, 0.0f};
+    for (int i=0; i<16; ++i)
+        for (int k=0; k<3; ++k)
+            mean[k] += (float)TexelChannel(texels[i], k) / 16.0f;
+    float covariance[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};     // xx, xy, xz, yy, yz, zz
+    for (int i=0; i<16; ++i)
+    {
+        float d[3];
+        for (int k=0; k<3; ++k)
+            d[k] = (float)TexelChannel(texels[i], k) - mean[k];
+        covariance[0] += d[0]*d[0]; covariance[1] += d[0]*d[1]; covariance[2] += d[0]*d[2];
+        covariance[3] += d[1]*d[1]; covariance[4] += d[1]*d[2]; covariance[5] += d[2]*d[2];
+    }
+    float axis[3] = {1.0f, 1.0f, 1.0f};
+    for (int iteration=0; iteration<8; ++iteration)
+    {
+        float next[3] = {covariance[0]*axis[0] + covariance[1]*axis[1] + covariance[2]*axis[2],
+                         covariance[1]*axis[0] + covariance[3]*axis[1] + covariance[4]*axis[2],
+                         covariance[2]*axis[0] + covariance[4]*axis[1] + covariance[5]*axis[2]};
+        float length = Max(Max(fabsf(next[0]), fabsf(next[1])), fabsf(next[2]));
+        if (length == 0.0f)
+            break;
+        for (int k=0; k<3; ++k)
+            axis[k] = next[k] / length;
+    }
+
+    float lowest = 1e30f, highest = -1e30f;
+    for (int i=0; i<16; ++i)
+    {
+        float t = 0.0f;
+        for (int k=0; k<3; ++k)
+            t += ((float)TexelChannel(texels[i], k) - mean[k]) * axis[k];
+        lowest = Min(lowest, t);
+        highest = Max(highest, t);
+    }
+    float axisLength2 = axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2];
+    int ends[2][3];
+    for (int k=0; k<3; ++k)
+    {
+        ends[0][k] = (int)(mean[k] + axis[k]*highest/axisLength2 + 0.5f);
+        ends[1][k] = (int)(mean[k] + axis[k]*lowest/axisLength2 + 0.5f);
+    }
+
+    BC1Block block;
+    block.color0 = Pack565(ends[0][2], ends[0][1], ends[0][0]);
+    block.color1 = Pack565(ends[1][2], ends[1][1], ends[1][0]);
+    if (block.color0 < block.color1)
+        std::swap(block.color0, block.color1);
+    block.indices = 0;
+    if (block.color0 == block.color1)
+        return block;
+
+    BC1Block candidate = block;
+    uint32_t colors[4];
+    for (uint32_t index=0; index<4; ++index)
+    {
+        candidate.indices = index;
+        colors[index] = DecodeBC1Texel(candidate, 0);
+    }
+    for (int i=0; i<16; ++i)
+    {
+        uint32_t best = 0;
+        for (uint32_t index=1; index<4; ++index)
+            if (TexelDistance(texels[i], colors[index]) < TexelDistance(texels[i], colors[best]))
+                best = index;
+        block.indices |= best << (2*i);
+    }
+    return block;
+}
+
+// Palette of 256 colors for texels by median cut: the box of colors spanning the widest channel
+//  is split at its median along that channel until there are 256 boxes, each giving its average color
+inline void BuildPalette(const std::vector<uint32_t>& texels, uint32_t palette[256])
+{
+    struct Box
+    {
+        size_t begin, end;
+        int channel, range;
+    };
+    std::vector<uint32_t> colors(texels);
+    std::vector<Box> boxes;
+    auto addBox = [&](size_t begin, size_t end)
+    {
+        Box box = {begin, end, 0, -1};
+        for (int k=0; k<3; ++k)
+        {
+            int lowest = 255, highest = 0;
+            for (size_t i=begin; i<end; ++i)
+            {
+                lowest = Min(lowest, TexelChannel(colors[i], k));
+                highest = Max(highest, TexelChannel(colors[i], k));
+            }
+            if (highest - lowest > box.range)
+            {
+                box.range = highest - lowest;
+                box.channel = k;
+            }
+        }
+        boxes.push_back(box);
+    };
+    if (!colors.empty())
+        addBox(0, colors.size());
+
+    while (boxes.size() < 256)
+    {
+        size_t widest = 0;
+        for (size_t i=1; i<boxes.size(); ++i)
+            if (boxes[i].range > boxes[widest].range)
+                widest = i;
+        Box box = boxes[widest];
+        if (box.range <= 0)
+            break;
+        size_t median = (box.begin + box.end)/2;
+        std::nth_element(colors.begin() + (long)box.begin, colors.begin() + (long)median, colors.begin() + (long)box.end,
+                         [&](uint32_t a, uint32_t b) { return TexelChannel(a, box.channel) < TexelChannel(b, box.channel); });
+        boxes.erase(boxes.begin() + (long)widest);
+        addBox(box.begin, median);
+        addBox(median, box.end);
+    }
+
+    for (size_t i=0; i<256; ++i)
+    {
+        palette[i] = 0xff000000;
+        if (i >= boxes.size())
+            continue;
+        uint32_t sums[3] = {0, 0, 0};
+        for (size_t j=boxes[i].begin; j<boxes[i].end; ++j)
+            for (int k=0; k<3; ++k)
+                sums[k] += (uint32_t)TexelChannel(colors[j], k);
+        uint32_t count = uint32_t(boxes[i].end - boxes[i].begin);
+        for (int k=0; k<3; ++k)
+            palette[i] |= ((sums[k] + count/2) / count) << (8*k);
+    }
+}
+
+inline uint8_t NearestPaletteEntry(const uint32_t palette[256], uint32_t texel)
+{
+    int best = 0, bestDistance = TexelDistance(palette[0], texel);
+    for (int i=1; i<256 && bestDistance > 0; ++i)
+    {
+        int distance = TexelDistance(palette[i], texel);
+        if (distance < bestDistance)
+        {
+            bestDistance = distance;
+            best = i;
+        }
+    }
+    return uint8_t(best);
+}
+
+// Mip levels of a texture, each half the size of the previous one down to 1x1, stored in 4x4 tiles
+struct TextureLevel
+{
+    int width, height;
+    int tilesPerRow;
+    size_t offset;          // Of the first tile, in tiles
+};
+
+// Fill levels for a texture of given size and return number of tiles of all levels
+inline size_t ComputeTextureLevels(int width, int height, std::vector<TextureLevel>& levels)
+{
+    levels.clear();
+    size_t numTiles = 0;
+    for (int w = width, h = height; ; w = Max(w/2, 1), h = Max(h/2, 1))
+    {
+        TextureLevel level;
+        level.width = w;
+        level.height = h;
+        level.tilesPerRow = (w + 3)/4;
+        level.offset = numTiles;
+        numTiles += size_t(level.tilesPerRow) * size_t((h + 3)/4);
+        levels.push_back(level);
+        if (w == 1 && h == 1)
+            break;
+    }
+    return numTiles;
+}
+
+// Bytes of a 4x4 tile
+inline size_t GetTileSize(TEXTURE_FORMAT format)
+{
+    if (format == TEXTURE_FORMAT_BC1)
+        return sizeof(BC1Block);
+    if (format == TEXTURE_FORMAT_PALETTED)
+        return 16;
+    return 16*sizeof(uint32_t);
+}
+
+// Texture files hold a texture laid out as it is in memory, so they can be used mapped in place:
+//  TextureFileHeader, the palette of a paletted texture at paletteOffset and the tiles of all levels at dataOffset,
+//  both aligned to TEXTURE_FILE_ALIGNMENT
+const uint32_t TEXTURE_FILE_MAGIC = 0x58455454;     // "TTEX"
+const uint32_t TEXTURE_FILE_VERSION = 1;
+const uint32_t TEXTURE_FILE_ALIGNMENT = 64;
+const uint32_t TEXTURE_MAX_SIZE = 1 << 15;           // Largest width or height of a texture file
+
+struct TextureFileHeader
+{
+    uint32_t magic, version;
+    uint32_t format;
+    uint32_t width, height;
+    uint32_t paletteOffset;     // 0 without a palette
+    uint32_t dataOffset, dataSize;
+};
+
+// Build the image of a texture file from texels of level 0 in rows: the mip chain, encoded in tiles of the format
+inline void EncodeTexture(const std::vector<uint32_t>& texels, int width, int height, TEXTURE_FORMAT format, std::vector<uint8_t>& image)
+{
+    std::vector<TextureLevel> levels;
+    size_t numTiles = ComputeTextureLevels(width, height, levels);
+
+    TextureFileHeader header;
+    header.magic = TEXTURE_FILE_MAGIC;
+    header.version = TEXTURE_FILE_VERSION;
+    header.format = format;
+    header.width = uint32_t(width);
+    header.height = uint32_t(height);
+    header.paletteOffset = format == TEXTURE_FORMAT_PALETTED ? TEXTURE_FILE_ALIGNMENT : 0;
+    header.dataOffset = TEXTURE_FILE_ALIGNMENT + (format == TEXTURE_FORMAT_PALETTED ? 256*sizeof(uint32_t) : 0);
+    header.dataSize = uint32_t(numTiles * GetTileSize(format));
+    image.assign(header.dataOffset + header.dataSize, 0);
+    memcpy(&image[0], &header, sizeof(header));
+
+    // Texels of each level in rows
+    std::vector<std::vector<uint32_t>> rows(levels.size());
+    rows[0] = texels;
+    for (size_t l=1; l<levels.size(); ++l)
+    {
+        // Average of 2x2 texels of the previous level (the last row or column repeated for odd sizes)
+        const TextureLevel& level = levels[l];
+        const TextureLevel& previous = levels[l-1];
+        const std::vector<uint32_t>& source = rows[l-1];
+        rows[l].resize(size_t(level.width*level.height));
+        for (int y=0; y<level.height; ++y)
+        for (int x=0; x<level.width; ++x)
+        {
+            int x0 = 2*x, y0 = 2*y;
+            int x1 = Min(x0+1, previous.width-1), y1 = Min(y0+1, previous.height-1);
+            uint32_t quad[4] = {source[size_t(y0*previous.width + x0)], source[size_t(y0*previous.width + x1)],
+                                source[size_t(y1*previous.width + x0)], source[size_t(y1*previous.width + x1)]};
+            uint32_t texel = 0;
+            for (int shift=0; shift<32; shift+=8)
+            {
+                uint32_t sum = 2;
+                for (int k=0; k<4; ++k)
+                    sum += (quad[k] >> shift) & 0xff;
+                texel |= (sum/4) << shift;
+            }
+            rows[l][size_t(y*level.width + x)] = texel;
+        }
+    }
+
+    // One palette for all levels
+    uint32_t* palette = (uint32_t*)&image[header.paletteOffset];
+    if (format == TEXTURE_FORMAT_PALETTED)
+    {
+        std::vector<uint32_t> all;
+        for (size_t l=0; l<rows.size(); ++l)
+            all.insert(all.end(), rows[l].begin(), rows[l].end());
+        BuildPalette(all, palette);
+    }
+
+    uint8_t* data = &image[header.dataOffset];
+    std::map<uint32_t, uint8_t> nearest;
+    for (size_t l=0; l<levels.size(); ++l)
+    {
+        const TextureLevel& level = levels[l];
+        for (int ty=0; ty<level.height; ty+=4)
+        for (int tx=0; tx<level.width; tx+=4)
+        {
+            // Texels of the tile, edge texels repeated past the edges
+            uint32_t tile[16];
+            for (int y=0; y<4; ++y)
+            for (int x=0; x<4; ++x)
+                tile[y*4 + x] = rows[l][size_t(Min(ty+y, level.height-1)*level.width + Min(tx+x, level.width-1))];
+
+            size_t t = level.offset + size_t((ty >> 2)*level.tilesPerRow + (tx >> 2));
+            if (format == TEXTURE_FORMAT_BC1)
+            {
+                BC1Block block = EncodeBC1Block(tile);
+                memcpy(data + t*sizeof(BC1Block), &block, sizeof(block));
+            }
+            else if (format == TEXTURE_FORMAT_PALETTED)
+            {
+                for (int i=0; i<16; ++i)
+                {
+                    auto it = nearest.find(tile[i]);
+                    if (it == nearest.end())
+                        it = nearest.insert(std::make_pair(tile[i], NearestPaletteEntry(palette, tile[i]))).first;
+                    data[t*16 + size_t(i)] = it->second;
+                }
+            }
+            else
+                memcpy(data + t*sizeof(tile), tile, sizeof(tile));
+        }
+    }
+}
+
+inline uint32_t PackTexel(const RGBColor& c)
+{
+    return 0xff000000 | uint32_t(c.r) << 16 | uint32_t(c.g) << 8 | uint32_t(c.b);
+}
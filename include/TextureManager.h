@@ -1,5 +1,5 @@
 #pragma once
-#include "Bitmap.h"
+#include "Texture.h"
 
 class TextureManager
 {
@@ -7,28 +7,41 @@ public:
     TextureManager()
     {
         // A white texture is added by default
-        m_bitmaps.push_back(Bitmap());
-        m_bitmaps[0].width = 1;
-        m_bitmaps[0].height = 1;
-        m_bitmaps[0].pixels.push_back(RGBColor(0xFF, 0xFF, 0xFF));
+        Bitmap white;
+        white.width = 1;
+        white.height = 1;
+        white.pixels.push_back(RGBColor(0xFF, 0xFF, 0xFF));
+        m_textures.push_back(Texture());
+        m_textures[0].Create(white);
     }
 
-    // Add a new texture loaded from a bitmap file
-    size_t AddTexture(const std::string& filename)
+    // Add a new texture from a texture file, mapped as it is, or from a bitmap file compressed to the format
+    //  Texture files are made offline by model-conv
+    size_t AddTexture(const std::string& filename, TEXTURE_FILTER filter = TEXTURE_FILTER_TRILINEAR, TEXTURE_FORMAT format = TEXTURE_FORMAT_BC1)
     {
-        m_bitmaps.push_back(Bitmap());
-        size_t id = m_bitmaps.size()-1;
-        m_bitmaps[id].LoadFile(filename);
+        m_textures.push_back(Texture());
+        size_t id = m_textures.size()-1;
+        if (!m_textures[id].LoadFile(filename, filter, format))
+            m_textures[id] = m_textures[0];     // White instead
         return id;
     }
 
+    // Bytes taken by all textures, mapped or allocated
+    size_t GetMemorySize() const
+    {
+        size_t size = 0;
+        for (size_t i=0; i<m_textures.size(); ++i)
+            size += m_textures[i].GetMemorySize();
+        return size;
+    }
+
     void CleanUp()
     {
-        m_bitmaps.clear();
+        m_textures.clear();
     }
 
-    Bitmap& GetTexture(size_t textureId) { return m_bitmaps[textureId]; }
+    Texture& GetTexture(size_t textureId) { return m_textures[textureId]; }
 
 private:
-    std::vector<Bitmap> m_bitmaps;
+    std::vector<Texture> m_textures;
 };
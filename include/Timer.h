@@ -1,4 +1,5 @@
 #pragma once
+#include <chrono>
 
 class Timer
 {
@@ -6,17 +7,18 @@ public:
     Timer(double targetFPS) { Reset(targetFPS); }
     void Reset(double targetFPS)
     {
-        m_lastTime = SDL_GetTicks();
+        m_lastTime = GetTicks();
         m_leftOver = 0.0;
         m_secondCounter = m_fps = m_frameCounter = 0;
         m_target = 1.0 / targetFPS;
     }
 
     uint32_t GetFPS() { return m_fps; }
+    double GetTarget() const { return m_target; }     // Time step of updates
 
     void Update(std::function<void(double)> update)
     {
-        double currentTime = SDL_GetTicks();
+        double currentTime = GetTicks();
         double deltaTime = (currentTime - m_lastTime)/1000.0f;
         m_lastTime = currentTime;
         // Second counter to keep track of whether we have crossed a second
@@ -52,6 +54,12 @@ public:
     }
 
 private:
+    // Milliseconds from an arbitrary start
+    static double GetTicks()
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
     double m_lastTime, m_target, m_leftOver;
     uint32_t m_fps, m_frameCounter, m_secondCounter;
 };
@@ -1,10 +1,9 @@
 #pragma once
 
+// Node of the skeleton; nodes are stored with parents before their children
 struct Node
 {
-    std::vector<Node> children;
-    mat4 transform;
-    mat4 combined_transform;
+    int parent;         // Index of the parent node, -1 for the root
 };
 
 struct VecKey
@@ -21,7 +20,7 @@ struct RotKey
 
 struct NodeAnim
 {
-    Node* node;
+    size_t node;
     std::vector<VecKey> posKeys;
     std::vector<RotKey> rotKeys;
 };
@@ -35,7 +34,7 @@ struct Animation
 
 struct Bone
 {
-    Node * node;
+    size_t node;
     mat4 offset;
 };
 
@@ -7,6 +7,8 @@
 #include <functional> 
 #include <vector>
 #include <map>
+#include <memory>
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <unordered_map>
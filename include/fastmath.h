@@ -0,0 +1,235 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// Approximate math for shaders, in tiers of accuracy
+//  MATH_EXACT calls the C library; MATH_FAST keeps exp2 and log2 around 1e-5, but pow built from them
+//  reaches 3e-4 for high exponents; MATH_FASTEST gives up more (around 1e-3, 2e-2 for pow) for fewer instructions
+//  --benchmark-math prints the errors and speeds
+// Scalar versions are templates on the tier; with SSE2 (USE_SSE_KERNELS) four values at a time are computed by the ...4 versions
+// Scalar rsqrt has no tiers: the compiler already turns 1/sqrtf into rsqrtss and a Newton-Raphson step with -Ofast,
+//  and vectorizes it, which measured faster than the estimate from the bits of x or an explicit rsqrtss
+// Expects vector.h to be included first
+enum MATH_ACCURACY
+{
+    MATH_EXACT,
+    MATH_FAST,
+    MATH_FASTEST,
+};
+
+// Tier used by the shaders
+//  Built with -Ofast, the shaders ran no faster on the approximations, and slower where they count (best of 5 runs of
+//  --benchmark-shaders: specular 30 against 27 ns per pixel, lights 79 against 65, texture 143 against 105),
+//  so the exact functions are the default; the other tiers are kept to measure on other compilers
+const MATH_ACCURACY SHADER_MATH_ACCURACY = MATH_EXACT;
+
+// Look specular highlights up in a SpecularTable of each material rather than computing Pow
+//  Off for the same reason; without it materials don't carry a table
+//#define SHADER_SPECULAR_TABLE
+
+inline int32_t FloatAsInt(float f)
+{
+    int32_t i;
+    memcpy(&i, &f, sizeof(i));
+    return i;
+}
+
+inline float IntAsFloat(int32_t i)
+{
+    float f;
+    memcpy(&f, &i, sizeof(f));
+    return f;
+}
+
+// 1/sqrt(x) for x > 0
+inline float Rsqrt(float x)
+{
+    return 1.0f / sqrtf(x);
+}
+
+// 2^x, for x from -126 to 128
+//  2 raised to the integer part of x goes straight to the exponent bits, a polynomial gives the fraction
+template<MATH_ACCURACY accuracy>
+inline float Exp2(float x)
+{
+    if (accuracy == MATH_EXACT)
+        return exp2f(x);
+    x = Min(Max(x, -126.0f), 127.99999f);
+    float whole = floorf(x);
+    float f = x - whole;
+    float p;
+    if (accuracy == MATH_FAST)
+        p = 9.9999994e-1f + f*(6.9315308e-1f + f*(2.4015361e-1f + f*(5.5826318e-2f + f*(8.9893397e-3f + f*1.8775767e-3f))));
+    else
+        p = 9.9992520e-1f + f*(6.9583356e-1f + f*(2.2606716e-1f + f*7.8024521e-2f));
+    return p * IntAsFloat(((int32_t)whole + 127) << 23);
+}
+
+// log2(x) for x > 0 (and not denormal)
+//  The exponent bits give the integer part, a polynomial of the mantissa m in [1, 2) the rest, as p(m)*(m-1)
+template<MATH_ACCURACY accuracy>
+inline float Log2(float x)
+{
+    if (accuracy == MATH_EXACT)
+        return log2f(x);
+    int32_t bits = FloatAsInt(x);
+    float exponent = (float)(((bits >> 23) & 0xff) - 127);
+    float m = IntAsFloat((bits & 0x007fffff) | 0x3f800000);
+    float p;
+    if (accuracy == MATH_FAST)
+        p = 2.8118704e+00f + m*(-2.3191810e+00f + m*(1.2846932e+00f + m*(-3.8180074e-01f + m*4.6383684e-02f)));
+    else
+        p = 2.1791673e+00f + m*(-9.1995207e-01f + m*1.6537670e-01f);
+    return exponent + p*(m - 1.0f);
+}
+
+// x^y for x >= 0; 0 for x = 0
+template<MATH_ACCURACY accuracy>
+inline float Pow(float x, float y)
+{
+    if (accuracy == MATH_EXACT)
+        return powf(x, y);
+    if (x <= 0.0f)
+        return 0.0f;
+    return Exp2<accuracy>(y * Log2<accuracy>(x));
+}
+
+// Scale v to unit length, or to (1, 0, 0) if it's zero like vec3::Normalize, multiplying by Rsqrt instead of dividing
+inline void Normalize(vec3& v)
+{
+    float l2 = v.Dot(v);
+    if (l2 == 0.0f)
+    {
+        v = vec3(1.0f, 0.0f, 0.0f);
+        return;
+    }
+    float s = Rsqrt(l2);
+    v.x *= s;
+    v.y *= s;
+    v.z *= s;
+}
+
+#ifdef USE_SSE_KERNELS
+template<MATH_ACCURACY accuracy>
+inline __m128 Rsqrt4(__m128 x)
+{
+    if (accuracy == MATH_EXACT)
+        return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(x));
+    __m128 y = _mm_rsqrt_ps(x);
+    if (accuracy == MATH_FAST)
+    {
+        __m128 xyy = _mm_mul_ps(_mm_mul_ps(x, y), y);
+        y = _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_set1_ps(0.5f), xyy)));
+    }
+    return y;
+}
+
+template<MATH_ACCURACY accuracy>
+inline __m128 Exp2_4(__m128 x)
+{
+    if (accuracy == MATH_EXACT)
+    {
+        float v[4];
+        _mm_storeu_ps(v, x);
+        return _mm_setr_ps(exp2f(v[0]), exp2f(v[1]), exp2f(v[2]), exp2f(v[3]));
+    }
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(127.99999f));
+    // Floor from truncation, one less where that rounded up (negative x); SSE2 has no floor instruction
+    __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, x), _mm_set1_ps(1.0f)));
+    __m128 f = _mm_sub_ps(x, whole);
+    __m128 p;
+    if (accuracy == MATH_FAST)
+    {
+        p = _mm_set1_ps(1.8775767e-3f);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(8.9893397e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5826318e-2f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4015361e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9315308e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.9999994e-1f));
+    }
+    else
+    {
+        p = _mm_set1_ps(7.8024521e-2f);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.2606716e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9583356e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.9992520e-1f));
+    }
+    __m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(whole), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+}
+
+template<MATH_ACCURACY accuracy>
+inline __m128 Log2_4(__m128 x)
+{
+    if (accuracy == MATH_EXACT)
+    {
+        float v[4];
+        _mm_storeu_ps(v, x);
+        return _mm_setr_ps(log2f(v[0]), log2f(v[1]), log2f(v[2]), log2f(v[3]));
+    }
+    __m128i bits = _mm_castps_si128(x);
+    __m128 exponent = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f800000)));
+    __m128 p;
+    if (accuracy == MATH_FAST)
+    {
+        p = _mm_set1_ps(4.6383684e-02f);
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-3.8180074e-01f));
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(1.2846932e+00f));
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-2.3191810e+00f));
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(2.8118704e+00f));
+    }
+    else
+    {
+        p = _mm_set1_ps(1.6537670e-01f);
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-9.1995207e-01f));
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(2.1791673e+00f));
+    }
+    return _mm_add_ps(exponent, _mm_mul_ps(p, _mm_sub_ps(m, _mm_set1_ps(1.0f))));
+}
+
+template<MATH_ACCURACY accuracy>
+inline __m128 Pow4(__m128 x, __m128 y)
+{
+    __m128 positive = _mm_cmpgt_ps(x, _mm_setzero_ps());
+    return _mm_and_ps(positive, Exp2_4<accuracy>(_mm_mul_ps(y, Log2_4<accuracy>(x))));
+}
+#endif
+
+// Table of x^shininess for x in [0, 1], looked up with linear interpolation
+//  For specular highlights: one table per material, rebuilt only when its shininess changes
+class SpecularTable
+{
+public:
+    static const int SIZE = 1024;
+
+    SpecularTable() : m_shininess(-1.0f) {}
+
+    void Build(float shininess)
+    {
+        if (shininess == m_shininess)
+            return;
+        m_shininess = shininess;
+        for (int i=0; i<SIZE; ++i)
+            m_table[i] = powf((float)i / (float)(SIZE-1), shininess);
+        m_table[SIZE] = m_table[SIZE-1];     // So that x = 1 can interpolate with the next entry
+    }
+
+    float GetShininess() const { return m_shininess; }
+
+    float Lookup(float x) const
+    {
+        float f = Min(Max(x, 0.0f), 1.0f) * (float)(SIZE-1);
+        int i = (int)f;
+        return m_table[i] + (m_table[i+1] - m_table[i]) * (f - (float)i);
+    }
+
+private:
+    float m_shininess;
+    float m_table[SIZE+1];
+};
+
+// Print error and speed of the approximations against the exact functions
+void BenchmarkFastMath();
@@ -1,58 +1,74 @@
 #include "Mesh.h"
 #include "shaders.h"
 
-struct DiffuseMaterial : public Material
+// Specular properties, only in materials of variants with SHADER_SPECULAR
+template<bool specular>
+struct SpecularProperties
 {
-    DiffuseMaterial() : depthBias(0.007f), textureId(0), diffuseColor(vec4(1.0f, 1.0f, 1.0f, 1.0f)) {}
-    size_t textureId;
-    float depthBias;
-    vec4 diffuseColor;
-    static const int ID = 0;
-
-    void DrawMesh(Mesh& mesh, bool transparency=false)
-    {
-        DiffuseShaders::Uniforms &uniforms = DiffuseShaders::uniforms;
-        uniforms.depthBias = depthBias;
-        uniforms.textureId = textureId;
-        uniforms.diffuseColor = diffuseColor;
-        mesh.Draw(DiffuseShaders::shaders, transparency);
-    }
+    template<class Uniforms>
+    void SetSpecularUniforms(Uniforms&) const {}
 };
 
-
-struct SpecularMaterial : public Material
+template<>
+struct SpecularProperties<true>
 {
-    SpecularMaterial() : depthBias(0.007f), textureId(0), diffuseColor(vec4(1.0f, 1.0f, 1.0f, 1.0f)), specularColor(vec3(1.0f, 1.0f, 1.0f)),
-                        shininess(32.0f) {}
-    size_t textureId;
-    float depthBias;
-    vec4 diffuseColor;
+    SpecularProperties() : specularColor(vec3(1.0f, 1.0f, 1.0f)), shininess(32.0f) {}
     vec3 specularColor;
     float shininess;
-    static const int ID = 1;
 
-    void DrawMesh(Mesh& mesh, bool transparency=false)
+#ifdef SHADER_SPECULAR_TABLE
+    // Highlights of the shininess, looked up by the shaders instead of computing pow for each pixel
+    //  Built again when shininess changes; draws refer to it, so recorded draws must not outlive the material
+    mutable SpecularTable specularTable;
+#endif
+
+    template<class Uniforms>
+    void SetSpecularUniforms(Uniforms& uniforms) const
     {
-        SpecularShaders::Uniforms &uniforms = SpecularShaders::uniforms;
-        uniforms.depthBias = depthBias;
-        uniforms.textureId = textureId;
-        uniforms.diffuseColor = diffuseColor;
         uniforms.specularColor = specularColor;
         uniforms.shininess = shininess;
-        mesh.Draw(SpecularShaders::shaders, transparency);
+#ifdef SHADER_SPECULAR_TABLE
+        specularTable.Build(shininess);
+        uniforms.specularTable = &specularTable;
+#endif
     }
 };
 
-struct ToonMaterial : public Material
+// Material drawn with the variant of the surface shaders of its features (SHADER_FEATURE bits)
+//  Pick the fewest features the surface needs: an untextured or unshadowed surface doesn't pay for them
+//  Properties of features left out are ignored
+template<unsigned FEATURES>
+struct SurfaceMaterial : public Material, public SpecularProperties<(FEATURES & SHADER_SPECULAR) != 0>
 {
-    ToonMaterial() : diffuseColor(vec4(1.0f, 1.0f, 1.0f, 1.0f)) {}
+    SurfaceMaterial() : textureId(0), depthBias(0.007f), diffuseColor(vec4(1.0f, 1.0f, 1.0f, 1.0f)) {}
+    size_t textureId;
+    float depthBias;
     vec4 diffuseColor;
-    static const int ID = 2;
+    static const int ID = FEATURES;     // Variants are told apart by their features
+
+    typedef SurfaceShaders<FEATURES> ShadersClass;
+    typedef typename ShadersClass::ShadersType ShadersType;
+    static ShadersType& GetShaders() { return ShadersClass::shaders; }
 
-    void DrawMesh(Mesh& mesh, bool transparency=false)
+    // Copy the material properties to given uniforms of its shaders, such as those of an instance
+    void GetUniforms(typename ShadersClass::Uniforms& uniforms) const
     {
-        CellShaders::Uniforms &uniforms = CellShaders::uniforms;
+        uniforms.depthBias = depthBias;
+        uniforms.textureId = textureId;
         uniforms.diffuseColor = diffuseColor;
-        mesh.Draw(CellShaders::shaders, transparency);
+        this->SetSpecularUniforms(uniforms);
+    }
+    // Copy the material properties to the shader uniforms
+    void SetUniforms() const { GetUniforms(ShadersClass::uniforms); }
+
+    void DrawMesh(Mesh& mesh, bool transparency=false, size_t lod=0, Pose* pose=NULL)
+    {
+        SetUniforms();
+        mesh.Draw(GetShaders(), transparency, lod, pose);
     }
 };
+
+// Materials with all features of a kind
+typedef SurfaceMaterial<SHADER_TEXTURE | SHADER_SHADOW | SHADER_ALPHA | SHADER_LIGHTS> DiffuseMaterial;                      // Diffuse color, texture and shadow
+typedef SurfaceMaterial<SHADER_TEXTURE | SHADER_SHADOW | SHADER_SPECULAR | SHADER_ALPHA | SHADER_LIGHTS> SpecularMaterial;   // Also a specular color and shininess
+typedef SurfaceMaterial<SHADER_TOON> ToonMaterial;                                                                           // Only a color, with toon shading
@@ -1,9 +1,14 @@
+#include <transform.h>
+#include <fastmath.h>
 
-#ifdef SPECULAR_SHADERS
-#undef SPECULAR_SHADERS
-#endif
-#include <shaders/shaders3d.h>
-#define SPECULAR_SHADERS
 #include <shaders/shaders3d.h>
 
-#include <shaders/cell.h>
+// Variants of the surface shaders with all features of a material kind; materials may use fewer
+typedef SurfaceShaders<SHADER_TEXTURE | SHADER_SHADOW | SHADER_ALPHA | SHADER_LIGHTS> DiffuseShaders;
+typedef SurfaceShaders<SHADER_TEXTURE | SHADER_SHADOW | SHADER_SPECULAR | SHADER_ALPHA | SHADER_LIGHTS> SpecularShaders;
+typedef SurfaceShaders<SHADER_TOON> CellShaders;
+
+// Print the time per pixel of the fragment shader of variants, drawing to the renderer
+void BenchmarkShaders();
+// Print the time per triangle of drawing with 16-bit and 32-bit indices, and of a mesh of about a million triangles
+void BenchmarkMeshes();
@@ -4,21 +4,59 @@
 
 extern Renderer g_renderer;
 
-vec4 VertexDepthShader(vec4 attribute[], const Vertex& vertex)
+// Constants of a depth-only draw
+struct DepthConstants
+{
+    // What differs between the instances of an instanced draw
+    struct Instance
+    {
+        mat4 mvp;
+    };
+
+    // packing holds the ranges to unpack packed vertices with
+    DepthConstants(Renderer& renderer, const PackingInfo& packing = PackingInfo())
+        : mvp(renderer.transforms.mvp), crop(renderer.shadows.crop[renderer.shadows.cascade]), packing(packing) {}
+    DepthConstants(Renderer& renderer, const Instance& instance, const PackingInfo& packing = PackingInfo())
+        : mvp(instance.mvp), crop(renderer.shadows.crop[renderer.shadows.cascade]), packing(packing) {}
+    mat4 mvp;
+    mat4 crop;      // Crop of the shadow cascade drawn, for vertices already in light clip space
+    PackingInfo packing;
+};
+
+vec4 VertexDepthShader(vec4 attribute[], const Vertex& vertex, const DepthConstants& c)
 {   
     // Since only depth is needed
     // no additional attributes are calculated
-    vec4 p = g_renderer.transforms.mvp * vec4(vertex.position);
+    vec4 p = c.mvp * vec4(vertex.position);
     return p;
 }
 
-void FragmentDepthShader(Point<0>& point)
+vec4 PackedVertexDepthShader(vec4 attribute[], const PackedVertex& vertex, const DepthConstants& c)
+{
+    return c.mvp * vec4(UnpackPosition(vertex, c.packing));
+}
+
+// Reads the position stream of meshes that have one
+vec4 PositionDepthShader(vec4 attribute[], const vec3& position, const DepthConstants& c)
+{
+    return c.mvp * vec4(position);
+}
+
+// Light view of vertices transformed by the multi-view vertex stage
+vec4 MultiViewDepthShader(vec4 attribute[], const MultiViewVertex& v, const DepthConstants& c)
+{
+    return c.crop * v.positions[VIEW_LIGHT];
+}
+
+void FragmentDepthShader(Point<0>& point, const DepthConstants& c)
 {
     // We don't need to process the pixels
     // as depth is automatically stored in depth buffer by the rasterizer
 }
 
 auto shadersDepth = 
-                Shaders<g_renderer, Vertex, 0, &VertexDepthShader, &FragmentDepthShader, true>(); 
+                VertexFormatShaders<Shaders<g_renderer, Vertex, 0, DepthConstants, &VertexDepthShader, &FragmentDepthShader, true>,
+                                    Shaders<g_renderer, PackedVertex, 0, DepthConstants, &PackedVertexDepthShader, &FragmentDepthShader, true>,
+                                    Shaders<g_renderer, vec3, 0, DepthConstants, &PositionDepthShader, &FragmentDepthShader, true>,
+                                    Shaders<g_renderer, MultiViewVertex, 0, DepthConstants, &MultiViewDepthShader, &FragmentDepthShader, true>>();
                                                                                         // backface visible/frontface culling = true
-
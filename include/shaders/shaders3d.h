@@ -1,12 +1,22 @@
+#pragma once
 extern Renderer g_renderer;
 extern TextureManager g_textureManager;
 
 
-#ifdef SPECULAR_SHADERS
-class SpecularShaders
-#else
-class DiffuseShaders
-#endif
+// Features of the surface shaders, combined as bits of the FEATURES template argument
+//  Each combination is a variant of its own: attributes and code of features left out are not compiled in
+enum SHADER_FEATURE
+{
+    SHADER_TEXTURE = 1,     // Color modulated by a texture, sampled at the texture coordinates of the mesh
+    SHADER_SHADOW = 2,      // Shadowed by the shadow maps of the renderer
+    SHADER_SPECULAR = 4,    // Specular highlights of the shininess of the material, computed or looked up in its specular table (SHADER_SPECULAR_TABLE)
+    SHADER_ALPHA = 8,       // Blended with the alpha of the diffuse color as its opacity, the way the transparency mode of the renderer blends; opaque otherwise
+    SHADER_TOON = 16,       // Diffuse lighting in two bands instead of smooth
+    SHADER_LIGHTS = 32,     // Lit by the point and spot lights of the renderer, those of the pixel's cluster of the light grid
+};
+
+template<unsigned FEATURES>
+class SurfaceShaders
 {
 public:
     struct Uniforms
@@ -14,112 +24,292 @@ public:
         float depthBias;
         size_t textureId;
         vec4 diffuseColor;
-#ifdef SPECULAR_SHADERS
         vec3 specularColor;
         float shininess;
+#ifdef SHADER_SPECULAR_TABLE
+        const SpecularTable* specularTable;     // Of the shininess
 #endif
     };
     static Uniforms uniforms;
 
-#ifdef ATTRIBUTES_NUM
-#undef ATTRIBUTES_NUM
-#endif
+    // Attributes interpolated for each pixel, only those of the features
+    static const int NORMAL = 0;
+    static const int TEXCOORDS = NORMAL + 1;
+    static const int LIGHT_POSITION = TEXCOORDS + ((FEATURES & SHADER_TEXTURE) ? 1 : 0);
+    static const int WORLD_POSITION = LIGHT_POSITION + ((FEATURES & SHADER_SHADOW) ? 1 : 0);
+    static const int NUM_ATTRIBUTES = WORLD_POSITION + ((FEATURES & (SHADER_SPECULAR | SHADER_LIGHTS)) ? 1 : 0);
 
-#ifdef SPECULAR_SHADERS
-#define ATTRIBUTES_NUM 4
-#else
-#define ATTRIBUTES_NUM 3
-#endif
+    // What differs between the instances of an instanced draw: placement, and the uniforms of the material
+    struct Instance
+    {
+        mat4 model;
+        Uniforms material;
+    };
+
+    // Constants of a draw, built once from the renderer and the uniforms, or from the renderer and an instance
+    //  Everything shared by all vertices and pixels of the draw is derived here
+    struct Constants
+    {
+        typedef SurfaceShaders::Instance Instance;
+
+        //  packing holds the ranges to unpack packed vertices with
+        Constants(Renderer& renderer, const PackingInfo& packing = PackingInfo())
+            : Constants(renderer, renderer.transforms.model, renderer.transforms.mvp, renderer.transforms.bias_light_mvp, uniforms, packing) {}
+        Constants(Renderer& renderer, const Instance& instance, const PackingInfo& packing = PackingInfo())
+            : Constants(renderer, instance.model, renderer.transforms.vp * instance.model,
+                        renderer.transforms.bias * renderer.transforms.light_vp * instance.model, instance.material, packing) {}
+
+        Constants(Renderer& renderer, const mat4& model, const mat4& mvp, const mat4& lightMvp, const Uniforms& material, const PackingInfo& packing)
+            : mvp(mvp), model(model), normalMatrix(model),
+              packing(packing), material(material), light(renderer.light),
+              camPos(renderer.transforms.camPos), texture((FEATURES & SHADER_TEXTURE) ? &g_textureManager.GetTexture(material.textureId) : NULL),
+              lightMvp(lightMvp), lightBias(renderer.transforms.bias), numCascades((FEATURES & SHADER_SHADOW) ? renderer.shadows.numCascades : 0),
+              width(0), height(0), pitch(0),
+              shadowFilter(renderer.shadows.filter), filterRadius(renderer.shadows.filterRadius), shadowDarkness(renderer.shadows.darkness),
+              minVariance(renderer.shadows.minVariance), lightBleeding(renderer.shadows.lightBleeding),
+              lightGrid(&renderer.lightGrid)
+        {
+            if (numCascades > 0)
+            {
+                width = renderer.GetDepthBufferWidth(renderer.shadows.depthBuffers[0]);
+                height = renderer.GetDepthBufferHeight(renderer.shadows.depthBuffers[0]);
+                pitch = renderer.GetDepthBufferPitch(renderer.shadows.depthBuffers[0]);
+            }
+            for (int k=0; k<numCascades; ++k)
+            {
+                shadowMaps[k] = renderer.GetDepthBuffer(renderer.shadows.depthBuffers[k]);
+                moments[k] = shadowFilter == SHADOW_FILTER_VSM ? &renderer.shadows.moments[k][0] : NULL;
+                splits[k] = renderer.shadows.splits[k];
+
+                // The crop of a cascade scales and offsets light clip space;
+                //  the same in texture space (where the bias matrix takes x to (1+x)/2 and y to (1-y)/2), then in pixels of the map
+                const mat4& crop = renderer.shadows.crop[k];
+                cascadeScale[k] = vec3(crop[0][0]*(float)width, crop[1][1]*(float)height, 1.0f);
+                cascadeOffset[k] = vec3(0.5f*(1.0f - crop[0][0] + crop[0][3])*(float)width,
+                                        0.5f*(1.0f - crop[1][1] - crop[1][3])*(float)height, 0.0f);
+            }
+        }
+
+        mat4 mvp, model;
+        mat3 normalMatrix;
+        PackingInfo packing;
+        Uniforms material;
+        Renderer::LightInfo light;
+        vec3 camPos;
+        const Texture* texture;
+
+        // Shadow maps of all cascades, all of the same size
+        mat4 lightMvp;          // Texture matrix for the light frustum cropped by the cascades
+        mat4 lightBias;         // The same for positions already in light clip space, from the multi-view vertex stage
+        int numCascades;
+        const float* shadowMaps[Renderer::MAX_SHADOW_CASCADES];
+        const float* moments[Renderer::MAX_SHADOW_CASCADES];
+        float splits[Renderer::MAX_SHADOW_CASCADES];
+        vec3 cascadeScale[Renderer::MAX_SHADOW_CASCADES], cascadeOffset[Renderer::MAX_SHADOW_CASCADES];  // From texture space to pixels of each map
+        int width, height, pitch;
+        SHADOW_FILTER shadowFilter;
+        int filterRadius;
+        float shadowDarkness, minVariance, lightBleeding;
+
+        const LightGrid* lightGrid;
+    };
 
     // VertexShader is called for each vertex and is expected to return its
     //  position in clip space as well as its attributes
-    static vec4 VertexShader(vec4 attribute[], const Vertex& vertex)
+    static vec4 VertexShader(vec4 attribute[], const Vertex& vertex, const Constants& c)
     {
-        vec4 p = g_renderer.transforms.mvp * vec4(vertex.position);
-        attribute[0] = mat3(g_renderer.transforms.model) * vertex.normal;
-        attribute[1] = vertex.texcoords;
+        vec4 p = c.mvp * vec4(vertex.position);
+        attribute[NORMAL] = c.normalMatrix * vertex.normal;
+        if (FEATURES & SHADER_TEXTURE)
+            attribute[TEXCOORDS] = vertex.texcoords;
         
         // Also take to light space; for shadow map calculations
-        attribute[2] = g_renderer.transforms.bias_light_mvp * vec4(vertex.position);
-        attribute[2] = attribute[2].ConvertToVec3();
-        attribute[2].x = (attribute[2].x) * (float)g_renderer.GetWidth();
-        attribute[2].y = (attribute[2].y) * (float)g_renderer.GetHeight();
+        if (FEATURES & SHADER_SHADOW)
+        {
+            attribute[LIGHT_POSITION] = c.lightMvp * vec4(vertex.position);
+            attribute[LIGHT_POSITION] = attribute[LIGHT_POSITION].ConvertToVec3();
+        }
 
-#ifdef SPECULAR_SHADERS
-        attribute[3] = g_renderer.transforms.model * vec4(vertex.position);
-#endif
+        if (FEATURES & (SHADER_SPECULAR | SHADER_LIGHTS))
+            attribute[WORLD_POSITION] = c.model * vec4(vertex.position);
         return p;
     }
 
-    // Get depth sample from the depthbuffer with light-space x,y-coordinates
-    // This gives closest depth to the light
-    static float GetSample(float x, float y)
+    // Vertex shader for meshes with packed vertices
+    static vec4 PackedVertexShader(vec4 attribute[], const PackedVertex& vertex, const Constants& c)
     {
-        float sample = 1.0f;
-        size_t samplingPos = int(y)*g_renderer.GetWidth() + (int)x;
-        if (samplingPos < g_renderer.GetWidth()*g_renderer.GetHeight())
-            sample = g_renderer.GetDepthBuffer(1)[samplingPos];
-        return sample;
+        return VertexShader(attribute, UnpackVertex(vertex, c.packing), c);
     }
-    
+
+    // Vertex shader for vertices already transformed by the multi-view vertex stage
+    //  Light space position comes from the light view rather than another transform
+    static vec4 MultiViewVertexShader(vec4 attribute[], const MultiViewVertex& v, const Constants& c)
+    {
+        attribute[NORMAL] = c.normalMatrix * v.vertex.normal;
+        if (FEATURES & SHADER_TEXTURE)
+            attribute[TEXCOORDS] = v.vertex.texcoords;
+
+        if (FEATURES & SHADER_SHADOW)
+        {
+            attribute[LIGHT_POSITION] = c.lightBias * v.positions[VIEW_LIGHT];
+            attribute[LIGHT_POSITION] = attribute[LIGHT_POSITION].ConvertToVec3();
+        }
+
+        if (FEATURES & (SHADER_SPECULAR | SHADER_LIGHTS))
+            attribute[WORLD_POSITION] = c.model * vec4(v.vertex.position);
+        return v.positions[VIEW_CAMERA];
+    }
+
+    // Highlight for the cosine x between reflection and view, x^shininess
+    static float SpecularPower(const Uniforms& material, float x)
+    {
+#ifdef SHADER_SPECULAR_TABLE
+        return material.specularTable->Lookup(x);
+#else
+        return Pow<SHADER_MATH_ACCURACY>(x, material.shininess);
+#endif
+    }
+
     // This function is called for each pixel
     // The Point contains x,y position of the pixel,
     //  the depth value and the interpolated attributes
-    static void FragmentShader(Point<ATTRIBUTES_NUM>& point)
+    static void FragmentShader(Point<NUM_ATTRIBUTES>& point, const Constants& c)
     {
-        // Code here may need to be optimized
-        
-        // Get normal and texture-color for the pixel
-        vec3 n = point.attribute[0];
-        n.Normalize();
-        vec3 texcolor = g_textureManager.GetTexture(uniforms.textureId).Sample(point.attribute[1]);
-        
-        // Perform a simple phong based lighting calculation for directional light
-        // Ambient Lighting:
-        vec3 c = g_renderer.light.ambient;
+        // Get normal for the pixel
+        vec3 n = point.attribute[NORMAL];
+        Normalize(n);
         
-        vec3 dir = g_renderer.light.direction;                   // assuming this is normalized
+        vec3 dir = c.light.direction;                   // assuming this is normalized
         float diffuseFactor = n.Dot(-dir);
 
-        if (diffuseFactor > 0)
+        vec3 color;
+        if (FEATURES & SHADER_TOON)
         {
-            // Diffuse Lighting:
-            c = c + uniforms.diffuseColor * diffuseFactor * g_renderer.light.diffuse;
-
-#ifdef SPECULAR_SHADERS
-            vec3 view = g_renderer.transforms.camPos - point.attribute[3];
-            view.Normalize();
-            // Specular Lighting:
-            float specintensity = dir.Reflect(n).Dot(view);
-            if (specintensity > 0.0f)
+            // Two bands of diffuse lighting, ambient on top
+            color = c.material.diffuseColor * (diffuseFactor > 0.5f ? 0.7f : 0.6f);
+            color = color * c.light.diffuse;
+            color = color + c.light.ambient;
+        }
+        else
+        {
+            // Perform a simple phong based lighting calculation for directional light
+            // Ambient Lighting:
+            color = c.light.ambient;
+            if (diffuseFactor > 0)
             {
-                specintensity = (float) pow(specintensity, uniforms.shininess);
-                c = c + uniforms.specularColor * specintensity * g_renderer.light.specular;
+                // Diffuse Lighting:
+                color = color + c.material.diffuseColor * diffuseFactor * c.light.diffuse;
+
+                if (FEATURES & SHADER_SPECULAR)
+                {
+                    vec3 view = c.camPos - point.attribute[WORLD_POSITION];
+                    Normalize(view);
+                    // Specular Lighting:
+                    //  reflection of the light direction is unit length already, both being normalized
+                    float specintensity = (dir - n*(2.0f*dir.Dot(n))).Dot(view);
+                    if (specintensity > 0.0f)
+                    {
+                        specintensity = SpecularPower(c.material, specintensity);
+                        color = color + c.material.specularColor * specintensity * c.light.specular;
+                    }
+                }
             }
-#endif
         }
-        c.x = Min(c.x, 1.0f);
-        c.y = Min(c.y, 1.0f);
-        c.z = Min(c.z, 1.0f);
+        color.x = Min(color.x, 1.0f);
+        color.y = Min(color.y, 1.0f);
+        color.z = Min(color.z, 1.0f);
         
         // Shadow Mapping
-        // Light space position of pixel
-        vec3 lpos = point.attribute[2];
-   
-        float visibility = 1.0f;
-        // Compare light space depth of this pixel with
-        // sample depth of this and nearby pixels from depthbuffer
-        for (float i=-1.5f; i<=1.5f; i+=1.5f)
-            for (float j=-1.5f; j<=1.5f; j+=1.5f)
-                if (GetSample(lpos.x + i, lpos.y +j) < lpos.z - uniforms.depthBias)
-                    visibility -= 0.06f;
-        c = c * visibility;
+        if ((FEATURES & SHADER_SHADOW) && c.numCascades > 0)
+        {
+            // Nearest cascade reaching the depth of the pixel
+            int k = 0;
+            while (k < c.numCascades-1 && point.d > c.splits[k])
+                ++k;
+
+            // Light space position of pixel in the shadow map of the cascade
+            vec3 lpos = point.attribute[LIGHT_POSITION];
+            float x = lpos.x*c.cascadeScale[k].x + c.cascadeOffset[k].x;
+            float y = lpos.y*c.cascadeScale[k].y + c.cascadeOffset[k].y;
+            float depth = lpos.z - c.material.depthBias;
+
+            // Compare light space depth of this pixel with depths of the shadow map around it
+            float shadow;
+            if (c.shadowFilter == SHADOW_FILTER_VSM)
+                shadow = SampleShadowVSM(c.moments[k], c.width, c.height, c.minVariance, c.lightBleeding, x, y, depth);
+            else
+                shadow = SampleShadowPCF(c.shadowMaps[k], c.width, c.height, c.pitch, c.filterRadius, x, y, depth);
+            color = color * (1.0f - c.shadowDarkness * shadow);
+        }
+
+        // Point and spot lights reaching the cluster of the pixel; they cast no shadows
+        //  View depth of the pixel is w, of which the rasterizer interpolates the inverse
+        if (FEATURES & SHADER_LIGHTS)
+        {
+            int count;
+            const uint16_t* lights = c.lightGrid->GetLights(point.pos[0], point.pos[1], 1.0f/point.w, count);
+            if (count > 0)
+            {
+                vec3 position = point.attribute[WORLD_POSITION];
+                vec3 diffuseColor = c.material.diffuseColor;
+                vec3 view;
+                if (FEATURES & SHADER_SPECULAR)
+                {
+                    view = c.camPos - position;
+                    Normalize(view);
+                }
+                for (int i=0; i<count; ++i)
+                {
+                    const LightGrid::Light& light = c.lightGrid->GetLight(lights[i]);
+                    vec3 l = light.position - position;
+                    float distanceSquared = l.Dot(l);
+                    if (distanceSquared >= light.radiusSquared)
+                        continue;
+                    l = l * Rsqrt(Max(distanceSquared, 1e-12f));
+                    float lightFactor = n.Dot(l);
+                    if (lightFactor <= 0.0f)
+                        continue;
+
+                    // Fading out smoothly to the radius, and to the edge of the cone of spot lights
+                    float attenuation = 1.0f - distanceSquared*light.invRadiusSquared;
+                    attenuation = attenuation*attenuation*Min(Max((-l.Dot(light.direction) - light.cosOuter)*light.spotScale, 0.0f), 1.0f);
+
+                    vec3 lit = diffuseColor * lightFactor;
+                    if (FEATURES & SHADER_SPECULAR)
+                    {
+                        float specintensity = (n*(2.0f*l.Dot(n)) - l).Dot(view);
+                        if (specintensity > 0.0f)
+                            lit = lit + c.material.specularColor * SpecularPower(c.material, specintensity);
+                    }
+                    color = color + lit * light.color * attenuation;
+                }
+                color.x = Min(color.x, 1.0f);
+                color.y = Min(color.y, 1.0f);
+                color.z = Min(color.z, 1.0f);
+            }
+        }
     
-        c = c * texcolor;
-        g_renderer.PutPixelUnsafe(point.pos[0], point.pos[1], c, uniforms.diffuseColor.a);     // Use the calculated color to plot the pixel
+        if (FEATURES & SHADER_TEXTURE)
+        {
+            vec4 texcoordsDx, texcoordsDy;
+            point.Derivatives(TEXCOORDS, texcoordsDx, texcoordsDy);
+            color = color * c.texture->Sample(point.attribute[TEXCOORDS], texcoordsDx, texcoordsDy);
+        }
+
+        if (FEATURES & SHADER_ALPHA)
+            g_renderer.BlendPixel(point.pos[0], point.pos[1], color, c.material.diffuseColor.a, point.d);
+        else
+            g_renderer.PutPixelUnsafe(point.pos[0], point.pos[1], color);     // Use the calculated color to plot the pixel
     }
 
-    typedef Shaders<g_renderer, Vertex, ATTRIBUTES_NUM, &VertexShader, &FragmentShader> ShadersType;
+    typedef VertexFormatShaders<Shaders<g_renderer, Vertex, NUM_ATTRIBUTES, Constants, &VertexShader, &FragmentShader>,
+                                Shaders<g_renderer, PackedVertex, NUM_ATTRIBUTES, Constants, &PackedVertexShader, &FragmentShader>,
+                                Shaders<g_renderer, MultiViewVertex, NUM_ATTRIBUTES, Constants, &MultiViewVertexShader, &FragmentShader>> ShadersType;
     static ShadersType shaders;
-    //              Shaders<Renderer&, VertexClass, NumberOfAttributes, VertexShaderFunction, FragmentShaderFunction>
+    //              Shaders<Renderer&, VertexClass, NumberOfAttributes, ConstantsClass, VertexShaderFunction, FragmentShaderFunction>
 };
+
+template<unsigned FEATURES>
+typename SurfaceShaders<FEATURES>::Uniforms SurfaceShaders<FEATURES>::uniforms;
+template<unsigned FEATURES>
+typename SurfaceShaders<FEATURES>::ShadersType SurfaceShaders<FEATURES>::shaders;
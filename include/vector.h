@@ -5,6 +5,13 @@
 #include <smmintrin.h>
 #endif
 
+// Kernels written with SSE2 intrinsics on plain floats and integers rather than on the vector types
+//  (shadow filtering, buffer fills, fast math) are compiled in wherever SSE2 is there, with or without USE_SSE
+#if defined(USE_SSE) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE_KERNELS
+#include <emmintrin.h>
+#endif
+
 template<class T>
 inline void Swap(T &a, T &b)
 {
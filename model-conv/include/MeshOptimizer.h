@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Merge vertices whose keys (bytes of all their attributes) are exactly equal
+//  Fills remap with the new index of each vertex and returns number of unique vertices
+size_t DeduplicateVertices(const std::vector<std::string>& keys, std::vector<uint32_t>& remap);
+
+// Reorder triangles so that consecutive triangles share vertices as much as possible
+//  (Tom Forsyth's linear-speed vertex cache optimization)
+void OptimizeTriangleOrder(std::vector<uint32_t>& indices, size_t nvertices);
+
+// Number vertices in the order they are first used by the triangles
+//  Rewrites indices, fills remap with the new index of each vertex (UINT32_MAX when unused)
+//  and returns number of used vertices
+size_t OptimizeVertexOrder(std::vector<uint32_t>& indices, size_t nvertices, std::vector<uint32_t>& remap);
+
+// Apply remap to indices
+void RemapIndices(std::vector<uint32_t>& indices, const std::vector<uint32_t>& remap);
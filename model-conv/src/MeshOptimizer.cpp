@@ -0,0 +1,159 @@
+#include <MeshOptimizer.h>
+#include <map>
+#include <math.h>
+
+size_t DeduplicateVertices(const std::vector<std::string>& keys, std::vector<uint32_t>& remap)
+{
+    std::map<std::string, uint32_t> unique;
+    remap.resize(keys.size());
+    for (size_t i=0; i<keys.size(); ++i)
+    {
+        auto it = unique.find(keys[i]);
+        if (it == unique.end())
+            it = unique.insert(std::make_pair(keys[i], uint32_t(unique.size()))).first;
+        remap[i] = it->second;
+    }
+    return unique.size();
+}
+
+void RemapIndices(std::vector<uint32_t>& indices, const std::vector<uint32_t>& remap)
+{
+    for (size_t i=0; i<indices.size(); ++i)
+        indices[i] = remap[indices[i]];
+}
+
+// Scoring as described in "Linear-Speed Vertex Cache Optimisation" by Tom Forsyth
+//  Vertices recently used score higher, so do vertices with few triangles left
+const int CACHE_SIZE = 32;
+
+static float VertexScore(int cachePosition, uint32_t activeTriangles)
+{
+    if (activeTriangles == 0)
+        return -1.0f;
+
+    float score = 0.0f;
+    if (cachePosition >= 0)
+    {
+        if (cachePosition < 3)
+            score = 0.75f;      // The triangle just drawn; no reason to prefer any of its vertices
+        else
+            score = powf(1.0f - float(cachePosition - 3) / float(CACHE_SIZE - 3), 1.5f);
+    }
+    return score + 2.0f / sqrtf(float(activeTriangles));
+}
+
+void OptimizeTriangleOrder(std::vector<uint32_t>& indices, size_t nvertices)
+{
+    size_t ntriangles = indices.size()/3;
+    if (ntriangles == 0)
+        return;
+
+    // Triangles around each vertex; the first activeTriangles[v] of them are not yet drawn
+    std::vector<uint32_t> start(nvertices+1, 0), activeTriangles(nvertices, 0), adjacency(indices.size());
+    for (size_t i=0; i<indices.size(); ++i)
+        activeTriangles[indices[i]]++;
+    for (size_t v=0; v<nvertices; ++v)
+        start[v+1] = start[v] + activeTriangles[v];
+    std::vector<uint32_t> fill(start.begin(), start.end()-1);
+    for (size_t i=0; i<indices.size(); ++i)
+        adjacency[fill[indices[i]]++] = uint32_t(i/3);
+
+    std::vector<int> cachePosition(nvertices, -1);
+    std::vector<float> vertexScore(nvertices), triangleScore(ntriangles, 0.0f);
+    std::vector<bool> added(ntriangles, false);
+    for (size_t v=0; v<nvertices; ++v)
+        vertexScore[v] = VertexScore(-1, activeTriangles[v]);
+    for (size_t t=0; t<ntriangles; ++t)
+        for (int k=0; k<3; ++k)
+            triangleScore[t] += vertexScore[indices[t*3+k]];
+
+    std::vector<uint32_t> output;
+    output.reserve(indices.size());
+    std::vector<uint32_t> cache, newCache;
+    size_t cursor = 0;
+    long best = -1;
+
+    while (output.size() < indices.size())
+    {
+        // Nothing in cache to continue with, so start from next triangle not drawn
+        if (best < 0)
+        {
+            while (added[cursor])
+                ++cursor;
+            best = long(cursor);
+        }
+
+        const uint32_t* tri = &indices[size_t(best)*3];
+        output.insert(output.end(), tri, tri+3);
+        added[size_t(best)] = true;
+
+        // Remove the triangle from active triangles of its vertices
+        for (int k=0; k<3; ++k)
+        {
+            uint32_t v = tri[k];
+            uint32_t* list = &adjacency[start[v]];
+            for (uint32_t i=0; i<activeTriangles[v]; ++i)
+                if (list[i] == uint32_t(best))
+                {
+                    list[i] = list[activeTriangles[v]-1];
+                    list[activeTriangles[v]-1] = uint32_t(best);
+                    break;
+                }
+            activeTriangles[v]--;
+        }
+
+        // Move vertices of the triangle to front of the cache
+        newCache.assign(tri, tri+3);
+        for (size_t i=0; i<cache.size(); ++i)
+            if (cache[i] != tri[0] && cache[i] != tri[1] && cache[i] != tri[2])
+                newCache.push_back(cache[i]);
+        cache.swap(newCache);
+
+        // Update scores of vertices in (or just pushed out of) the cache and of their triangles
+        for (size_t i=0; i<cache.size(); ++i)
+        {
+            uint32_t v = cache[i];
+            cachePosition[v] = i < size_t(CACHE_SIZE) ? int(i) : -1;
+            float score = VertexScore(cachePosition[v], activeTriangles[v]);
+            float delta = score - vertexScore[v];
+            vertexScore[v] = score;
+            for (uint32_t j=0; j<activeTriangles[v]; ++j)
+                triangleScore[adjacency[start[v]+j]] += delta;
+        }
+        if (cache.size() > size_t(CACHE_SIZE))
+            cache.resize(CACHE_SIZE);
+
+        // Continue with the best triangle using a vertex in cache
+        best = -1;
+        float bestScore = -1.0f;
+        for (size_t i=0; i<cache.size(); ++i)
+        {
+            uint32_t v = cache[i];
+            for (uint32_t j=0; j<activeTriangles[v]; ++j)
+            {
+                uint32_t t = adjacency[start[v]+j];
+                if (triangleScore[t] > bestScore)
+                {
+                    bestScore = triangleScore[t];
+                    best = long(t);
+                }
+            }
+        }
+    }
+
+    indices.swap(output);
+}
+
+size_t OptimizeVertexOrder(std::vector<uint32_t>& indices, size_t nvertices, std::vector<uint32_t>& remap)
+{
+    remap.assign(nvertices, UINT32_MAX);
+    uint32_t next = 0;
+    for (size_t i=0; i<indices.size(); ++i)
+    {
+        uint32_t& id = remap[indices[i]];
+        if (id == UINT32_MAX)
+            id = next++;
+        indices[i] = id;
+    }
+    return next;
+}
@@ -11,6 +11,10 @@
 #include <map>
 
 #include "../../include/transform.h"
+#include "../../include/MeshFormat.h"
+#include "../../include/Bitmap.h"
+#include "../../include/TextureFormat.h"
+#include <MeshOptimizer.h>
 
 mat4 ConvertMatrix(aiMatrix4x4 &mat)
 {
@@ -54,10 +58,63 @@ void WriteNode(aiNode* node)
         WriteNode(node->mChildren[i]);
 }
 
-int main()
+template<class IndexType>
+void WriteIndices(const std::vector<uint32_t>& indices32)
+{
+    std::vector<IndexType> indices(indices32.begin(), indices32.end());
+    if (!indices.empty())
+        file.write((char*)&indices[0], sizeof(IndexType)*indices.size());
+}
+
+struct Vertex
+{
+    vec3 position, normal;
+    vec2 tcoords;
+};
+
+// Bake a bitmap into a texture file: mip levels built and encoded as the renderer keeps them in memory
+void ConvertTexture(const std::string& iFilename, const std::string& oFilename, const std::string& formatName)
+{
+    TEXTURE_FORMAT format;
+    if (formatName == "rgba8")
+        format = TEXTURE_FORMAT_RGBA8;
+    else if (formatName == "bc1")
+        format = TEXTURE_FORMAT_BC1;
+    else if (formatName == "paletted")
+        format = TEXTURE_FORMAT_PALETTED;
+    else
+        throw Exception("Unknown texture format: " + formatName);
+
+    Bitmap bitmap;
+    bitmap.LoadFile(iFilename);
+    if (bitmap.width == 0 || bitmap.height == 0)
+        throw Exception("Couldn't read bitmap: " + iFilename);
+    if (bitmap.width > TEXTURE_MAX_SIZE || bitmap.height > TEXTURE_MAX_SIZE)
+        throw Exception("Bitmap too large for a texture file: " + iFilename);
+    std::vector<uint32_t> texels(bitmap.pixels.size());
+    for (size_t i=0; i<texels.size(); ++i)
+        texels[i] = PackTexel(bitmap.pixels[i]);
+
+    std::vector<uint8_t> image;
+    EncodeTexture(texels, (int)bitmap.width, (int)bitmap.height, format, image);
+    std::fstream out(oFilename, std::ios::binary | std::ios::out);
+    if (!out.good())
+        throw Exception("Couldn't open file: " + oFilename);
+    out.write((char*)&image[0], (std::streamsize)image.size());
+}
+
+// With arguments: model-conv texture.bmp texture.tex [rgba8|bc1|paletted]
+//  converts a texture, otherwise the mesh below
+int main(int argc, char* argv[])
 {
     try
     {
+        if (argc > 2)
+        {
+            ConvertTexture(argv[1], argv[2], argc > 3 ? argv[3] : "bc1");
+            return 0;
+        }
+
         Assimp::Importer importer;
         const std::string iFilename = "StickmanWalking.dae";
         const std::string oFilename = "test1.dat";
@@ -86,42 +143,98 @@ int main()
                 animated = true;
         }
 
-        if (animated)
-            WriteNode(scene->mRootNode);
+        bool quantized = false;
+        std::cout << "Want to quantize vertices? (y/n): ";
+        char q;
+        std::cin >> q;
+        if (q == 'y')
+            quantized = true;
 
-        // Import the mesh data and save it in the file
+        // Import the mesh data
         aiMesh* mesh = scene->mMeshes[0];
-        uint32_t nvertices;
-
-        nvertices = mesh->mNumVertices;
-        file.write((char*)&nvertices, sizeof(nvertices));
-
-        struct Vertex
-        {
-            aiVector3D position, normal;
-            aiVector2D tcoords;
-        };
-        std::vector<Vertex> vertices(nvertices);
+        std::vector<Vertex> vertices(mesh->mNumVertices);
         for (size_t i=0; i<mesh->mNumVertices; ++i)
         {
-            vertices[i].position = mesh->mVertices[i];
-            vertices[i].normal = mesh->mNormals[i];
+            vertices[i].position = vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
+            vertices[i].normal = vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
             vertices[i].tcoords.x = (!mesh->mTextureCoords[0])?0.0f:mesh->mTextureCoords[0][i].x;
             vertices[i].tcoords.y = (!mesh->mTextureCoords[0])?0.0f:mesh->mTextureCoords[0][i].y;
         }
-        file.write((char*)&vertices[0], sizeof(Vertex)*nvertices);
-
-        unsigned int tris = mesh->mNumFaces*3;
-        file.write((char*)&tris ,sizeof(tris));
-
-        std::vector<uint16_t> indices(tris);
+        std::vector<uint32_t> indices(mesh->mNumFaces*3);
         for (size_t i=0; i<mesh->mNumFaces; ++i)
         {    
             indices[i*3 + 0] = mesh->mFaces[i].mIndices[0];
             indices[i*3 + 1] = mesh->mFaces[i].mIndices[1];
             indices[i*3 + 2] = mesh->mFaces[i].mIndices[2];
         }
-        file.write((char*)&indices[0], sizeof(uint16_t)*tris);
+
+        // Bone weights of each vertex, as bone index and weight
+        std::vector<std::vector<std::pair<uint32_t, float>>> weights(vertices.size());
+        if (animated)
+            for (uint32_t j=0; j<mesh->mNumBones; ++j)
+                for (unsigned int k=0; k<mesh->mBones[j]->mNumWeights; ++k)
+                {
+                    const aiVertexWeight& wt = mesh->mBones[j]->mWeights[k];
+                    weights[wt.mVertexId].push_back(std::make_pair(j, wt.mWeight));
+                }
+
+        // Optimize the mesh:
+        //  1. Merge vertices with exactly the same attributes (and bone weights)
+        //  2. Reorder triangles so that neighbouring triangles are drawn together
+        //  3. Number vertices in order of first use so that they are fetched sequentially
+        std::vector<std::string> keys(vertices.size());
+        for (size_t i=0; i<vertices.size(); ++i)
+        {
+            keys[i].assign((char*)&vertices[i], sizeof(Vertex));
+            if (!weights[i].empty())
+                keys[i].append((char*)&weights[i][0], sizeof(weights[i][0])*weights[i].size());
+        }
+        std::vector<uint32_t> dedupe, reorder;
+        size_t nunique = DeduplicateVertices(keys, dedupe);
+        RemapIndices(indices, dedupe);
+        OptimizeTriangleOrder(indices, nunique);
+        uint32_t nvertices = (uint32_t)OptimizeVertexOrder(indices, nunique, reorder);
+
+        std::vector<Vertex> optimized(nvertices);
+        std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+        for (size_t i=0; i<vertices.size(); ++i)
+        {
+            remap[i] = reorder[dedupe[i]];
+            if (remap[i] != UINT32_MAX)
+                optimized[remap[i]] = vertices[i];
+        }
+        std::cout << "Vertices: " << vertices.size() << " -> " << nvertices << std::endl;
+
+        // Header telling the loader how vertices and indices are stored
+        //  Meshes with more than 65536 vertices are saved with 32-bit indices
+        bool wide = nvertices > 0x10000;
+        uint32_t header[2] = { MESH_FILE_MAGIC, (quantized ? (uint32_t)MESH_FILE_QUANTIZED : 0u) | (wide ? (uint32_t)MESH_FILE_WIDE_INDICES : 0u) };
+        file.write((char*)header, sizeof(header));
+
+        if (animated)
+            WriteNode(scene->mRootNode);
+
+        // Save the vertices
+        file.write((char*)&nvertices, sizeof(nvertices));
+        if (quantized)
+        {
+            PackingInfo info = ComputePackingInfo(&optimized[0].position, &optimized[0].tcoords, optimized.size(), sizeof(Vertex));
+            std::vector<PackedVertex> packed(nvertices);
+            for (size_t i=0; i<nvertices; ++i)
+                packed[i] = PackVertex(optimized[i].position, optimized[i].normal, optimized[i].tcoords, info);
+            file.write((char*)&info, sizeof(info));
+            file.write((char*)&packed[0], sizeof(PackedVertex)*nvertices);
+        }
+        else
+            file.write((char*)&optimized[0], sizeof(Vertex)*nvertices);
+
+        unsigned int tris = (unsigned int)indices.size();
+        file.write((char*)&tris ,sizeof(tris));
+
+        if (wide)
+            WriteIndices<uint32_t>(indices);
+        else
+            WriteIndices<uint16_t>(indices);
 
         if (animated)
         {
@@ -136,8 +249,21 @@ int main()
                 mat4 m = ConvertMatrix(bone->mOffsetMatrix);
                 file.write((char*)&m, sizeof(m));
 
-                file.write((char*)&bone->mNumWeights, sizeof(bone->mNumWeights));
-                file.write((char*)bone->mWeights, sizeof(aiVertexWeight)*bone->mNumWeights);
+                // Renumber weighted vertices; merged vertices had the same weights so keep just one
+                std::vector<aiVertexWeight> boneWeights;
+                std::vector<bool> written(nvertices, false);
+                for (unsigned int k=0; k<bone->mNumWeights; ++k)
+                {
+                    aiVertexWeight wt = bone->mWeights[k];
+                    wt.mVertexId = remap[wt.mVertexId];
+                    if (wt.mVertexId == UINT32_MAX || written[wt.mVertexId])
+                        continue;
+                    written[wt.mVertexId] = true;
+                    boneWeights.push_back(wt);
+                }
+                uint32_t nweights = (uint32_t)boneWeights.size();
+                file.write((char*)&nweights, sizeof(nweights));
+                file.write((char*)boneWeights.data(), sizeof(aiVertexWeight)*nweights);
             }
 
             aiAnimation * anim = scene->mAnimations[0];
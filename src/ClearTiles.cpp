@@ -0,0 +1,142 @@
+#include <common.h>
+#include <vector.h>
+#include <ClearTiles.h>
+#include <thread>
+
+void FillBuffer(uint32_t* p, size_t count, uint32_t value)
+{
+#ifdef USE_SSE_KERNELS
+    // Up to a 16 byte boundary, then 64 bytes a store loop
+    while (count > 0 && ((uintptr_t)p & 15) != 0)
+    {
+        *p++ = value;
+        --count;
+    }
+    __m128i v = _mm_set1_epi32((int)value);
+    for (; count >= 16; count -= 16, p += 16)
+    {
+        _mm_store_si128((__m128i*)p, v);
+        _mm_store_si128((__m128i*)(p + 4), v);
+        _mm_store_si128((__m128i*)(p + 8), v);
+        _mm_store_si128((__m128i*)(p + 12), v);
+    }
+    for (; count >= 4; count -= 4, p += 4)
+        _mm_store_si128((__m128i*)p, v);
+#endif
+    for (size_t i=0; i<count; ++i)
+        p[i] = value;
+}
+
+void FillBuffer(float* p, size_t count, float value)
+{
+#ifdef USE_SSE_KERNELS
+    while (count > 0 && ((uintptr_t)p & 15) != 0)
+    {
+        *p++ = value;
+        --count;
+    }
+    __m128 v = _mm_set1_ps(value);
+    for (; count >= 16; count -= 16, p += 16)
+    {
+        _mm_store_ps(p, v);
+        _mm_store_ps(p + 4, v);
+        _mm_store_ps(p + 8, v);
+        _mm_store_ps(p + 12, v);
+    }
+    for (; count >= 4; count -= 4, p += 4)
+        _mm_store_ps(p, v);
+#endif
+    for (size_t i=0; i<count; ++i)
+        p[i] = value;
+}
+
+void ClearTiles::Attach(uint32_t* color, float* depth, int width, int height, int pitch)
+{
+    m_color = color;
+    m_depth = depth;
+    m_width = width;
+    m_height = height;
+    m_pitch = pitch;
+    m_tilesX = (width + TILE_SIZE-1) / TILE_SIZE;
+    m_tilesY = (height + TILE_SIZE-1) / TILE_SIZE;
+    m_states.reset(new std::atomic<uint8_t>[GetNumTiles()]);
+    for (size_t i=0; i<GetNumTiles(); ++i)
+        m_states[i].store(TILE_DRAWN);
+}
+
+void ClearTiles::Clear(uint32_t clearColor)
+{
+    // Tiles keep holding the clear color only while it's the same
+    bool sameColor = clearColor == m_clearColor;
+    m_clearColor = clearColor;
+    for (size_t i=0; i<GetNumTiles(); ++i)
+    {
+        uint8_t state = m_states[i].load();
+        if (state == TILE_CLEAR || state == TILE_PENDING_DEPTH)
+            m_states[i].store(sameColor ? TILE_PENDING_DEPTH : TILE_PENDING);
+        else
+            m_states[i].store(TILE_PENDING);
+    }
+}
+
+void ClearTiles::Resolve()
+{
+    for (int y=0; y<m_tilesY; ++y)
+    for (int x=0; x<m_tilesX; ++x)
+    {
+        std::atomic<uint8_t>& state = m_states[size_t(y)*size_t(m_tilesX) + size_t(x)];
+        if (state.load() == TILE_PENDING)
+            FillTile(x, y, true, false);
+        if (state.load() != TILE_DRAWN)
+            state.store(TILE_CLEAR);
+    }
+}
+
+void ClearTiles::Flush()
+{
+    for (int y=0; y<m_tilesY; ++y)
+    for (int x=0; x<m_tilesX; ++x)
+    {
+        std::atomic<uint8_t>& state = m_states[size_t(y)*size_t(m_tilesX) + size_t(x)];
+        uint8_t s = state.load();
+        if (s != TILE_DRAWN)
+            FillTile(x, y, s == TILE_PENDING, true);
+        state.store(TILE_DRAWN);
+    }
+}
+
+void ClearTiles::Prepare(int tileX, int tileY)
+{
+    std::atomic<uint8_t>& state = m_states[size_t(tileY)*size_t(m_tilesX) + size_t(tileX)];
+    uint8_t s = state.load(std::memory_order_acquire);
+    while (s != TILE_DRAWN)
+    {
+        if (s == TILE_CLEARING)
+        {
+            // Another thread clears it
+            std::this_thread::yield();
+            s = state.load(std::memory_order_acquire);
+        }
+        else if (state.compare_exchange_weak(s, (uint8_t)TILE_CLEARING, std::memory_order_acquire))
+        {
+            // Tiles still holding the clear color only need depth
+            FillTile(tileX, tileY, s == TILE_PENDING, true);
+            state.store(TILE_DRAWN, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+void ClearTiles::FillTile(int tileX, int tileY, bool color, bool depth)
+{
+    int x0 = tileX*TILE_SIZE, y0 = tileY*TILE_SIZE;
+    size_t w = size_t(Min(TILE_SIZE, m_width - x0));
+    int y1 = Min(y0 + TILE_SIZE, m_height);
+    for (int y=y0; y<y1; ++y)
+    {
+        if (color)
+            FillBuffer(m_color + size_t(y)*size_t(m_width) + size_t(x0), w, m_clearColor);
+        if (depth)
+            FillBuffer(m_depth + size_t(y)*size_t(m_pitch) + size_t(x0), w, 1.0f);
+    }
+}
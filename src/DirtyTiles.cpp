@@ -0,0 +1,70 @@
+#include <common.h>
+#include <vector.h>
+#include <DirtyTiles.h>
+
+void DirtyTiles::Begin(int width, int height)
+{
+    if (width == m_width && height == m_height)
+        return;
+    m_width = width;
+    m_height = height;
+    m_tilesX = (width + TILE_SIZE-1) / TILE_SIZE;
+    m_tilesY = (height + TILE_SIZE-1) / TILE_SIZE;
+    m_hashes.assign(GetNumTiles(), 0);
+    m_changed.assign(GetNumTiles(), 1);
+    m_all = true;
+}
+
+void DirtyTiles::HashRows(const uint32_t* color, int firstRow, int lastRow)
+{
+    for (int tileY=firstRow; tileY<lastRow; ++tileY)
+    {
+        int y0 = tileY*TILE_SIZE, y1 = Min(y0 + TILE_SIZE, m_height);
+        for (int tileX=0; tileX<m_tilesX; ++tileX)
+        {
+            int x0 = tileX*TILE_SIZE, x1 = Min(x0 + TILE_SIZE, m_width);
+            // FNV-1a over the pixels, a word at a time
+            uint64_t hash = 14695981039346656037ull;
+            for (int y=y0; y<y1; ++y)
+            {
+                const uint32_t* row = color + size_t(y)*size_t(m_width);
+                for (int x=x0; x<x1; ++x)
+                    hash = (hash ^ row[x]) * 1099511628211ull;
+            }
+            size_t i = size_t(tileY)*size_t(m_tilesX) + size_t(tileX);
+            m_changed[i] = hash != m_hashes[i];
+            m_hashes[i] = hash;
+        }
+    }
+}
+
+size_t DirtyTiles::Gather(std::vector<Rect>& rects)
+{
+    rects.clear();
+    size_t numChanged = 0;
+    for (int tileY=0; tileY<m_tilesY; ++tileY)
+    {
+        const uint8_t* changed = &m_changed[size_t(tileY)*size_t(m_tilesX)];
+        for (int tileX=0; tileX<m_tilesX; )
+        {
+            if (!m_all && !changed[tileX])
+            {
+                ++tileX;
+                continue;
+            }
+            int first = tileX;
+            while (tileX < m_tilesX && (m_all || changed[tileX]))
+                ++tileX;
+            numChanged += size_t(tileX - first);
+
+            Rect rect;
+            rect.x = first*TILE_SIZE;
+            rect.y = tileY*TILE_SIZE;
+            rect.w = Min(tileX*TILE_SIZE, m_width) - rect.x;
+            rect.h = Min(rect.y + TILE_SIZE, m_height) - rect.y;
+            rects.push_back(rect);
+        }
+    }
+    m_all = false;
+    return numChanged;
+}
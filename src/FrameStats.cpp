@@ -0,0 +1,97 @@
+#include <common.h>
+#include <FrameStats.h>
+
+// Milliseconds between two points in time
+static double Milliseconds(FrameStatistics::Clock::time_point start, FrameStatistics::Clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+FrameStatistics::FrameStatistics() : m_numFrames(0), m_inFrame(false), m_stage(STAGE_UPDATE), m_recording(false)
+{
+    m_last = FrameStats();
+    for (int i=0; i<NUM_FRAME_STAGES; ++i)
+        m_stageTimes[i] = 0.0;
+}
+
+void FrameStatistics::BeginFrame(FRAME_STAGE stage)
+{
+    // Work done between frames counts for the next one
+    m_frameStart = m_stageStart = Clock::now();
+    for (int i=0; i<NUM_FRAME_STAGES; ++i)
+        m_stageTimes[i] = 0.0;
+    m_stage = stage;
+    m_inFrame = true;
+}
+
+FRAME_STAGE FrameStatistics::SetStage(FRAME_STAGE stage)
+{
+    FRAME_STAGE previous = m_stage;
+    if (m_inFrame)
+    {
+        Clock::time_point now = Clock::now();
+        m_stageTimes[m_stage] += Milliseconds(m_stageStart, now);
+        m_stageStart = now;
+    }
+    m_stage = stage;
+    return previous;
+}
+
+void FrameStatistics::EndFrame()
+{
+    if (!m_inFrame)
+        return;
+    SetStage(m_stage);
+    m_inFrame = false;
+
+    FrameStats stats;
+    stats.frameTime = Milliseconds(m_frameStart, m_stageStart);
+    for (int i=0; i<NUM_FRAME_STAGES; ++i)
+        stats.stageTimes[i] = m_stageTimes[i];
+
+    FrameCounters& counters = FrameCounters::Get();
+    stats.skinningTime = double(counters.skinningNanoseconds.exchange(0)) * 1e-6;
+    stats.verticesShaded = counters.verticesShaded.exchange(0);
+    stats.trianglesSubmitted = counters.trianglesSubmitted.exchange(0);
+    stats.trianglesClipped = counters.trianglesClipped.exchange(0);
+    stats.trianglesCulled = counters.trianglesCulled.exchange(0);
+    stats.trianglesRasterized = counters.trianglesRasterized.exchange(0);
+    stats.fragmentsTested = counters.fragmentsTested.exchange(0);
+    stats.fragmentsPassed = counters.fragmentsPassed.exchange(0);
+    stats.fragmentsShaded = stats.fragmentsPassed;
+
+    m_last = stats;
+    ++m_numFrames;
+    if (m_recording)
+        m_history.push_back(stats);
+}
+
+bool FrameStatistics::WriteCSV(const std::string& filename) const
+{
+    std::ofstream file(filename.c_str());
+    if (!file)
+    {
+        std::cout << "Couldn't write statistics to " << filename << std::endl;
+        return false;
+    }
+    file << "frame,frame_ms,update_ms,record_ms,shadow_ms,opaque_ms,transparent_ms,clear_ms,present_ms,skinning_ms,"
+            "vertices_shaded,triangles_submitted,triangles_clipped,triangles_culled,triangles_rasterized";
+#ifdef COUNT_FRAGMENTS
+    file << ",fragments_tested,fragments_passed,fragments_shaded";
+#endif
+    file << "\n";
+    for (size_t i=0; i<m_history.size(); ++i)
+    {
+        const FrameStats& s = m_history[i];
+        file << i << "," << s.frameTime;
+        for (int k=0; k<NUM_FRAME_STAGES; ++k)
+            file << "," << s.stageTimes[k];
+        file << "," << s.skinningTime
+             << "," << s.verticesShaded << "," << s.trianglesSubmitted << "," << s.trianglesClipped << "," << s.trianglesCulled << "," << s.trianglesRasterized;
+#ifdef COUNT_FRAGMENTS
+        file << "," << s.fragmentsTested << "," << s.fragmentsPassed << "," << s.fragmentsShaded;
+#endif
+        file << "\n";
+    }
+    return file.good();
+}
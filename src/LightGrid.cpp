@@ -0,0 +1,105 @@
+#include <common.h>
+#include <vector.h>
+#include <matrix.h>
+#include <LightGrid.h>
+
+void LightGrid::Build(const std::vector<LocalLight>& lights, const mat4& view, const mat4& proj, int width, int height)
+{
+    m_lights.clear();
+    m_offsets.clear();
+    m_indices.clear();
+    if (lights.empty() || width <= 0 || height <= 0)
+        return;
+
+    // Near and far planes from the projection, which maps view depth -n to -1 and -f to 1
+    m_near = proj[2][3] / (proj[2][2] - 1.0f);
+    float far = proj[2][3] / (proj[2][2] + 1.0f);
+    m_invNear = 1.0f / m_near;
+    m_sliceScale = (float)LIGHT_DEPTH_SLICES / log2f(far * m_invNear);
+    m_tilesX = (width + LIGHT_TILE_SIZE-1) / LIGHT_TILE_SIZE;
+    m_tilesY = (height + LIGHT_TILE_SIZE-1) / LIGHT_TILE_SIZE;
+
+    // Range of clusters of each light: tiles x0..x1, y0..y1 and slices s0..s1
+    struct Range { int x0, y0, s0, x1, y1, s1; };
+    std::vector<Range> ranges;
+    size_t numLights = Min(lights.size(), size_t(0xffff));
+    for (size_t i=0; i<numLights; ++i)
+    {
+        const LocalLight& light = lights[i];
+        float r = light.radius;
+        vec4 center = view * vec4(light.position);
+        float depth = -center.z;
+        if (r <= 0.0f || depth + r < m_near || depth - r > far)
+            continue;
+
+        Range range = { 0, 0, Slice(depth - r), m_tilesX-1, m_tilesY-1, Slice(depth + r) };
+        if (depth - r > m_near)
+        {
+            // Screen rectangle of the corners of the box around the sphere, all in front of the camera
+            float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+            for (int c=0; c<8; ++c)
+            {
+                vec4 p = proj * vec4(center.x + (c & 1 ? r : -r), center.y + (c & 2 ? r : -r), center.z + (c & 4 ? r : -r), 1.0f);
+                float x = (0.5f*p.x/p.w + 0.5f)*(float)width;
+                float y = (-0.5f*p.y/p.w + 0.5f)*(float)height;
+                minX = Min(minX, x);
+                maxX = Max(maxX, x);
+                minY = Min(minY, y);
+                maxY = Max(maxY, y);
+            }
+            if (maxX < 0.0f || maxY < 0.0f || minX >= (float)width || minY >= (float)height)
+                continue;
+            range.x0 = Max(int(minX), 0) / LIGHT_TILE_SIZE;
+            range.y0 = Max(int(minY), 0) / LIGHT_TILE_SIZE;
+            range.x1 = Min(int(maxX), width-1) / LIGHT_TILE_SIZE;
+            range.y1 = Min(int(maxY), height-1) / LIGHT_TILE_SIZE;
+        }
+        ranges.push_back(range);
+
+        Light l;
+        l.position = light.position;
+        l.radiusSquared = r*r;
+        l.invRadiusSquared = 1.0f / l.radiusSquared;
+        l.color = light.color;
+        l.direction = light.direction;
+        if (light.IsSpot())
+        {
+            l.cosOuter = cosf(light.outerAngle);
+            l.spotScale = 1.0f / Max(cosf(light.innerAngle) - l.cosOuter, 1e-4f);
+        }
+        else
+        {
+            // Spot factor never below 1
+            l.cosOuter = -2.0f;
+            l.spotScale = 1.0f;
+        }
+        m_lights.push_back(l);
+    }
+    if (m_lights.empty())
+        return;
+
+    // Count the lights of each cluster, then place each cluster's after those of the previous ones
+    size_t numClusters = GetNumClusters();
+    m_offsets.assign(numClusters + 1, 0);
+    for (size_t i=0; i<ranges.size(); ++i)
+    {
+        const Range& range = ranges[i];
+        for (int s=range.s0; s<=range.s1; ++s)
+        for (int y=range.y0; y<=range.y1; ++y)
+        for (int x=range.x0; x<=range.x1; ++x)
+            ++m_offsets[(size_t(s)*size_t(m_tilesY) + size_t(y))*size_t(m_tilesX) + size_t(x) + 1];
+    }
+    for (size_t c=0; c<numClusters; ++c)
+        m_offsets[c+1] += m_offsets[c];
+
+    std::vector<uint32_t> next(m_offsets.begin(), m_offsets.end()-1);
+    m_indices.resize(m_offsets[numClusters]);
+    for (size_t i=0; i<ranges.size(); ++i)
+    {
+        const Range& range = ranges[i];
+        for (int s=range.s0; s<=range.s1; ++s)
+        for (int y=range.y0; y<=range.y1; ++y)
+        for (int x=range.x0; x<=range.x1; ++x)
+            m_indices[next[(size_t(s)*size_t(m_tilesY) + size_t(y))*size_t(m_tilesX) + size_t(x)]++] = (uint16_t)i;
+    }
+}
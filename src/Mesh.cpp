@@ -1,6 +1,7 @@
 #include <common.h>
 #include <Mesh.h>
 #include <transform.h>
+#include <MeshSimplifier.h>
 
 Mesh::Mesh() : m_animation(NULL) {}
 
@@ -10,16 +11,141 @@ Mesh::~Mesh()
         delete m_animation;
 }
 
-void Mesh::ReadNode(std::fstream& file, Node* node)
+// Read the optional file header and return its flags
+//  Files without the header are left at the beginning
+static uint32_t ReadHeader(std::fstream& file)
+{
+    uint32_t header[2];
+    file.read((char*)header, sizeof(header));
+    if (file.good() && header[0] == MESH_FILE_MAGIC)
+        return header[1];
+    file.clear();
+    file.seekg(0);
+    return 0;
+}
+
+// Read vertices, keeping them packed if they were saved quantized
+void Mesh::ReadVertices(std::fstream& file, uint32_t nvertices, uint32_t flags)
+{
+    m_vertices.clear();
+    m_packedVertices.clear();
+    if (nvertices == 0)
+        return;
+    if (flags & MESH_FILE_QUANTIZED)
+    {
+        file.read((char*)&m_packing, sizeof(m_packing));
+        m_packedVertices.resize(nvertices);
+        file.read((char*)&m_packedVertices[0], nvertices*sizeof(PackedVertex));
+    }
+    else
+    {
+        m_vertices.resize(nvertices);
+        file.read((char*)&m_vertices[0], nvertices*sizeof(Vertex));
+    }
+}
+
+void Mesh::GetUnpackedVertices(std::vector<Vertex>& vertices) const
+{
+    if (!IsPacked())
+    {
+        vertices = m_vertices;
+        return;
+    }
+    vertices.resize(m_packedVertices.size());
+    for (size_t i=0; i<vertices.size(); ++i)
+        vertices[i] = UnpackVertex(m_packedVertices[i], m_packing);
+}
+
+void Mesh::Pack()
+{
+    if (IsPacked() || m_vertices.empty())
+        return;
+    m_packing = ComputePackingInfo(&m_vertices[0].position, &m_vertices[0].texcoords, m_vertices.size(), sizeof(Vertex));
+    m_packedVertices.resize(m_vertices.size());
+    for (size_t i=0; i<m_vertices.size(); ++i)
+        m_packedVertices[i] = PackVertex(m_vertices[i].position, m_vertices[i].normal, m_vertices[i].texcoords, m_packing);
+    std::vector<Vertex>().swap(m_vertices);
+
+    for (size_t l=0; l<m_lods.size(); ++l)
+    {
+        LODLevel& level = m_lods[l];
+        level.packedVertices.resize(level.vertices.size());
+        for (size_t i=0; i<level.vertices.size(); ++i)
+            level.packedVertices[i] = m_packedVertices[level.sourceVertices[i]];
+        std::vector<Vertex>().swap(level.vertices);
+    }
+
+    // Keep the position stream matching the positions drawn by the other passes
+    if (HasPositionStream())
+        SplitPositions();
+}
+
+void Mesh::ReadNode(std::fstream& file, int parent, std::map<unsigned int, size_t>& ids)
 {
     unsigned int id, nChildren;
     file.read((char*)&id, sizeof(id));
     file.read((char*)&nChildren, sizeof(nChildren));
-    m_animation->map[id] = node;
-    node->children.resize(nChildren);
+    int index = int(m_animation->nodes.size());
+    ids[id] = index;
+    Node node;
+    node.parent = parent;
+    m_animation->nodes.push_back(node);
     for (unsigned int i=0; i<nChildren; ++i)
-        ReadNode(file, &node->children[i]);
+        ReadNode(file, index, ids);
 }
+
+// Meshes with more than 65536 vertices can't be addressed by 16-bit indices, so they get 32-bit ones
+static bool NeedsWideIndices(size_t nvertices)
+{
+    return nvertices > 0x10000;
+}
+
+void IndexBuffer::Set(const std::vector<uint32_t>& indices, size_t nvertices)
+{
+    wide = NeedsWideIndices(nvertices);
+    if (wide)
+    {
+        indices16.clear();
+        indices32 = indices;
+    }
+    else
+    {
+        indices32.clear();
+        indices16.resize(indices.size());
+        for (size_t i=0; i<indices.size(); ++i)
+            indices16[i] = uint16_t(indices[i]);
+    }
+}
+
+void IndexBuffer::Read(std::fstream& file, bool wideIndices)
+{
+    uint32_t nindices;
+    file.read((char*)&nindices, sizeof(nindices));
+    wide = wideIndices;
+    if (wide)
+    {
+        indices16.clear();
+        indices32.resize(nindices);
+        if (nindices > 0)
+            file.read((char*)&indices32[0], nindices*sizeof(uint32_t));
+    }
+    else
+    {
+        indices32.clear();
+        indices16.resize(nindices);
+        if (nindices > 0)
+            file.read((char*)&indices16[0], nindices*sizeof(uint16_t));
+    }
+}
+
+void IndexBuffer::Get(std::vector<uint32_t>& indices) const
+{
+    if (wide)
+        indices = indices32;
+    else
+        indices.assign(indices16.begin(), indices16.end());
+}
+
 void Mesh::LoadAnimatedFile(const std::string &filename)
 {
     if (!m_animation)
@@ -33,23 +159,20 @@ void Mesh::LoadAnimatedFile(const std::string &filename)
         return;
     }
 
-    ReadNode(file, &m_animation->root);
+    uint32_t flags = ReadHeader(file);
+    std::map<unsigned int, size_t> ids;
+    ReadNode(file, -1, ids);
 
     std::vector<size_t> wtcnt;
 
     uint32_t nvertices;
     file.read((char*)&nvertices, sizeof(nvertices));
-    m_vertices.resize(nvertices);
     m_animation->skin.resize(nvertices);
-    m_animation->tempVertices.resize(nvertices);
     wtcnt.resize(nvertices, 0);
 
-    file.read((char*)&m_vertices[0], nvertices*sizeof(Vertex));
+    ReadVertices(file, nvertices, flags);
 
-    uint32_t nindices;
-    file.read((char*)&nindices, sizeof(nindices));
-    m_indices.resize(nindices);
-    file.read((char*)&m_indices[0], nindices*sizeof(uint16_t));
+    m_indices.Read(file, (flags & MESH_FILE_WIDE_INDICES) != 0);
 
 
     uint32_t nBones;
@@ -60,7 +183,7 @@ void Mesh::LoadAnimatedFile(const std::string &filename)
         Bone& bn = m_animation->bones[j];
         unsigned int id;
         file.read((char*)&id, sizeof(id));
-        bn.node = m_animation->map[id];
+        bn.node = ids[id];
         file.read((char*)&bn.offset, sizeof(bn.offset));
 
         uint32_t nWeights;
@@ -92,7 +215,7 @@ void Mesh::LoadAnimatedFile(const std::string &filename)
         NodeAnim& nd = anim.data[j];
         unsigned int id;
         file.read((char*)&id, sizeof(id));
-        nd.node = m_animation->map[id];
+        nd.node = ids[id];
         unsigned int knum;
         file.read((char*)&knum, sizeof(knum));
         nd.posKeys.resize(knum);
@@ -105,11 +228,13 @@ void Mesh::LoadAnimatedFile(const std::string &filename)
     file.close();
 }
 
-void Mesh::Animate(double time)
+void Mesh::Animate(Pose& pose, double time) const
 {
+    // Nodes without animation keep identity transform
+    pose.transforms.assign(m_animation->nodes.size(), mat4());
     for (size_t i=0; i<m_animation->animation.data.size(); ++i)
     {
-        NodeAnim& nd = m_animation->animation.data[i];
+        const NodeAnim& nd = m_animation->animation.data[i];
         size_t pk = 0, rk = 0;
 
         for (size_t j=1; j<nd.posKeys.size(); ++j)
@@ -140,20 +265,156 @@ void Mesh::Animate(double time)
 
         vec3 pos = nd.posKeys[pk].vec + (nd.posKeys[npk].vec - nd.posKeys[pk].vec)*pf;
         quat rot = nd.rotKeys[rk].rot + (nd.rotKeys[nrk].rot - nd.rotKeys[rk].rot)*rf;
-        nd.node->transform = Translate(pos) * mat4(rot);
+        pose.transforms[nd.node] = Translate(pos) * mat4(rot);
+    }
+
+    // Parents come before their children, so their combined transforms are ready
+    pose.combinedTransforms.resize(pose.transforms.size());
+    for (size_t i=0; i<pose.transforms.size(); ++i)
+    {
+        int parent = m_animation->nodes[i].parent;
+        if (parent >= 0)
+            pose.combinedTransforms[i] = pose.combinedTransforms[parent] * pose.transforms[i];
+        else
+            pose.combinedTransforms[i] = pose.transforms[i];
+    }
+}
+
+// Transform of a skinned vertex: the transforms of its bones blended by weight
+static mat4 SkinTransform(const std::vector<Bone>& bones, const Pose& pose, const WeightInfo& wt)
+{
+    mat4 t;
+    for (int k=0; k<6; ++k)
+    {
+        if (wt.weights[k] <= 0)
+            continue;
+        const Bone& bn = bones[wt.boneids[k]];
+        t = t + (pose.combinedTransforms[bn.node] * bn.offset) * wt.weights[k];
+    }
+    return t;
+}
+
+void Mesh::GetBuffers(size_t lod, Pose* pose, const std::vector<Vertex>*& vertices, const std::vector<PackedVertex>*& packedVertices, const IndexBuffer*& indices) const
+{
+    vertices = &m_vertices;
+    packedVertices = &m_packedVertices;
+    indices = &m_indices;
+    const uint32_t* source = NULL;
+    if (lod > 0 && lod <= m_lods.size())
+    {
+        vertices = &m_lods[lod-1].vertices;
+        packedVertices = &m_lods[lod-1].packedVertices;
+        indices = &m_lods[lod-1].indices;
+        source = &m_lods[lod-1].sourceVertices[0];
+    }
+    if (!IsPacked())
+        packedVertices = NULL;
+
+    if (!m_animation || !pose || pose->combinedTransforms.empty())
+        return;
+
+    SkinningScope skinning;
+    size_t count = packedVertices ? packedVertices->size() : vertices->size();
+    size_t level = source ? lod : 0;
+    if (pose->vertices.size() <= level)
+        pose->vertices.resize(level + 1);
+    std::vector<Vertex>& skinned = pose->vertices[level];
+    skinned.resize(count);
+    for (size_t i=0; i<count; ++i)
+    {
+        mat4 t = SkinTransform(m_animation->bones, *pose, m_animation->skin[source ? source[i] : i]);
+        Vertex& v = skinned[i];
+        v = packedVertices ? UnpackVertex((*packedVertices)[i], m_packing) : (*vertices)[i];
+        v.position = t*v.position;
+    }
+    vertices = &skinned;
+    packedVertices = NULL;
+}
+
+bool Mesh::GetPositionBuffers(size_t lod, Pose* pose, const std::vector<vec3>*& positions, const IndexBuffer*& indices) const
+{
+    const std::vector<Vertex>* vertices = &m_vertices;
+    const std::vector<PackedVertex>* packedVertices = &m_packedVertices;
+    positions = &m_positions;
+    indices = &m_indices;
+    const uint32_t* source = NULL;
+    if (lod > 0 && lod <= m_lods.size())
+    {
+        vertices = &m_lods[lod-1].vertices;
+        packedVertices = &m_lods[lod-1].packedVertices;
+        positions = &m_lods[lod-1].positions;
+        indices = &m_lods[lod-1].indices;
+        source = &m_lods[lod-1].sourceVertices[0];
+    }
+
+    if (!m_animation || !pose || pose->combinedTransforms.empty())
+        return !positions->empty();
+
+    // Skin positions only, reading them from the position stream when there is one
+    SkinningScope skinning;
+    size_t count = IsPacked() ? packedVertices->size() : vertices->size();
+    size_t level = source ? lod : 0;
+    if (pose->positions.size() <= level)
+        pose->positions.resize(level + 1);
+    std::vector<vec3>& skinned = pose->positions[level];
+    skinned.resize(count);
+    for (size_t i=0; i<count; ++i)
+    {
+        mat4 t = SkinTransform(m_animation->bones, *pose, m_animation->skin[source ? source[i] : i]);
+        if (!positions->empty())
+            skinned[i] = t*(*positions)[i];
+        else if (IsPacked())
+            skinned[i] = t*UnpackPosition((*packedVertices)[i], m_packing);
+        else
+            skinned[i] = t*(*vertices)[i].position;
     }
+    positions = &skinned;
+    return true;
+}
 
-    UpdateNode(m_animation->root);
+void Mesh::TransformViews(std::vector<MultiViewVertex>& views, const mat4 mvps[NUM_VIEWS], size_t lod, Pose* pose) const
+{
+    const std::vector<Vertex>* vertices;
+    const std::vector<PackedVertex>* packedVertices;
+    const IndexBuffer* indices;
+    GetBuffers(lod, pose, vertices, packedVertices, indices);
+
+    size_t count = packedVertices ? packedVertices->size() : vertices->size();
+    views.resize(count);
+    for (size_t i=0; i<count; ++i)
+    {
+        MultiViewVertex& v = views[i];
+        v.vertex = packedVertices ? UnpackVertex((*packedVertices)[i], m_packing) : (*vertices)[i];
+        vec4 p(v.vertex.position);
+        for (int k=0; k<NUM_VIEWS; ++k)
+            v.positions[k] = mvps[k] * p;
+    }
 }
 
-void Mesh::UpdateNode(Node& node, Node* parent)
+void Mesh::SplitPositions()
 {
-    if (parent)
-        node.combined_transform = parent->combined_transform * node.transform;
+    for (size_t lod=0; lod<GetNumLODs(); ++lod)
+        CopyPositions(lod);
+}
+
+// Fill the position stream of a level of detail from its vertices
+void Mesh::CopyPositions(size_t lod)
+{
+    std::vector<Vertex>& vertices = lod == 0 ? m_vertices : m_lods[lod-1].vertices;
+    std::vector<PackedVertex>& packedVertices = lod == 0 ? m_packedVertices : m_lods[lod-1].packedVertices;
+    std::vector<vec3>& positions = lod == 0 ? m_positions : m_lods[lod-1].positions;
+    if (IsPacked())
+    {
+        positions.resize(packedVertices.size());
+        for (size_t i=0; i<packedVertices.size(); ++i)
+            positions[i] = UnpackPosition(packedVertices[i], m_packing);
+    }
     else
-        node.combined_transform = node.transform;
-    for (size_t i=0; i<node.children.size(); ++i)
-        UpdateNode(node.children[i], &node);
+    {
+        positions.resize(vertices.size());
+        for (size_t i=0; i<vertices.size(); ++i)
+            positions[i] = vertices[i].position;
+    }
 }
 
 void Mesh::LoadFile(const std::string &filename)
@@ -166,15 +427,12 @@ void Mesh::LoadFile(const std::string &filename)
         return;
     }
 
+    uint32_t flags = ReadHeader(file);
     uint32_t nvertices;
     file.read((char*)&nvertices, sizeof(nvertices));
-    m_vertices.resize(nvertices);
-    file.read((char*)&m_vertices[0], nvertices*sizeof(Vertex));
+    ReadVertices(file, nvertices, flags);
 
-    uint32_t nindices;
-    file.read((char*)&nindices, sizeof(nindices));
-    m_indices.resize(nindices);
-    file.read((char*)&m_indices[0], nindices*sizeof(uint16_t));
+    m_indices.Read(file, (flags & MESH_FILE_WIDE_INDICES) != 0);
 
     file.close();
 }
@@ -216,8 +474,7 @@ void Mesh::LoadBox(float x, float y, float z)
         { vec3( x, -y, -z), vec3( 0,  0, -1), vec2(0.0f, 1.0f) },
     });
     
-    m_indices.resize(36);
-    m_indices = std::vector<uint16_t>
+    m_indices.Set(std::vector<uint32_t>
     ({
         0, 1, 3, 0, 3, 2,
         4, 5, 7, 4, 7, 6,
@@ -225,7 +482,7 @@ void Mesh::LoadBox(float x, float y, float z)
         12, 13, 15, 12, 15, 14,
         16, 17, 19, 16, 19, 18,
         20, 21, 23, 20, 23, 22
-    });
+    }), m_vertices.size());
 }
 
 void Mesh::LoadSphere(float radius, uint16_t rings, uint16_t sectors)
@@ -259,19 +516,19 @@ void Mesh::LoadSphere(float radius, uint16_t rings, uint16_t sectors)
             ++i;
         }
 
-    m_indices.resize((rings-1)*(sectors-1)*6);
-    auto id = &m_indices[0];
+    std::vector<uint32_t> indices((rings-1)*(sectors-1)*6);
+    auto id = &indices[0];
     for (r=0; r<rings-1; ++r)
         for (s=0; s<sectors-1; ++s)
         {
-            *id++ = uint16_t(r*sectors + s);
-            *id++ = uint16_t(r*sectors + s+1);
-            *id++ = uint16_t((r+1)*sectors + s+1);
-            *id++ = uint16_t(r*sectors + s);
-            *id++ = uint16_t((r+1)*sectors + s+1);
-            *id++ = uint16_t((r+1)*sectors + s);
+            *id++ = uint32_t(r*sectors + s);
+            *id++ = uint32_t(r*sectors + s+1);
+            *id++ = uint32_t((r+1)*sectors + s+1);
+            *id++ = uint32_t(r*sectors + s);
+            *id++ = uint32_t((r+1)*sectors + s+1);
+            *id++ = uint32_t((r+1)*sectors + s);
         }
-    
+    m_indices.Set(indices, m_vertices.size());
 }
 
 void Mesh::LoadCone(float radius, float height, unsigned sides)
@@ -332,15 +589,67 @@ void Mesh::LoadCone(float radius, float height, unsigned sides)
     vertices[sides * 2 + 1].texcoords = vec2(0.0f, 0.0f);
 
 
-    std::vector<unsigned short>& indices = m_indices;
+    std::vector<uint32_t> indices;
     for (unsigned i = 0; i < sides; ++i)
     {
-        indices.push_back(uint16_t((i + 1) % sides));
-        indices.push_back(uint16_t((i + 0) % sides));
-        indices.push_back(uint16_t(sides * 2 + 1));
+        indices.push_back(uint32_t((i + 1) % sides));
+        indices.push_back(uint32_t((i + 0) % sides));
+        indices.push_back(uint32_t(sides * 2 + 1));
         
-        indices.push_back(uint16_t((sides + i + 1) % (sides * 2)));
-        indices.push_back(uint16_t(sides * 2));
-        indices.push_back(uint16_t((sides + i + 0) % (sides * 2)));
+        indices.push_back(uint32_t((sides + i + 1) % (sides * 2)));
+        indices.push_back(uint32_t(sides * 2));
+        indices.push_back(uint32_t((sides + i + 0) % (sides * 2)));
+    }
+    m_indices.Set(indices, m_vertices.size());
+}
+
+void Mesh::GenerateLODs(size_t maxLevels, float ratio)
+{
+    m_lods.clear();
+    std::vector<uint32_t> base;
+    m_indices.Get(base);
+    std::vector<Vertex> vertices;
+    GetUnpackedVertices(vertices);
+
+    size_t previous = base.size()/3;
+    float error = 0.0f;
+    for (size_t l=0; l<maxLevels; ++l)
+    {
+        size_t target = size_t(float(previous)*ratio);
+        if (target < 4)
+            break;
+
+        // Simplify from the full detail mesh each time, so the error is measured against it
+        std::vector<uint32_t> indices = base;
+        error = Max(error, SimplifyMesh(vertices, indices, target));
+
+        // Stop when hardly anything could be collapsed (e.g. all vertices lie on seams)
+        size_t triangles = indices.size()/3;
+        if (triangles*10 > previous*9)
+            break;
+        previous = triangles;
+
+        // Keep only the vertices still used by the simplified triangles
+        m_lods.push_back(LODLevel());
+        LODLevel& level = m_lods.back();
+        std::vector<uint32_t> newIndex(vertices.size(), UINT32_MAX);
+        for (size_t i=0; i<indices.size(); ++i)
+        {
+            uint32_t& id = newIndex[indices[i]];
+            if (id == UINT32_MAX)
+            {
+                id = uint32_t(level.sourceVertices.size());
+                if (IsPacked())
+                    level.packedVertices.push_back(m_packedVertices[indices[i]]);
+                else
+                    level.vertices.push_back(vertices[indices[i]]);
+                level.sourceVertices.push_back(indices[i]);
+            }
+            indices[i] = id;
+        }
+        level.indices.Set(indices, level.sourceVertices.size());
+        level.error = error;
+        if (HasPositionStream())
+            CopyPositions(m_lods.size());
     }
 }
@@ -0,0 +1,210 @@
+#include <common.h>
+#include <Mesh.h>
+#include <MeshSimplifier.h>
+#include <algorithm>
+
+// Symmetric 4x4 matrix storing weighted sum of squared distances to a set of planes
+//  Error at point p is p^T * Q * p divided by total weight, i.e. mean squared distance
+struct Quadric
+{
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+    double w;
+
+    Quadric() : a2(0), ab(0), ac(0), ad(0), b2(0), bc(0), bd(0), c2(0), cd(0), d2(0), w(0) {}
+
+    // Quadric for plane ax+by+cz+d=0, weighted by w
+    Quadric(double a, double b, double c, double d, double w)
+    : a2(a*a*w), ab(a*b*w), ac(a*c*w), ad(a*d*w), b2(b*b*w), bc(b*c*w), bd(b*d*w),
+      c2(c*c*w), cd(c*d*w), d2(d*d*w), w(w) {}
+
+    Quadric& operator+=(const Quadric& q)
+    {
+        a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+        b2 += q.b2; bc += q.bc; bd += q.bd;
+        c2 += q.c2; cd += q.cd; d2 += q.d2;
+        w += q.w;
+        return *this;
+    }
+
+    double Error(const vec3& p) const
+    {
+        if (w == 0.0)
+            return 0.0;
+        double x = p.x, y = p.y, z = p.z;
+        double e = a2*x*x + 2*ab*x*y + 2*ac*x*z + 2*ad*x
+                          + b2*y*y + 2*bc*y*z + 2*bd*y
+                                   + c2*z*z + 2*cd*z
+                                            + d2;
+        return Max(e, 0.0) / w;
+    }
+};
+
+struct Collapse
+{
+    double cost;
+    uint32_t from, to;
+    bool operator<(const Collapse& other) const { return cost < other.cost; }
+};
+
+static vec3 TriangleNormal(const vec3& p0, const vec3& p1, const vec3& p2)
+{
+    return (p1-p0).Cross(p2-p0);
+}
+
+float SimplifyMesh(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, size_t targetTriangles)
+{
+    const size_t nvertices = vertices.size();
+    const int maxPasses = 32;
+
+    // Each vertex starts with the quadric of the planes of its triangles, weighted by area
+    std::vector<Quadric> quadrics(nvertices);
+    for (size_t i=0; i+2<indices.size(); i+=3)
+    {
+        const vec3 &p0 = vertices[indices[i]].position,
+                   &p1 = vertices[indices[i+1]].position,
+                   &p2 = vertices[indices[i+2]].position;
+        vec3 n = TriangleNormal(p0, p1, p2);
+        float area = n.Length();
+        if (area == 0.0f)
+            continue;
+        n = n / area;
+        Quadric q(n.x, n.y, n.z, -n.Dot(p0), area*0.5);
+        quadrics[indices[i]] += q;
+        quadrics[indices[i+1]] += q;
+        quadrics[indices[i+2]] += q;
+    }
+
+    double maxError = 0.0;
+    std::vector<uint32_t> remap(nvertices);
+    std::vector<bool> locked(nvertices), touched(nvertices);
+    std::vector<uint32_t> adjacencyStart(nvertices+1), adjacency;
+    std::vector<Collapse> collapses;
+    std::vector<uint64_t> edges;
+
+    for (int pass=0; pass<maxPasses && indices.size()/3 > targetTriangles; ++pass)
+    {
+        // Count triangles sharing each edge: an edge used by only one triangle lies on a border
+        //  Since vertices are split at attribute seams, this also finds seams
+        edges.clear();
+        for (size_t i=0; i<indices.size(); i+=3)
+            for (int k=0; k<3; ++k)
+            {
+                uint64_t a = indices[i+k], b = indices[i+(k+1)%3];
+                edges.push_back(Min(a, b) << 32 | Max(a, b));
+            }
+        std::sort(edges.begin(), edges.end());
+        std::fill(locked.begin(), locked.end(), false);
+        size_t nedges = 0;
+        for (size_t i=0; i<edges.size(); )
+        {
+            size_t j = i+1;
+            while (j < edges.size() && edges[j] == edges[i])
+                ++j;
+            if (j-i == 1)
+                locked[edges[i] >> 32] = locked[edges[i] & 0xFFFFFFFF] = true;
+            edges[nedges++] = edges[i];
+            i = j;
+        }
+        edges.resize(nedges);
+
+        // Triangles around each vertex
+        std::fill(adjacencyStart.begin(), adjacencyStart.end(), 0);
+        for (size_t i=0; i<indices.size(); ++i)
+            adjacencyStart[indices[i]+1]++;
+        for (size_t i=0; i<nvertices; ++i)
+            adjacencyStart[i+1] += adjacencyStart[i];
+        adjacency.resize(indices.size());
+        std::vector<uint32_t> fill(adjacencyStart.begin(), adjacencyStart.end()-1);
+        for (size_t i=0; i<indices.size(); ++i)
+            adjacency[fill[indices[i]]++] = uint32_t(i/3);
+
+        // Cheapest direction for each edge, then cheapest edges first
+        collapses.clear();
+        for (size_t i=0; i<edges.size(); ++i)
+        {
+            uint32_t a = uint32_t(edges[i] >> 32), b = uint32_t(edges[i] & 0xFFFFFFFF);
+            Quadric q = quadrics[a];
+            q += quadrics[b];
+            Collapse c;
+            c.cost = -1.0;
+            if (!locked[a])
+            {
+                c.cost = q.Error(vertices[b].position);
+                c.from = a; c.to = b;
+            }
+            if (!locked[b])
+            {
+                double cost = q.Error(vertices[a].position);
+                if (c.cost < 0.0 || cost < c.cost)
+                {
+                    c.cost = cost;
+                    c.from = b; c.to = a;
+                }
+            }
+            if (c.cost >= 0.0)
+                collapses.push_back(c);
+        }
+        std::sort(collapses.begin(), collapses.end());
+
+        for (size_t i=0; i<nvertices; ++i)
+            remap[i] = uint32_t(i);
+        std::fill(touched.begin(), touched.end(), false);
+
+        // Each interior collapse removes two triangles
+        size_t needed = (indices.size()/3 - targetTriangles + 1)/2;
+        size_t done = 0;
+        for (size_t c=0; c<collapses.size() && done<needed; ++c)
+        {
+            uint32_t from = collapses[c].from, to = collapses[c].to;
+            if (touched[from] || touched[to])
+                continue;
+
+            // Reject collapses that would flip any of the remaining triangles
+            bool flips = false;
+            for (uint32_t t=adjacencyStart[from]; t<adjacencyStart[from+1] && !flips; ++t)
+            {
+                const uint32_t* tri = &indices[adjacency[t]*3];
+                if (tri[0] == to || tri[1] == to || tri[2] == to)
+                    continue;
+                vec3 p[3], q[3];
+                for (int k=0; k<3; ++k)
+                {
+                    p[k] = vertices[tri[k]].position;
+                    q[k] = tri[k] == from ? vertices[to].position : p[k];
+                }
+                if (TriangleNormal(p[0], p[1], p[2]).Dot(TriangleNormal(q[0], q[1], q[2])) <= 0.0f)
+                    flips = true;
+            }
+            if (flips)
+                continue;
+
+            // Neighbourhood of the moved vertex changes, so leave it alone for the rest of this pass
+            for (uint32_t t=adjacencyStart[from]; t<adjacencyStart[from+1]; ++t)
+            {
+                const uint32_t* tri = &indices[adjacency[t]*3];
+                touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = true;
+            }
+            remap[from] = to;
+            quadrics[to] += quadrics[from];
+            maxError = Max(maxError, collapses[c].cost);
+            ++done;
+        }
+        if (done == 0)
+            break;
+
+        // Apply collapses and remove triangles that became degenerate
+        size_t n = 0;
+        for (size_t i=0; i<indices.size(); i+=3)
+        {
+            uint32_t a = remap[indices[i]], b = remap[indices[i+1]], c = remap[indices[i+2]];
+            if (a == b || b == c || c == a)
+                continue;
+            indices[n++] = a;
+            indices[n++] = b;
+            indices[n++] = c;
+        }
+        indices.resize(n);
+    }
+
+    return float(sqrt(maxError));
+}
@@ -1,14 +1,40 @@
 #include <common.h>
 #include <Renderer.h>
 
-Renderer::Renderer() : m_timer(/*60.0*/300.0)
-{}
+// Memory for count values starting on a cache line; allocation is what to delete[]
+template<class T>
+static T* AllocateAligned(size_t count, T*& allocation)
+{
+    const size_t ALIGNMENT = 64;
+    allocation = new T[count + ALIGNMENT/sizeof(T)];
+    return (T*)(((uintptr_t)allocation + ALIGNMENT-1) & ~(uintptr_t)(ALIGNMENT-1));
+}
+
+Renderer::Renderer() : m_framebuffer(NULL), m_width(0), m_height(0), m_timer(/*60.0*/300.0),
+                       m_window(NULL), m_screen(NULL), m_offscreen(false), m_colorAllocation(NULL), m_lazyClear(false),
+                       m_transparencyMode(TRANSPARENCY_BLEND), m_accumulating(false)
+{
+    transforms.bias = mat4(0.5f, 0, 0, 0.5f,
+                           0, -0.5f, 0, 0.5f,
+                           0, 0, 0.5f, 0.5f,
+                           0, 0, 0, 1);
+    shadows.numCascades = 0;
+    shadows.distance = 20.0f;
+    shadows.cascade = 0;
+    shadows.cacheValid = false;
+    shadows.filter = SHADOW_FILTER_PCF;
+    shadows.filterRadius = 1;
+    shadows.darkness = 0.54f;
+    shadows.minVariance = 0.00002f;
+    shadows.lightBleeding = 0.2f;
+}
 
 Renderer::~Renderer()
 {
     m_threader.Destroy();
     for (size_t i=0; i<m_depthBuffers.size(); ++i)
-        delete[] m_depthBuffers[i];
+        delete[] m_depthBuffers[i].allocation;
+    delete[] m_colorAllocation;
 }
 
 
@@ -22,7 +48,24 @@ void Renderer::Initialize(const char* title, int x, int y, int width, int height
     m_width = m_screen->w;
     m_height = m_screen->h;
 
-    m_depthBuffers.push_back(new float[m_width*m_height]);
+    AddDepthBuffer();
+    m_depthBufferId = 0;
+
+#ifdef USE_MULTITHREADING
+    m_threader.Initialize();
+#endif
+    m_threader.renderer = this;
+}
+
+void Renderer::InitializeOffscreen(int width, int height)
+{
+    m_offscreen = true;
+    m_width = Max(width, 1);
+    m_height = Max(height, 1);
+    m_framebuffer = AllocateAligned(size_t(m_width)*size_t(m_height), m_colorAllocation);
+    memset(m_framebuffer, 0, size_t(m_width)*size_t(m_height)*sizeof(uint32_t));
+
+    AddDepthBuffer();
     m_depthBufferId = 0;
 
 #ifdef USE_MULTITHREADING
@@ -31,8 +74,62 @@ void Renderer::Initialize(const char* title, int x, int y, int width, int height
     m_threader.renderer = this;
 }
 
+void Renderer::DrawFrame()
+{
+    m_statistics.SetStage(STAGE_RECORD);
+    if (m_width > 0 && m_height > 0 && m_render) 
+        m_render();
+    if (m_lazyClear)
+    {
+        m_statistics.SetStage(STAGE_CLEAR);
+        m_clearTiles.Resolve();
+    }
+}
+
+void Renderer::RunOffscreen(int numFrames)
+{
+    for (int i=0; i<numFrames; ++i)
+    {
+        m_statistics.BeginFrame();
+        if (m_update)
+            m_update(m_timer.GetTarget());
+        DrawFrame();
+        m_statistics.EndFrame();
+    }
+}
+
+bool Renderer::SaveFramebuffer(const std::string& filename) const
+{
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    if (!file)
+    {
+        std::cout << "Couldn't write frame to " << filename << std::endl;
+        return false;
+    }
+    file << "P6\n" << m_width << " " << m_height << "\n255\n";
+    std::vector<uint8_t> row(3*size_t(m_width));
+    for (int y=0; y<m_height; ++y)
+    {
+        const uint32_t* pixels = m_framebuffer + size_t(y)*size_t(m_width);
+        for (int x=0; x<m_width; ++x)
+        {
+            row[3*x] = uint8_t(pixels[x] >> 16);
+            row[3*x+1] = uint8_t(pixels[x] >> 8);
+            row[3*x+2] = uint8_t(pixels[x]);
+        }
+        file.write((const char*)&row[0], (std::streamsize)row.size());
+    }
+    return file.good();
+}
+
 void Renderer::MainLoop()
 {
+    if (m_offscreen)
+    {
+        std::cout << "No window to run the main loop in; use RunOffscreen" << std::endl;
+        return;
+    }
+
     SDL_Event e;
     bool quit = false;
     while (!quit)
@@ -43,8 +140,11 @@ void Renderer::MainLoop()
                 quit = true;
             else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE)
                 quit = true;
+            else if (e.type == SDL_WINDOWEVENT)
+                m_dirtyTiles.Invalidate();      // What the window shows may be lost
         }
 
+        m_statistics.BeginFrame();
         SDL_LockSurface(m_screen);
 
 //        std::string title = "FPS: " + std::to_string(m_timer.GetFPS());
@@ -54,24 +154,256 @@ void Renderer::MainLoop()
                 m_update(dt); 
         });
 
-        if (m_width > 0 && m_height > 0 && m_render) 
-            m_render();
+        DrawFrame();
         SDL_UnlockSurface(m_screen);
+        m_statistics.SetStage(STAGE_PRESENT);
+        Present();
+        m_statistics.EndFrame();
+    }
+}
+
+void Renderer::Present()
+{
+    m_dirtyTiles.Begin(m_width, m_height);
+#ifdef USE_MULTITHREADING
+    // Each thread hashes its share of the rows of tiles
+    DirtyTiles& dirtyTiles = m_dirtyTiles;
+    const uint32_t* framebuffer = m_framebuffer;
+    m_threader.Run([&dirtyTiles, framebuffer](int row, size_t numRows) {
+        dirtyTiles.HashRows(framebuffer, row, row + (int)numRows);
+    }, size_t(m_dirtyTiles.GetNumRows()));
+#else
+    m_dirtyTiles.HashRows(m_framebuffer, 0, m_dirtyTiles.GetNumRows());
+#endif
+
+    std::vector<DirtyTiles::Rect>& rects = m_dirtyRects;
+    size_t numChanged = m_dirtyTiles.Gather(rects);
+    if (numChanged == 0)
+        return;
+    // Mostly changed: updating the whole window costs less than many rectangles
+    if (2*numChanged > m_dirtyTiles.GetNumTiles())
+    {
         SDL_UpdateWindowSurface(m_window);
+        return;
     }
+    m_presentRects.resize(rects.size());
+    for (size_t i=0; i<rects.size(); ++i)
+    {
+        m_presentRects[i].x = rects[i].x;
+        m_presentRects[i].y = rects[i].y;
+        m_presentRects[i].w = rects[i].w;
+        m_presentRects[i].h = rects[i].h;
+    }
+    SDL_UpdateWindowSurfaceRects(m_window, &m_presentRects[0], (int)m_presentRects.size());
 }
 
 void Renderer::CleanUp()
 {
-    SDL_FreeSurface(m_screen);
-    SDL_DestroyWindow(m_window);
-    SDL_Quit();
+    if (!m_offscreen)
+    {
+        SDL_FreeSurface(m_screen);
+        SDL_DestroyWindow(m_window);
+        SDL_Quit();
+    }
     
     m_threader.Destroy();
     for (size_t i=0; i<m_depthBuffers.size(); ++i)
-        delete[] m_depthBuffers[i];
+        delete[] m_depthBuffers[i].allocation;
     m_depthBuffers.clear();
+    delete[] m_colorAllocation;
+    m_colorAllocation = NULL;
+    m_framebuffer = NULL;
     
 }
 
+size_t Renderer::AddDepthBuffer(int width, int height, int padding)
+{
+    DepthBuffer buffer;
+    buffer.width = width > 0 ? width : m_width;
+    buffer.height = height > 0 ? height : m_height;
+    buffer.pitch = buffer.width + 2*padding;
+    buffer.size = size_t(buffer.pitch) * size_t(buffer.height + 2*padding);
+    buffer.memory = AllocateAligned(buffer.size, buffer.allocation);
+    buffer.data = buffer.memory + padding*buffer.pitch + padding;
+    m_depthBuffers.push_back(buffer);
+    return m_depthBuffers.size()-1;
+}
+
+void Renderer::CreateShadowMaps(int numCascades, int width, int height, SHADOW_FILTER filter, int filterRadius)
+{
+    if (numCascades < 1 || numCascades > MAX_SHADOW_CASCADES)
+    {
+        std::cout << "Number of shadow cascades should be 1 to " << MAX_SHADOW_CASCADES << std::endl;
+        numCascades = Min(Max(numCascades, 1), (int)MAX_SHADOW_CASCADES);
+    }
+    if (filter == SHADOW_FILTER_PCF && (filterRadius < 0 || filterRadius > SHADOW_MAX_PCF_RADIUS))
+    {
+        std::cout << "Radius of shadow filter should be 0 to " << SHADOW_MAX_PCF_RADIUS << std::endl;
+        filterRadius = Min(Max(filterRadius, 0), SHADOW_MAX_PCF_RADIUS);
+    }
+    shadows.numCascades = numCascades;
+    shadows.filter = filter;
+    shadows.filterRadius = filterRadius;
+    for (int i=0; i<numCascades; ++i)
+    {
+        shadows.depthBuffers[i] = AddDepthBuffer(width, height, SHADOW_MAP_PADDING);
+        shadows.cacheBuffers[i] = AddDepthBuffer(width, height, SHADOW_MAP_PADDING);
+        shadows.crop[i] = mat4();
+        shadows.splits[i] = 1.0f;
+        if (filter == SHADOW_FILTER_VSM)
+            shadows.moments[i].resize(2*size_t(width)*size_t(height));
+    }
+    shadows.cacheValid = false;
+}
+
+void Renderer::FilterShadowMaps()
+{
+    if (shadows.filter != SHADOW_FILTER_VSM)
+        return;
+    for (int i=0; i<shadows.numCascades; ++i)
+    {
+        const DepthBuffer& map = m_depthBuffers[shadows.depthBuffers[i]];
+        ComputeShadowMoments(map.data, map.width, map.height, map.pitch, shadows.filterRadius, &shadows.moments[i][0], shadows.momentsScratch);
+    }
+}
+
+bool Renderer::ValidateShadowCache()
+{
+    bool valid = shadows.cacheValid;
+    for (int i=0; i<shadows.numCascades; ++i)
+    {
+        // Compared by value rather than by bytes, so that 0.0 and -0.0 don't invalidate the cache
+        mat4 vp = shadows.crop[i] * transforms.light_vp;
+        for (int j=0; j<4; ++j)
+            for (int k=0; k<4; ++k)
+                if (vp.m[j][k] != shadows.cacheVP[i].m[j][k])
+                    valid = false;
+        shadows.cacheVP[i] = vp;
+    }
+    shadows.cacheValid = true;
+    return valid;
+}
+
+void Renderer::CopyDepthBuffer(size_t fromId, size_t toId)
+{
+    const DepthBuffer& from = m_depthBuffers[fromId];
+    DepthBuffer& to = m_depthBuffers[toId];
+    FlushClear(from.data);
+    FlushClear(to.data);
+    assert(from.size == to.size && from.pitch == to.pitch);
+    memcpy(to.memory, from.memory, sizeof(float)*from.size);
+}
+
  
+
+void Renderer::ClearColor()
+{
+    StageScope stage(m_statistics, STAGE_CLEAR);
+    FlushClear(m_depthBuffers[m_depthBufferId].data);
+    uint32_t color = (0xFF << 24) | (m_clearColor.r << 16) | (m_clearColor.g << 8) | m_clearColor.b;
+#ifdef USE_MULTITHREADING
+    // Each thread clears its share of the rows
+    uint32_t* framebuffer = m_framebuffer;
+    size_t width = size_t(m_width);
+    m_threader.Run([framebuffer, width, color](int row, size_t numRows) {
+        FillBuffer(framebuffer + size_t(row)*width, numRows*width, color);
+    }, size_t(m_height));
+#else
+    FillBuffer(m_framebuffer, size_t(m_width)*size_t(m_height), color);
+#endif
+}
+
+void Renderer::ClearDepth()
+{
+    StageScope stage(m_statistics, STAGE_CLEAR);
+    DepthBuffer& target = m_depthBuffers[m_depthBufferId];
+    FlushClear(target.data);
+    // Padding included
+#ifdef USE_MULTITHREADING
+    float* memory = target.memory;
+    m_threader.Run([memory](int offset, size_t count) {
+        FillBuffer(memory + offset, count, 1.0f);
+    }, target.size);
+#else
+    FillBuffer(target.memory, target.size, 1.0f);
+#endif
+}
+
+void Renderer::ClearColorAndDepth()
+{
+    StageScope stage(m_statistics, STAGE_CLEAR);
+    DepthBuffer& target = m_depthBuffers[m_depthBufferId];
+    if (!m_lazyClear || target.width != m_width || target.height != m_height)
+    {
+        ClearColor();
+        ClearDepth();
+        return;
+    }
+    if (!m_clearTiles.IsAttachedTo(m_framebuffer, target.data, m_width, m_height))
+    {
+        // Padding is never drawn to, so it only needs clearing once
+        FillBuffer(target.memory, target.size, 1.0f);
+        m_clearTiles.Attach(m_framebuffer, target.data, m_width, m_height, target.pitch);
+    }
+    m_clearTiles.Clear((0xFF << 24) | (m_clearColor.r << 16) | (m_clearColor.g << 8) | m_clearColor.b);
+}
+
+void Renderer::SetLazyClear(bool lazyClear)
+{
+    if (!lazyClear)
+        m_clearTiles.Flush();
+    m_lazyClear = lazyClear;
+}
+
+void Renderer::BeginTransparency()
+{
+    if (m_transparencyMode != TRANSPARENCY_WEIGHTED)
+        return;
+    // Resolving leaves the buffers cleared, so they only need clearing when they're made
+    size_t numPixels = size_t(m_width)*size_t(m_height);
+    if (m_revealage.size() != numPixels)
+    {
+        m_accumulation.assign(numPixels*4, 0.0f);
+        m_revealage.assign(numPixels, 1.0f);
+    }
+    m_accumulating = true;
+}
+
+// Blend the average color of the transparent fragments of pixels first to last over the color buffer,
+//  covering it as much as they don't let it through, and clear the buffers for the next frame
+static void ResolvePixels(uint32_t* framebuffer, float* accumulation, float* revealage, size_t first, size_t last)
+{
+    for (size_t i=first; i<last; ++i)
+    {
+        float reveal = revealage[i];
+        if (reveal == 1.0f)
+            continue;
+        float* a = &accumulation[i*4];
+        float scale = (1.0f - reveal) / Max(a[3], 1e-5f);
+        uint32_t d = framebuffer[i];
+        float r = float((d >> 16) & 0xFF)*reveal + a[0]*scale*255.0f;
+        float g = float((d >> 8) & 0xFF)*reveal + a[1]*scale*255.0f;
+        float b = float(d & 0xFF)*reveal + a[2]*scale*255.0f;
+        framebuffer[i] = (0xFFu << 24) | (uint32_t(Min(r, 255.0f)) << 16) | (uint32_t(Min(g, 255.0f)) << 8) | uint32_t(Min(b, 255.0f));
+        a[0] = a[1] = a[2] = a[3] = 0.0f;
+        revealage[i] = 1.0f;
+    }
+}
+
+void Renderer::ResolveTransparency()
+{
+    if (!m_accumulating)
+        return;
+    m_accumulating = false;
+    uint32_t* framebuffer = m_framebuffer;
+    float* accumulation = m_accumulation.data();
+    float* revealage = m_revealage.data();
+#ifdef USE_MULTITHREADING
+    // Each thread resolves its share of the pixels
+    m_threader.Run([framebuffer, accumulation, revealage](int offset, size_t count) {
+        ResolvePixels(framebuffer, accumulation, revealage, size_t(offset), size_t(offset) + count);
+    }, m_revealage.size());
+#else
+    ResolvePixels(framebuffer, accumulation, revealage, 0, m_revealage.size());
+#endif
+}
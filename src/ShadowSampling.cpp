@@ -0,0 +1,52 @@
+#include <common.h>
+#include <vector.h>
+#include <ShadowSampling.h>
+
+void ComputeShadowMoments(const float* map, int width, int height, int pitch, int radius, float* moments, std::vector<float>& scratch)
+{
+    // Separable box filter with running sums: along rows into scratch, then down columns into moments
+    //  Texels past the edges repeat the edge texel
+    const float scale = 1.0f / float(2*radius+1);
+    scratch.resize(2*size_t(width)*size_t(height));
+    for (int y=0; y<height; ++y)
+    {
+        const float* row = map + y*pitch;
+        float* out = &scratch[2*size_t(y)*size_t(width)];
+        float sum = 0.0f, sumSquares = 0.0f;
+        for (int i=-radius; i<=radius; ++i)
+        {
+            float d = row[Min(Max(i, 0), width-1)];
+            sum += d;
+            sumSquares += d*d;
+        }
+        for (int x=0; x<width; ++x)
+        {
+            out[2*x] = sum * scale;
+            out[2*x+1] = sumSquares * scale;
+            float added = row[Min(x+radius+1, width-1)], removed = row[Max(x-radius, 0)];
+            sum += added - removed;
+            sumSquares += added*added - removed*removed;
+        }
+    }
+
+    // Sums of both moments of each column, over the rows around the current one
+    const int rowSize = 2*width;
+    std::vector<float> sums(rowSize, 0.0f);
+    for (int i=-radius; i<=radius; ++i)
+    {
+        const float* row = &scratch[size_t(Min(Max(i, 0), height-1))*size_t(rowSize)];
+        for (int x=0; x<rowSize; ++x)
+            sums[x] += row[x];
+    }
+    for (int y=0; y<height; ++y)
+    {
+        float* out = moments + size_t(y)*size_t(rowSize);
+        const float* added = &scratch[size_t(Min(y+radius+1, height-1))*size_t(rowSize)];
+        const float* removed = &scratch[size_t(Max(y-radius, 0))*size_t(rowSize)];
+        for (int x=0; x<rowSize; ++x)
+        {
+            out[x] = sums[x] * scale;
+            sums[x] += added[x] - removed[x];
+        }
+    }
+}
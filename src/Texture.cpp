@@ -0,0 +1,146 @@
+#include <common.h>
+#include <vector.h>
+#include <Texture.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Map a whole file read-only; the memory stays mapped until the last copy of the pointer is gone
+//  Returns null if the file can't be mapped
+static std::shared_ptr<const uint8_t> MapFile(const std::string& filename, size_t& size)
+{
+    size = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return std::shared_ptr<const uint8_t>();
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return std::shared_ptr<const uint8_t>();
+    const uint8_t* data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+        return std::shared_ptr<const uint8_t>();
+    size = (size_t)fileSize.QuadPart;
+    return std::shared_ptr<const uint8_t>(data, [](const uint8_t* p) { UnmapViewOfFile(p); });
+#else
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file < 0)
+        return std::shared_ptr<const uint8_t>();
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(file, &info) == 0 && info.st_size > 0)
+        data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED)
+        return std::shared_ptr<const uint8_t>();
+    size_t mappedSize = (size_t)info.st_size;
+    size = mappedSize;
+    return std::shared_ptr<const uint8_t>((const uint8_t*)data, [mappedSize](const uint8_t* p) { munmap((void*)p, mappedSize); });
+#endif
+}
+
+void Texture::Create(const Bitmap& bitmap, TEXTURE_FILTER filter, TEXTURE_FORMAT format)
+{
+    std::vector<uint32_t> texels(bitmap.pixels.size());
+    for (size_t i=0; i<texels.size(); ++i)
+        texels[i] = PackTexel(bitmap.pixels[i]);
+    std::vector<uint8_t> image;
+    EncodeTexture(texels, (int)bitmap.width, (int)bitmap.height, format, image);
+
+    // Copy of the image aligned like a mapped file
+    uint8_t* memory = new uint8_t[image.size() + TEXTURE_FILE_ALIGNMENT];
+    uint8_t* aligned = memory + (TEXTURE_FILE_ALIGNMENT - (size_t)memory % TEXTURE_FILE_ALIGNMENT) % TEXTURE_FILE_ALIGNMENT;
+    memcpy(aligned, &image[0], image.size());
+    Attach(std::shared_ptr<const uint8_t>(aligned, [memory](const uint8_t*) { delete[] memory; }), image.size(), filter, "bitmap");
+    m_mapped = false;
+}
+
+bool Texture::LoadFile(const std::string& filename, TEXTURE_FILTER filter, TEXTURE_FORMAT format)
+{
+    size_t size;
+    std::shared_ptr<const uint8_t> memory = MapFile(filename, size);
+    if (!memory)
+    {
+        std::cout << "Couldn't load texture: " << filename << std::endl;
+        return false;
+    }
+    if (size >= sizeof(uint32_t) && *(const uint32_t*)memory.get() == TEXTURE_FILE_MAGIC)
+    {
+        m_mapped = Attach(memory, size, filter, filename);
+        return m_mapped;
+    }
+    memory.reset();
+
+    Bitmap bitmap;
+    bitmap.LoadFile(filename);
+    if (bitmap.width == 0 || bitmap.height == 0)
+        return false;
+    Create(bitmap, filter, format);
+    return true;
+}
+
+bool Texture::Attach(const std::shared_ptr<const uint8_t>& memory, size_t size, TEXTURE_FILTER filter, const std::string& name)
+{
+    m_levels.clear();
+    m_memory.reset();
+    m_size = 0;
+    m_texels = NULL;
+    m_blocks = NULL;
+    m_indices = NULL;
+    m_palette = NULL;
+
+    TextureFileHeader header;
+    if (size < sizeof(header))
+    {
+        std::cout << "Texture file too short: " << name << std::endl;
+        return false;
+    }
+    memcpy(&header, memory.get(), sizeof(header));
+    std::vector<TextureLevel> levels;
+    // The size is checked before computing the levels, so that tile counts and offsets can't overflow
+    bool validSize = header.width >= 1 && header.width <= TEXTURE_MAX_SIZE && header.height >= 1 && header.height <= TEXTURE_MAX_SIZE;
+    size_t numTiles = validSize ? ComputeTextureLevels((int)header.width, (int)header.height, levels) : 0;
+    if (header.magic != TEXTURE_FILE_MAGIC || header.version != TEXTURE_FILE_VERSION || header.format > TEXTURE_FORMAT_PALETTED ||
+        numTiles == 0 || header.dataSize != numTiles*GetTileSize((TEXTURE_FORMAT)header.format) ||
+        header.dataOffset % TEXTURE_FILE_ALIGNMENT != 0 || size_t(header.dataOffset) + header.dataSize > size ||
+        (header.format == TEXTURE_FORMAT_PALETTED && (header.paletteOffset == 0 || header.paletteOffset % sizeof(uint32_t) != 0 ||
+                                                      size_t(header.paletteOffset) + 256*sizeof(uint32_t) > size)))
+    {
+        std::cout << "Invalid texture file: " << name << std::endl;
+        return false;
+    }
+
+    m_filter = filter;
+    m_format = (TEXTURE_FORMAT)header.format;
+    for (size_t l=0; l<levels.size(); ++l)
+    {
+        Level level;
+        level.width = levels[l].width;
+        level.height = levels[l].height;
+        level.fwidth = (float)level.width;
+        level.fheight = (float)level.height;
+        level.tilesPerRow = levels[l].tilesPerRow;
+        level.offset = levels[l].offset;
+        m_levels.push_back(level);
+    }
+    m_memory = memory;
+    m_size = size;
+    const uint8_t* data = memory.get() + header.dataOffset;
+    m_texels = (const uint32_t*)data;
+    m_blocks = (const BC1Block*)data;
+    m_indices = data;
+    if (header.format == TEXTURE_FORMAT_PALETTED)
+        m_palette = (const uint32_t*)(memory.get() + header.paletteOffset);
+    return true;
+}
@@ -0,0 +1,118 @@
+#include <common.h>
+#include <vector.h>
+#include <fastmath.h>
+#include <chrono>
+#include <vector>
+
+// Largest error of approx against exact over inputs, relative unless absolute is set
+template<class Approx, class Exact>
+static double MaxError(const std::vector<float>& inputs, Approx approx, Exact exact, bool absolute=false)
+{
+    double maxError = 0.0;
+    for (size_t i=0; i<inputs.size(); ++i)
+    {
+        double e = exact(inputs[i]);
+        double error = fabs((double)approx(inputs[i]) - e);
+        if (!absolute && e != 0.0)
+            error /= fabs(e);
+        maxError = Max(maxError, error);
+    }
+    return maxError;
+}
+
+// Nanoseconds per input of f, best of a few runs
+template<class Function>
+static double Time(const std::vector<float>& inputs, Function f)
+{
+    double best = 1e30;
+    volatile float sink = 0.0f;
+    for (int run=0; run<5; ++run)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        float sum = 0.0f;
+        for (size_t i=0; i<inputs.size(); ++i)
+            sum += f(inputs[i]);
+        auto end = std::chrono::high_resolution_clock::now();
+        sink = sink + sum;
+        best = Min(best, std::chrono::duration<double, std::nano>(end - start).count() / (double)inputs.size());
+    }
+    return best;
+}
+
+#ifdef USE_SSE_KERNELS
+template<class Function>
+static double Time4(const std::vector<float>& inputs, Function f)
+{
+    double best = 1e30;
+    volatile float sink = 0.0f;
+    for (int run=0; run<5; ++run)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        __m128 sum = _mm_setzero_ps();
+        for (size_t i=0; i+4<=inputs.size(); i+=4)
+            sum = _mm_add_ps(sum, f(_mm_loadu_ps(&inputs[i])));
+        auto end = std::chrono::high_resolution_clock::now();
+        sink = sink + _mm_cvtss_f32(sum);
+        best = Min(best, std::chrono::duration<double, std::nano>(end - start).count() / (double)inputs.size());
+    }
+    return best;
+}
+#endif
+
+// Inputs spread evenly over [from, to], or logarithmically for positive ranges when logarithmic is set
+static std::vector<float> Range(float from, float to, bool logarithmic=false)
+{
+    const size_t count = 1 << 20;
+    std::vector<float> inputs(count);
+    for (size_t i=0; i<count; ++i)
+    {
+        double t = (double)i / (double)(count-1);
+        inputs[i] = logarithmic ? (float)(from * pow(to/from, t)) : (float)(from + (to-from)*t);
+    }
+    return inputs;
+}
+
+template<MATH_ACCURACY accuracy>
+static void BenchmarkTier(const char* name)
+{
+    std::vector<float> positive = Range(1e-4f, 1e4f, true), exponents = Range(-20.0f, 20.0f), cosines = Range(0.0f, 1.0f);
+    // Not known to the compiler, as the shininess of a material isn't, so that pow isn't turned into multiplies
+    volatile float volatileShininess = 32.0f;
+    const float shininess = volatileShininess;
+
+    double exp2Error = MaxError(exponents, [](float x) { return Exp2<accuracy>(x); }, [](float x) { return pow(2.0, (double)x); });
+    double log2Error = MaxError(positive, [](float x) { return Log2<accuracy>(x); }, [](float x) { return log((double)x)/log(2.0); }, true);
+    double powError = MaxError(cosines, [=](float x) { return Pow<accuracy>(x, shininess); }, [=](float x) { return pow((double)x, (double)shininess); }, true);
+
+    std::cout << name << std::endl;
+    std::cout << "  exp2   relative error " << exp2Error << ", " << Time(exponents, [](float x) { return Exp2<accuracy>(x); }) << " ns" << std::endl;
+    std::cout << "  log2   absolute error " << log2Error << ", " << Time(positive, [](float x) { return Log2<accuracy>(x); }) << " ns" << std::endl;
+    std::cout << "  pow    absolute error " << powError << " (x^" << shininess << " on [0, 1]), "
+              << Time(cosines, [=](float x) { return Pow<accuracy>(x, shininess); }) << " ns" << std::endl;
+#ifdef USE_SSE_KERNELS
+    std::cout << "  SIMD rsqrt " << Time4(positive, [](__m128 x) { return Rsqrt4<accuracy>(x); }) << " ns, exp2 "
+              << Time4(exponents, [](__m128 x) { return Exp2_4<accuracy>(x); }) << " ns, log2 "
+              << Time4(positive, [](__m128 x) { return Log2_4<accuracy>(x); }) << " ns, pow "
+              << Time4(cosines, [=](__m128 x) { return Pow4<accuracy>(x, _mm_set1_ps(shininess)); }) << " ns" << std::endl;
+#endif
+}
+
+void BenchmarkFastMath()
+{
+    std::vector<float> positive = Range(1e-4f, 1e4f, true);
+    double rsqrtError = MaxError(positive, [](float x) { return Rsqrt(x); }, [](float x) { return 1.0/sqrt((double)x); });
+    std::cout << "Scalar rsqrt relative error " << rsqrtError << ", " << Time(positive, [](float x) { return Rsqrt(x); }) << " ns" << std::endl;
+    BenchmarkTier<MATH_EXACT>("Exact");
+    BenchmarkTier<MATH_FAST>("Fast");
+    BenchmarkTier<MATH_FASTEST>("Fastest");
+
+    std::vector<float> cosines = Range(0.0f, 1.0f);
+    SpecularTable table;
+    table.Build(32.0f);
+    double error = MaxError(cosines, [&](float x) { return table.Lookup(x); }, [](float x) { return pow((double)x, 32.0); }, true);
+    std::cout << "Specular table absolute error " << error << " (x^32 on [0, 1]), "
+              << Time(cosines, [&](float x) { return table.Lookup(x); }) << " ns" << std::endl;
+    volatile double volatileShininess = 32.0;
+    const double shininess = volatileShininess;
+    std::cout << "Double precision pow " << Time(cosines, [=](float x) { return (float)pow((double)x, shininess); }) << " ns" << std::endl;
+}
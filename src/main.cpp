@@ -3,6 +3,7 @@
 #include <transform.h>
 #include <TextureManager.h>
 #include <Mesh.h>
+#include <MeshManager.h>
 
 //#define TOON_SHADING
 
@@ -14,6 +15,7 @@
 
 Renderer g_renderer;                // Default renderer
 TextureManager g_textureManager;    // Default texture manager
+MeshManager g_meshManager;          // Default mesh manager
 
 /*
     Entity-Component-System approach of programming
@@ -30,14 +32,40 @@ TextureManager g_textureManager;    // Default texture manager
 std::vector<Entity> g_entities;     // Collection of all entities
 std::vector<SystemBase*> g_systems; // Collection of all systems
 
-// Bias matrix for texture transformation
-mat4 bias_matrix
-(
-    0.5f, 0, 0, 0.5f,
-    0, -0.5f, 0, 0.5f,
-    0, 0, 0.5f, 0.5f,
-    0, 0, 0, 1
-);
+// Draws of the frame, gathered from the systems and sorted in the render queue
+//  While nothing in the scene changes, the frame is drawn again from the same commands
+RenderQueue g_renderQueue;
+CommandList g_frameCommands;
+// Draws of static shadow casters, only kept when the shadow cache has to be drawn again
+RenderQueue g_staticShadowQueue;
+CommandList g_shadowCacheCommands;
+bool g_sceneChanged = true;
+
+// Shadow maps are sized apart from the window, so shadow cost and quality can be tuned on their own
+//  More than one cascade splits the camera frustum between maps, each fit to its slice
+//  Shadows are filtered with PCF over a 3x3 kernel; SHADOW_FILTER_VSM gives soft shadows for one filtered fetch
+const int SHADOW_CASCADES = 1;
+const int SHADOW_MAP_SIZE = 768;
+const SHADOW_FILTER SHADOW_FILTERING = SHADOW_FILTER_PCF;
+const int SHADOW_FILTER_RADIUS = 1;
+
+// Transform vertices for camera and light in one sweep (multi-view), in the shadow pass for the passes after it
+//  Without it, the shadow pass draws positions alone, from a stream of their own for the meshes that have one
+const bool MULTI_VIEW = true;
+
+// Clear the window lazily, by tiles as they are drawn into
+const bool LAZY_CLEAR = true;
+// Blend transparent surfaces in any order, without sorting them
+const Renderer::TRANSPARENCY_MODE TRANSPARENCY = Renderer::TRANSPARENCY_WEIGHTED;
+
+// Materials of the scene, each with only the shader features its surfaces need
+typedef SurfaceMaterial<SHADER_TEXTURE | SHADER_SHADOW | SHADER_LIGHTS> TexturedMaterial;
+typedef SurfaceMaterial<SHADER_SHADOW | SHADER_LIGHTS> ColorMaterial;
+typedef SurfaceMaterial<SHADER_SHADOW | SHADER_SPECULAR | SHADER_LIGHTS> ShinyMaterial;
+typedef SurfaceMaterial<SHADER_SHADOW | SHADER_SPECULAR | SHADER_ALPHA | SHADER_LIGHTS> GlassMaterial;
+
+// Colored point lights in a ring over the ground, besides the directional light and a spot light on the stickman
+const int NUM_POINT_LIGHTS = 12;
 
 float angle=(180)*3.1415f/180.0f;
 // Render objects
@@ -52,24 +80,69 @@ void Render()
     trans = g_entities[3].GetComponent<TransformComponent>();
     trans->SetTransform(LookAt(vec3(cosf(angle)*5, 2, sinf(angle)*5), vec3(0,0,0), vec3(0,1,0)).AffineInverse());
 
-    // First Pass:
-    // Create depth buffer in light space
-    g_renderer.UseDepthBuffer(1);
-    g_renderer.ClearDepth();
-    for (size_t i=0; i<g_systems.size(); ++i)
-        g_systems[i]->RenderShadow();
-
-    // Second Pass:
-    // Render the scene and use previous depth buffer for shadow mapping
-    g_renderer.UseDepthBuffer(0);
-    g_renderer.ClearColorAndDepth();
-    for (size_t i=0; i<g_systems.size(); ++i)
-        g_systems[i]->Render();
+    if (g_sceneChanged)
+    {
+        g_frameCommands.Clear();
+        for (size_t i=0; i<g_systems.size(); ++i)
+            g_systems[i]->SetRenderQueue(&g_renderQueue, &g_staticShadowQueue);
+
+        // First Pass:
+        // Create depth buffer in light space for each shadow cascade
+        //  Static casters are drawn into the cache of the shadow map, which the map starts from
+        for (int k=0; k<g_renderer.shadows.numCascades; ++k)
+        {
+            size_t shadowMap = g_renderer.shadows.depthBuffers[k];
+            size_t cache = g_renderer.shadows.cacheBuffers[k];
+            g_staticShadowQueue.Add(RenderQueue::SetupKey(PASS_SHADOW, k)).Record([cache](Renderer& renderer) {
+                renderer.GetStatistics().SetStage(STAGE_SHADOW);
+                renderer.UseDepthBuffer(cache);
+                renderer.ClearDepth();
+            });
+            g_renderQueue.Add(RenderQueue::SetupKey(PASS_SHADOW, k)).Record([shadowMap, cache](Renderer& renderer) {
+                renderer.GetStatistics().SetStage(STAGE_SHADOW);
+                renderer.CopyDepthBuffer(cache, shadowMap);
+                renderer.UseDepthBuffer(shadowMap);
+            });
+        }
+        for (size_t i=0; i<g_systems.size(); ++i)
+            g_systems[i]->RenderShadow();
+        if (g_renderer.ValidateShadowCache())
+            g_staticShadowQueue.Clear();
+        else
+            g_staticShadowQueue.Flush(g_shadowCacheCommands);
+
+        // Second Pass:
+        // Render the scene and use previous depth buffer for shadow mapping
+        g_renderQueue.Add(RenderQueue::SetupKey(PASS_OPAQUE)).Record([](Renderer& renderer) {
+            renderer.GetStatistics().SetStage(STAGE_OPAQUE);
+            renderer.FilterShadowMaps();
+            renderer.CullLights();
+            renderer.UseDepthBuffer(0);
+            renderer.ClearColorAndDepth();
+        });
+        for (size_t i=0; i<g_systems.size(); ++i)
+            g_systems[i]->Render();
+
+        // Third Pass:
+        // Render the scene with transparent objects, then resolve them over it when blended by weight
+        g_renderQueue.Add(RenderQueue::SetupKey(PASS_TRANSPARENT)).Record([](Renderer& renderer) {
+            renderer.GetStatistics().SetStage(STAGE_TRANSPARENT);
+            renderer.BeginTransparency();
+        });
+        for (size_t i=0; i<g_systems.size(); ++i)
+            g_systems[i]->PostRender();
+        g_renderQueue.Add(RenderQueue::SetupKey(PASS_COMPOSITE)).Record([](Renderer& renderer) {
+            renderer.ResolveTransparency();
+        });
+
+        g_renderQueue.Flush(g_frameCommands);
+        g_sceneChanged = false;
+    }
 
-    // Third Pass:
-    // Render the scene with transparent objects
-    for (size_t i=0; i<g_systems.size(); ++i)
-        g_systems[i]->PostRender();
+    // The shadow cache is drawn once, before the frames that use it
+    g_shadowCacheCommands.Execute(g_renderer);
+    g_shadowCacheCommands.Clear();
+    g_frameCommands.Execute(g_renderer);
 }
 
 // On resize of window, we calculate the projection matrix
@@ -81,10 +154,12 @@ void Resize(int width, int height)
 
     for (size_t i=0; i<g_systems.size(); ++i)
         g_systems[i]->Resize(width, height);
+    g_sceneChanged = true;
 }
 
 double animtime;
-Mesh* g_stickmesh = NULL;
+MeshHandle g_stickmesh;
+Pose* g_stickpose = NULL;
 bool firstTime = true;
 // Update each frame by time-step dt
 void Update(double dt)
@@ -95,7 +170,9 @@ void Update(double dt)
         firstTime = false;
     }
     //angle += float(dt/10);
-    const uint8_t* keys = SDL_GetKeyboardState(NULL);
+    // No keyboard when drawing offscreen
+    static const uint8_t noKeys[SDL_NUM_SCANCODES] = {};
+    const uint8_t* keys = g_renderer.IsOffscreen() ? noKeys : SDL_GetKeyboardState(NULL);
     auto trans = g_entities[0].GetComponent<TransformComponent>();
     vec3 rot = trans->GetRotation();
     if (keys[SDL_SCANCODE_RIGHT])
@@ -140,6 +217,10 @@ void Update(double dt)
     if (keys[SDL_SCANCODE_E])
         angle -= (float)dt;
 
+    // Anything moving needs the frame to be recorded again
+    if (animating || keys[SDL_SCANCODE_RIGHT] || keys[SDL_SCANCODE_LEFT] || keys[SDL_SCANCODE_Q] || keys[SDL_SCANCODE_E])
+        g_sceneChanged = true;
+
     for (size_t i=0; i<g_systems.size(); ++i)
         g_systems[i]->Update(dt);
 
@@ -148,7 +229,7 @@ void Update(double dt)
         animtime += dt*2;
         if (animtime > g_stickmesh->GetAnimation()->duration)
             animtime -= g_stickmesh->GetAnimation()->duration;
-        g_stickmesh->Animate(animtime);
+        g_stickmesh->Animate(*g_stickpose, animtime);
     }
 }
 
@@ -157,16 +238,55 @@ void Update(double dt)
 #define SDL_main main
 #endif
 
-int main()
+int main(int argc, char* argv[])
 {
-    g_renderer.Initialize("Stickman-3D", 100, 100, 800, 600);
+    // Command line:
+    //  --benchmark-math, --benchmark-shaders   Print speed of the shader math or of the shader variants, then quit
+    //  --benchmark-meshes                      Print speed of drawing triangles by index width and of a million-triangle mesh, then quit
+    //  --headless                              Draw offscreen, without a window, and write the last frame to a PPM file
+    //  --frames N                              Frames to draw headless (3 by default)
+    //  --output file.ppm                       File of the last frame headless (frame.ppm by default)
+    //  --stats file.csv                        Write times and counts of work of every frame to a CSV file on quitting
+    bool headless = false, benchmarkShaders = false, benchmarkMeshes = false;
+    int frames = 3;
+    std::string output = "frame.ppm", statsFile;
+    for (int i=1; i<argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--benchmark-math")
+        {
+            BenchmarkFastMath();
+            return 0;
+        }
+        else if (arg == "--benchmark-shaders")
+            benchmarkShaders = true;
+        else if (arg == "--benchmark-meshes")
+            benchmarkMeshes = true;
+        else if (arg == "--headless")
+            headless = true;
+        else if (arg == "--frames" && i+1 < argc)
+            frames = atoi(argv[++i]);
+        else if (arg == "--output" && i+1 < argc)
+            output = argv[++i];
+        else if (arg == "--stats" && i+1 < argc)
+            statsFile = argv[++i];
+        else
+            std::cout << "Unknown argument: " << arg << std::endl;
+    }
+
+    if (headless)
+        g_renderer.InitializeOffscreen(800, 600);
+    else
+        g_renderer.Initialize("Stickman-3D", 100, 100, 800, 600);
     g_renderer.SetClearColor(RGBColor(100, 149, 237));
+    g_renderer.SetLazyClear(LAZY_CLEAR);
+    g_renderer.SetTransparencyMode(TRANSPARENCY);
     g_renderer.SetRenderCallback(&Render);
     g_renderer.SetUpdateCallback(&Update);
     g_renderer.SetResizeCallback(&Resize);
     
-    // Add depth buffer for shadow mapping
-    g_renderer.AddDepthBuffer();
+    // Add depth buffers for shadow mapping
+    g_renderer.CreateShadowMaps(SHADOW_CASCADES, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, SHADOW_FILTERING, SHADOW_FILTER_RADIUS);
 
     // Light Direction for a directional light
     g_renderer.light.direction = vec3(-1.5, -1, -1);
@@ -177,60 +297,92 @@ int main()
     g_renderer.light.diffuse = vec3(1.0f, 1.0f, 1.0f);
     g_renderer.light.specular = vec3(1.0f, 1.0f, 1.0f);
 
+    // Local lights
+    for (int i=0; i<NUM_POINT_LIGHTS; ++i)
+    {
+        float a = 2.0f*3.1415f*(float)i/(float)NUM_POINT_LIGHTS;
+        vec3 color(0.5f + 0.5f*cosf(a), 0.5f + 0.5f*cosf(a - 2.094f), 0.5f + 0.5f*cosf(a + 2.094f));
+        g_renderer.lights.push_back(LocalLight(vec3(1.6f*cosf(a), -0.7f, 1.6f*sinf(a)), 1.0f, color*0.6f));
+    }
+    LocalLight spot(vec3(0.0f, 1.5f, 0.0f), 4.0f, vec3(0.8f, 0.7f, 0.5f));
+    spot.SetSpot(vec3(0.0f, -1.0f, 0.0f), 25.0f*3.1415f/180.0f, 18.0f*3.1415f/180.0f);
+    g_renderer.lights.push_back(spot);
+
+    if (benchmarkShaders)
+    {
+        BenchmarkShaders();
+        return 0;
+    }
+    if (benchmarkMeshes)
+    {
+        BenchmarkMeshes();
+        return 0;
+    }
+
     // Add systems
     CameraSystem cameraSystem(&g_renderer);
     g_systems.push_back(&cameraSystem);
-    MeshRenderSystem<DiffuseMaterial> diffuseRenderSystem(&g_renderer);
-    MeshRenderSystem<SpecularMaterial> specularRenderSystem(&g_renderer);
-    MeshRenderSystem<ToonMaterial> toonRenderSystem(&g_renderer);
-    g_systems.push_back(&diffuseRenderSystem);
-    g_systems.push_back(&specularRenderSystem);
+    // One system for each material variant of the scene
+    MeshRenderSystem<TexturedMaterial> texturedRenderSystem(&g_renderer, MULTI_VIEW);
+    MeshRenderSystem<ColorMaterial> colorRenderSystem(&g_renderer, MULTI_VIEW);
+    MeshRenderSystem<ShinyMaterial> shinyRenderSystem(&g_renderer, MULTI_VIEW);
+    MeshRenderSystem<GlassMaterial> glassRenderSystem(&g_renderer, MULTI_VIEW);
+    MeshRenderSystem<ToonMaterial> toonRenderSystem(&g_renderer, MULTI_VIEW);
+    g_systems.push_back(&texturedRenderSystem);
+    g_systems.push_back(&colorRenderSystem);
+    g_systems.push_back(&shinyRenderSystem);
+    g_systems.push_back(&glassRenderSystem);
     g_systems.push_back(&toonRenderSystem);
 
     // Create some entities
     g_entities.resize(10);
     
     // MeshComponent<MaterialType> is a component to store a mesh and a material
-    typedef MeshComponent<DiffuseMaterial> DiffuseMeshComponent;  // DiffuseMaterial supports diffuse color, texture and shadow on surface
-    typedef MeshComponent<SpecularMaterial> SpecularMeshComponent; // SpecularMaterial also supports a specular color and shininess
-    typedef MeshComponent<ToonMaterial> ToonMeshComponent;          // ToonMaterial only supports a color and performs toon shading
+    //  Each material uses the shader variant with only the features its surface needs
+    typedef MeshComponent<TexturedMaterial> TexturedMeshComponent;  // Diffuse color, texture and shadow on surface
+    typedef MeshComponent<ColorMaterial> ColorMeshComponent;        // Diffuse color and shadow
+    typedef MeshComponent<ShinyMaterial> ShinyMeshComponent;        // Also a specular color and shininess
+    typedef MeshComponent<GlassMaterial> GlassMeshComponent;        // Shiny, and blended with the alpha of its color
+    typedef MeshComponent<ToonMaterial> ToonMeshComponent;          // Only a color, with toon shading
 
     
     // Stickman entity, with mesh loaded from file
 #ifdef TOON_SHADING
-    auto msc = g_entities[0].AddComponent<ToonMeshComponent>(0.15f);
+    auto stickman = g_entities[0].AddComponent<ToonMeshComponent>(0.15f);
 #else
-    auto msc = g_entities[0].AddComponent<SpecularMeshComponent>(0.15f);
-    msc->material.depthBias = 0.05f;
-    msc->material.shininess = 20.0f;
-    msc->material.specularColor = vec3(1.0f, 1.0f, 1.0f);
+    auto stickman = g_entities[0].AddComponent<ShinyMeshComponent>(0.15f);
+    stickman->material.depthBias = 0.05f;
+    stickman->material.shininess = 20.0f;
+    stickman->material.specularColor = vec3(1.0f, 1.0f, 1.0f);
 #endif
-    g_stickmesh = &msc->mesh;
-    msc->mesh.LoadAnimatedFile("test1.dat");
+    // Without multi-view, the shadow pass reads and skins positions only, from a stream of their own; multi-view reads whole vertices
+    stickman->mesh = g_meshManager.LoadAnimatedFile("test1.dat", MESH_GENERATE_LODS | (MULTI_VIEW ? 0 : MESH_SPLIT_POSITIONS));
+    g_stickmesh = stickman->mesh;
+    g_stickpose = &stickman->pose;
     g_entities[0].AddComponent<TransformComponent>(vec3(0,0.07f,0), vec3(-90*3.1415f/180.0f,0,0));
     
     // Ground entity, with box mesh and green diffuse color
 #ifdef TOON_SHADING
-    auto mc = g_entities[1].AddComponent<ToonMeshComponent>();
+    auto ground = g_entities[1].AddComponent<ToonMeshComponent>();
 #else
-    auto mc = g_entities[1].AddComponent<DiffuseMeshComponent>();
-    mc->material.depthBias = 0.0f;
+    auto ground = g_entities[1].AddComponent<ColorMeshComponent>();
+    ground->material.depthBias = 0.0f;
 #endif
-    mc->material.diffuseColor = vec3(0.0f, 1.0f, 0.0f);
-    mc->mesh.LoadBox(3.0f, 0.05f, 3.0f);        // Larger than this ground size seems to give problems while shadow mapping; so use smaller pieces of ground entities instead of one large box
+    ground->material.diffuseColor = vec3(0.0f, 1.0f, 0.0f);
+    ground->mesh = g_meshManager.LoadBox(3.0f, 0.05f, 3.0f);    // Larger than this ground size seems to give problems while shadow mapping; so use smaller pieces of ground entities instead of one large box
     g_entities[1].AddComponent<TransformComponent>(vec3(0,-1.05f,0));
     
     // Cube entity, with box mesh and texture loaded from file
 #ifdef TOON_SHADING
-    mc = g_entities[2].AddComponent<ToonMeshComponent>(1.0f);
-    mc->material.diffuseColor = vec3(0.7f, 1.0f, 0.0f);
+    auto cube = g_entities[2].AddComponent<ToonMeshComponent>(1.0f);
+    cube->material.diffuseColor = vec3(0.7f, 1.0f, 0.0f);
 #else
-    mc = g_entities[2].AddComponent<DiffuseMeshComponent>(1.0f);
-    mc->material.depthBias = 0.008f;
-    mc->material.textureId = g_textureManager.AddTexture("grass_T.bmp");
+    auto cube = g_entities[2].AddComponent<TexturedMeshComponent>(1.0f);
+    cube->material.depthBias = 0.008f;
+    cube->material.textureId = g_textureManager.AddTexture("grass_T.bmp");
 #endif
-    mc->mesh.LoadBox(0.5f, 0.5f, 0.5f);
-    //mc->mesh.LoadCone(0.2f, 1.0f, 20);
+    cube->mesh = g_meshManager.LoadBox(0.5f, 0.5f, 0.5f);
+    //cube->mesh = g_meshManager.LoadCone(0.2f, 1.0f, 20);
     g_entities[2].AddComponent<TransformComponent>(vec3(2,-0.5f,-1));
 
     // A camera entity
@@ -240,29 +392,29 @@ int main()
  
     // Test transparent entity
 #ifdef TOON_SHADING
-    msc = g_entities[4].AddComponent<ToonMeshComponent>();
+    auto sphere = g_entities[4].AddComponent<ToonMeshComponent>();
 #else
-    msc = g_entities[4].AddComponent<SpecularMeshComponent>();
-    msc->material.depthBias = 0.0f;
-    msc->material.shininess = 20.0f;
-    msc->material.specularColor = vec3(1.0f, 1.0f, 1.0f);
+    auto sphere = g_entities[4].AddComponent<GlassMeshComponent>();
+    sphere->material.depthBias = 0.0f;
+    sphere->material.shininess = 20.0f;
+    sphere->material.specularColor = vec3(1.0f, 1.0f, 1.0f);
 #endif
-    msc->material.diffuseColor = vec4(1, 0, 0, 0.4f);
-    msc->mesh.LoadSphere(0.7f, 30, 30);
-    //msc->mesh.LoadBox(0.5f, 0.5f, 0.5f);
-    msc->transparent = true;
+    sphere->material.diffuseColor = vec4(1, 0, 0, 0.6f);
+    sphere->mesh = g_meshManager.LoadSphere(0.7f, 30, 30, MESH_GENERATE_LODS | MESH_PACK);   // Packed vertices halve the memory of the vertex buffers
+    //sphere->mesh = g_meshManager.LoadBox(0.5f, 0.5f, 0.5f);
+    sphere->transparent = true;
     g_entities[4].AddComponent<TransformComponent>(vec3(-1.05f, 0.0f, 0));
 
 
 
 #ifdef TOON_SHADING
-    mc = g_entities[5].AddComponent<ToonMeshComponent>(1.0f);
+    auto cone = g_entities[5].AddComponent<ToonMeshComponent>(1.0f);
 #else
-    mc = g_entities[5].AddComponent<DiffuseMeshComponent>(1.0f);
-    mc->material.depthBias = 0.008f;
+    auto cone = g_entities[5].AddComponent<ColorMeshComponent>(1.0f);
+    cone->material.depthBias = 0.008f;
 #endif
-    mc->material.diffuseColor = vec3(0.0f, 0.0f, 1.0f);
-    mc->mesh.LoadCone(0.4f, 1.0f, 20);
+    cone->material.diffuseColor = vec3(0.0f, 0.0f, 1.0f);
+    cone->mesh = g_meshManager.LoadCone(0.4f, 1.0f, 20, MESH_GENERATE_LODS);
     g_entities[5].AddComponent<TransformComponent>(vec3(2,-1.0f,0));
 
 
@@ -279,12 +431,23 @@ int main()
     // Call resize once to initialize the view and projection matrices
     Resize(g_renderer.GetWidth(), g_renderer.GetHeight());
     
-    g_renderer.MainLoop();
+    if (!statsFile.empty())
+        g_renderer.GetStatistics().StartRecording();
+    if (headless)
+    {
+        g_renderer.RunOffscreen(frames);
+        g_renderer.SaveFramebuffer(output);
+    }
+    else
+        g_renderer.MainLoop();
+    if (!statsFile.empty())
+        g_renderer.GetStatistics().WriteCSV(statsFile);
 
     // Clean up the systems
     for (size_t i=0; i<g_systems.size(); ++i)
         g_systems[i]->CleanUp();
 
+    g_meshManager.CleanUp();
     g_renderer.CleanUp();
         return 0;
 }
@@ -2,14 +2,220 @@
 #include <Mesh.h>
 #include <TextureManager.h>
 #include <shaders.h>
+#include <chrono>
 
-DiffuseShaders::Uniforms DiffuseShaders::uniforms;
-DiffuseShaders::ShadersType DiffuseShaders::shaders;
+// Names of the features of a variant, like "texture+shadow"
+static std::string FeatureNames(unsigned features)
+{
+    const char* names[] = { "texture", "shadow", "specular", "alpha", "toon", "lights" };
+    std::string result;
+    for (unsigned i=0; i<sizeof(names)/sizeof(names[0]); ++i)
+    {
+        if (!(features & (1u << i)))
+            continue;
+        if (!result.empty())
+            result += "+";
+        result += names[i];
+    }
+    return result.empty() ? "none" : result;
+}
 
-SpecularShaders::Uniforms SpecularShaders::uniforms;
-SpecularShaders::ShadersType SpecularShaders::shaders;
+// Pixel of the benchmark, with the attributes of all features
+struct BenchmarkPixel
+{
+    int x, y;
+    float w;
+    vec4 normal, texcoords, lightPosition, worldPosition;
+};
 
-CellShaders::Uniforms CellShaders::uniforms;
-CellShaders::ShadersType CellShaders::shaders;
+// Time the fragment shader of a variant alone, over the pixels
+template<unsigned FEATURES>
+static void BenchmarkVariant(const std::vector<BenchmarkPixel>& pixels, size_t textureId, const SpecularTable& specularTable)
+{
+    typedef SurfaceShaders<FEATURES> S;
+    typename S::Uniforms& uniforms = S::uniforms;
+    uniforms.depthBias = 0.007f;
+    uniforms.textureId = textureId;
+    uniforms.diffuseColor = vec4(0.8f, 0.6f, 0.4f, 0.5f);
+    uniforms.specularColor = vec3(1.0f, 1.0f, 1.0f);
+    uniforms.shininess = specularTable.GetShininess();
+#ifdef SHADER_SPECULAR_TABLE
+    uniforms.specularTable = &specularTable;
+#endif
+    typename S::Constants c(g_renderer);
 
+    // Attributes change by about a texel from pixel to pixel
+    vec4 gradientX[S::NUM_ATTRIBUTES + 1], gradientY[S::NUM_ATTRIBUTES + 1];
+    for (int i=0; i<S::NUM_ATTRIBUTES; ++i)
+    {
+        gradientX[i] = vec4(1.0f/256.0f, 0.0f, 0.0f, 0.0f);
+        gradientY[i] = vec4(0.0f, 1.0f/256.0f, 0.0f, 0.0f);
+    }
+    Point<S::NUM_ATTRIBUTES> point;
+    point.gradientX = gradientX;
+    point.gradientY = gradientY;
 
+    double best = 1e30;
+    for (int run=0; run<5; ++run)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i=0; i<pixels.size(); ++i)
+        {
+            const BenchmarkPixel& pixel = pixels[i];
+            point.pos[0] = pixel.x;
+            point.pos[1] = pixel.y;
+            point.d = 0.5f;
+            point.w = pixel.w;
+            point.attribute[S::NORMAL] = pixel.normal;
+            point.attribute[S::TEXCOORDS] = pixel.texcoords;
+            point.attribute[S::LIGHT_POSITION] = pixel.lightPosition;
+            point.attribute[S::WORLD_POSITION] = pixel.worldPosition;
+            S::FragmentShader(point, c);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        best = Min(best, std::chrono::duration<double, std::nano>(end - start).count() / (double)pixels.size());
+    }
+    std::cout << "  " << FeatureNames(FEATURES) << ": " << best << " ns per pixel" << std::endl;
+}
+
+void BenchmarkShaders()
+{
+    size_t textureId = g_textureManager.AddTexture("grass_T.bmp");
+    SpecularTable specularTable;
+    specularTable.Build(32.0f);
+
+    // Ground seen from above at an angle, lights culled for that camera
+    int width = g_renderer.GetWidth(), height = g_renderer.GetHeight();
+    g_renderer.transforms.view = LookAt(vec3(-3.0f, 2.0f, -3.0f), vec3(0.0f, -1.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+    g_renderer.transforms.proj = Perspective(60.0f*3.1415f/180.0f, float(width)/float(height), 0.01f, 100.0f);
+    g_renderer.transforms.vp = g_renderer.transforms.proj * g_renderer.transforms.view;
+    g_renderer.transforms.camPos = vec3(-3.0f, 2.0f, -3.0f);
+    g_renderer.CullLights();
+
+    // Points of the ground, where the camera sees them; attributes vary smoothly as they would over a triangle:
+    //  normals turn through the light, texture coordinates and light space positions cover the texture and the shadow map
+    const int size = 256;
+    std::vector<BenchmarkPixel> pixels;
+    for (int j=0; j<size; ++j)
+    for (int i=0; i<size; ++i)
+    {
+        float u = (float)i/(float)size, v = (float)j/(float)size;
+        vec3 world(3.0f*u - 1.5f, -1.0f, 3.0f*v - 1.5f);
+        vec4 p = g_renderer.transforms.vp * vec4(world);
+        BenchmarkPixel pixel;
+        pixel.x = Min(Max(int((0.5f*p.x/p.w + 0.5f)*(float)width), 0), width-1);
+        pixel.y = Min(Max(int((-0.5f*p.y/p.w + 0.5f)*(float)height), 0), height-1);
+        pixel.w = 1.0f/p.w;
+        pixel.normal = vec4(u - 0.5f, 1.0f, v - 0.5f, 0.0f);
+        pixel.texcoords = vec4(u, v, 0.0f, 0.0f);
+        pixel.lightPosition = vec4(u, v, 0.5f, 0.0f);
+        pixel.worldPosition = vec4(world);
+        pixels.push_back(pixel);
+    }
+
+    std::cout << "Fragment shaders, " << g_renderer.lightGrid.GetNumLights() << " local lights, "
+              << double(g_renderer.lightGrid.GetNumIndices())/double(g_renderer.lightGrid.GetNumClusters()) << " per cluster" << std::endl;
+    BenchmarkVariant<0>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_TOON>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_TEXTURE>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_SHADOW>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_SPECULAR>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_ALPHA>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_LIGHTS>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_TEXTURE | SHADER_SHADOW>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_SHADOW | SHADER_SPECULAR>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_SHADOW | SHADER_SPECULAR | SHADER_ALPHA>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_TEXTURE | SHADER_SHADOW | SHADER_ALPHA>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_TEXTURE | SHADER_SHADOW | SHADER_SPECULAR | SHADER_ALPHA>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_SHADOW | SHADER_SPECULAR | SHADER_LIGHTS>(pixels, textureId, specularTable);
+    BenchmarkVariant<SHADER_TEXTURE | SHADER_SHADOW | SHADER_SPECULAR | SHADER_ALPHA | SHADER_LIGHTS>(pixels, textureId, specularTable);
+}
+
+// Grid of size by size vertices over a square facing the camera of BenchmarkMeshes
+static void BenchmarkGrid(int size, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+{
+    vertices.resize(size_t(size)*size_t(size));
+    for (int j=0; j<size; ++j)
+    for (int i=0; i<size; ++i)
+    {
+        float u = (float)i/(float)(size-1), v = (float)j/(float)(size-1);
+        Vertex& vertex = vertices[size_t(j)*size_t(size) + size_t(i)];
+        vertex.position = vec3(2.0f*u - 1.0f, 2.0f*v - 1.0f, 0.0f);
+        vertex.normal = vec3(0.0f, 0.0f, 1.0f);
+        vertex.texcoords = vec2(u, v);
+    }
+    indices.clear();
+    indices.reserve(size_t(size-1)*size_t(size-1)*6);
+    for (int j=0; j<size-1; ++j)
+    for (int i=0; i<size-1; ++i)
+    {
+        uint32_t k = uint32_t(j*size + i);
+        indices.push_back(k);
+        indices.push_back(k + 1);
+        indices.push_back(k + size + 1);
+        indices.push_back(k);
+        indices.push_back(k + size + 1);
+        indices.push_back(k + size);
+    }
+}
+
+// Best of 5 runs of draw, in nanoseconds per triangle, starting each from a cleared frame
+template<class DrawFunction>
+static double TimeTriangles(DrawFunction draw, size_t numTriangles)
+{
+    double best = 1e30;
+    for (int run=0; run<5; ++run)
+    {
+        g_renderer.ClearColorAndDepth();
+        auto start = std::chrono::high_resolution_clock::now();
+        draw();
+        auto end = std::chrono::high_resolution_clock::now();
+        best = Min(best, std::chrono::duration<double, std::nano>(end - start).count() / (double)numTriangles);
+    }
+    return best;
+}
+
+void BenchmarkMeshes()
+{
+    typedef SurfaceShaders<0> S;
+    S::uniforms.diffuseColor = vec4(0.8f, 0.6f, 0.4f, 1.0f);
+    S::uniforms.specularColor = vec3(1.0f, 1.0f, 1.0f);
+
+    int width = g_renderer.GetWidth(), height = g_renderer.GetHeight();
+    g_renderer.SetLazyClear(false);     // Clears are not part of what is timed
+    g_renderer.UseDepthBuffer(0);
+    g_renderer.transforms.view = LookAt(vec3(0.0f, 0.0f, 3.0f), vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+    g_renderer.transforms.proj = Perspective(60.0f*3.1415f/180.0f, float(width)/float(height), 0.01f, 100.0f);
+    g_renderer.transforms.vp = g_renderer.transforms.proj * g_renderer.transforms.view;
+    g_renderer.transforms.camPos = vec3(0.0f, 0.0f, 3.0f);
+    g_renderer.transforms.model = mat4();
+    g_renderer.transforms.mvp = g_renderer.transforms.vp;
+    g_renderer.CullLights();
+
+    // The same triangles drawn with either index width: as many vertices as 16-bit indices address,
+    //  drawn enough times for about a million triangles
+    const int size = 256, draws = 8;
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices32;
+    BenchmarkGrid(size, vertices, indices32);
+    std::vector<uint16_t> indices16(indices32.begin(), indices32.end());
+    size_t numTriangles = draws * indices32.size()/3;
+    std::cout << "Grid of " << vertices.size() << " vertices drawn " << draws << " times, " << numTriangles << " triangles" << std::endl;
+    std::cout << "  16-bit indices: " << TimeTriangles([&]() {
+        for (int i=0; i<draws; ++i)
+            S::shaders.DrawTriangles(vertices, indices16);
+    }, numTriangles) << " ns per triangle" << std::endl;
+    std::cout << "  32-bit indices: " << TimeTriangles([&]() {
+        for (int i=0; i<draws; ++i)
+            S::shaders.DrawTriangles(vertices, indices32);
+    }, numTriangles) << " ns per triangle" << std::endl;
+
+    // A single mesh of about a million triangles, too many vertices for 16-bit indices, drawn as the scene draws meshes
+    Mesh sphere;
+    sphere.LoadSphere(1.0f, 708, 708);
+    numTriangles = sphere.GetNumTriangles();
+    double time = TimeTriangles([&]() { sphere.Draw(S::shaders); }, numTriangles);
+    std::cout << "Sphere of " << sphere.GetNumVertices() << " vertices, " << numTriangles << " triangles, "
+              << sphere.GetIndexSize() << "-byte indices: " << time*(double)numTriangles*1e-6 << " ms per draw, "
+              << time << " ns per triangle" << std::endl;
+}